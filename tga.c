@@ -22,10 +22,16 @@
 ===============================================================================
 */
 
+#if !defined(_WIN64) && !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "tga.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
 
 #define TGA_TYPE_NO_IMAGE       0
 #define TGA_TYPE_MAPPED         1
@@ -38,1058 +44,4687 @@
 #if defined(_WIN64) || defined(_WIN32)
 #include <locale.h>
 #include "wcharconv/wcharconv.h"
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
 #endif
 
-static void swap_byte(byte *a, byte *b)
-{
-    byte temp = *a;
-    *a = *b;
-    *b = temp;
-}
+// Static tracepoints for perf and bpftrace under the libtga provider, each a single nop until a tracer
+// attaches. Built in wherever <sys/sdt.h> is available, unless TGA_NO_SDT is defined.
+#if !defined(TGA_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TGA_SDT
+#endif
+#endif
 
-static void rgb_to_bgr(const byte *origin, byte *dest, int channels)
-{
-    // Do not reorder the following code below as the order is very important
+#ifdef TGA_SDT
+#define TGA_PROBE1(name, a)                     DTRACE_PROBE1(libtga, name, a)
+#define TGA_PROBE2(name, a, b)                  DTRACE_PROBE2(libtga, name, a, b)
+#define TGA_PROBE3(name, a, b, c)               DTRACE_PROBE3(libtga, name, a, b, c)
+#define TGA_PROBE4(name, a, b, c, d)            DTRACE_PROBE4(libtga, name, a, b, c, d)
+#define TGA_PROBE5(name, a, b, c, d, e)         DTRACE_PROBE5(libtga, name, a, b, c, d, e)
+#else
+#define TGA_PROBE1(name, a)                     ((void)0)
+#define TGA_PROBE2(name, a, b)                  ((void)0)
+#define TGA_PROBE3(name, a, b, c)               ((void)0)
+#define TGA_PROBE4(name, a, b, c, d)            ((void)0)
+#define TGA_PROBE5(name, a, b, c, d, e)         ((void)0)
+#endif
 
-    // Alpha
-    if (channels == 4)
-        dest[3] = origin[3];
+// Size of the buffers used when an image is streamed instead of being processed in one piece
+#define TGA_STREAM_CHUNK        65536
 
-    dest[2] = origin[0];    // B
-    dest[1] = origin[1];    // G
-    dest[0] = origin[2];    // R
-}
+#if defined(_WIN64) || defined(_WIN32)
+typedef SRWLOCK tga_mutex;
+typedef CONDITION_VARIABLE tga_cond;
 
-static void rgb_to_rgb16(const byte *data, word *pixel, int channels)
-{
-    *pixel = 0;
-    *pixel |= (data[0] >> 3) << 10;     // R
-    *pixel |= (data[1] >> 3) << 5;      // G
-    *pixel |= (data[2] >> 3);           // B
+#define TGA_MUTEX_INIT          SRWLOCK_INIT
+#define TGA_COND_INIT           CONDITION_VARIABLE_INIT
 
-    // Alpha
-    if (channels == 4)
-        *pixel |= data[3] ? 1 << 15 : 0 << 15;
-    else
-        *pixel |= 1 << 15;
-}
+static void init_mutex(tga_mutex *mutex) { InitializeSRWLock(mutex); }
+static void destroy_mutex(tga_mutex *mutex) { (void)mutex; }
+static void lock_mutex(tga_mutex *mutex) { AcquireSRWLockExclusive(mutex); }
+static void unlock_mutex(tga_mutex *mutex) { ReleaseSRWLockExclusive(mutex); }
+static void wait_cond(tga_cond *cond, tga_mutex *mutex) { SleepConditionVariableSRW(cond, mutex, INFINITE, 0); }
+static void broadcast_cond(tga_cond *cond) { WakeAllConditionVariable(cond); }
 
-static void rgb16_to_rgb(const word *pixel, byte *data, int channels)
+typedef struct
 {
-    data[0] = ((*pixel >> 10) & 0x1f) << 3;      // R
-    data[1] = ((*pixel >> 5) & 0x1f) << 3;       // G
-    data[2] = (*pixel & 0x1f) << 3;              // B
+    HANDLE handle;
+    void *(*func)(void *);
+    void *arg;
+} tga_thread;
 
-    // Alpha
-    if (channels == 4)
-        data[3] = *pixel & 0x8000 ? 255 : 0;
+static DWORD WINAPI thread_entry(LPVOID param)
+{
+    tga_thread *thread = (tga_thread *)param;
+    thread->func(thread->arg);
+    return 0;
 }
 
-static void rgb_to_bw(const byte *data, byte *pixel, int channels, int pixel_size)
+static bool start_thread(tga_thread *thread, void *(*func)(void *), void *arg)
 {
-    pixel[0] = (data[0] + data[1] + data[2]) / 3;
+    thread->func = func;
+    thread->arg = arg;
+    thread->handle = CreateThread(NULL, 0, thread_entry, thread, 0, NULL);
+    return thread->handle != NULL;
+}
 
-    // Alpha
-    if (channels == 4)
-        pixel[1] = data[3];
-    else if (pixel_size == 2)
-        pixel[1] = 255;
+static void join_thread(tga_thread *thread)
+{
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
 }
 
-static void bw_to_rgb(const byte *pixel, byte *data, int channels)
+static int count_cores(void)
 {
-    // Do not reorder the following code below as the order is very important
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
 
-    // Alpha
-    if (channels == 4)
-        data[3] = pixel[1];
+#define TGA_THREAD_LOCAL        __declspec(thread)
 
-    // Colors
-    data[2] = pixel[0];
-    data[1] = pixel[0];
-    data[0] = pixel[0];
+static uint64_t now_ns(void)
+{
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000000 + counter.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
 }
+#else
+typedef pthread_mutex_t tga_mutex;
+typedef pthread_cond_t tga_cond;
 
-void flip_tga_horizontally(tga_image *tga)
-{
-    if (!tga || !tga->data)
-        return;
+#define TGA_MUTEX_INIT          PTHREAD_MUTEX_INITIALIZER
+#define TGA_COND_INIT           PTHREAD_COND_INITIALIZER
 
-    for (unsigned int i = 0; i < tga->height; i++)
-    {
-        for (unsigned int j = 0; j < tga->width / 2; j++)
-        {
-            for (unsigned int k = 0; k < tga->channels; k++)
-            {
-                swap_byte(&tga->data[((i * tga->width) + j) * tga->channels + k],
-                          &tga->data[((i * tga->width) + (tga->width - j - 1)) * tga->channels + k]);
-            }
-        }
-    }
-}
+static void init_mutex(tga_mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+static void destroy_mutex(tga_mutex *mutex) { pthread_mutex_destroy(mutex); }
+static void lock_mutex(tga_mutex *mutex) { pthread_mutex_lock(mutex); }
+static void unlock_mutex(tga_mutex *mutex) { pthread_mutex_unlock(mutex); }
+static void wait_cond(tga_cond *cond, tga_mutex *mutex) { pthread_cond_wait(cond, mutex); }
+static void broadcast_cond(tga_cond *cond) { pthread_cond_broadcast(cond); }
 
-void flip_tga_vertically(tga_image *tga)
-{
-    if (!tga || !tga->data)
-        return;
+typedef pthread_t tga_thread;
 
-    for (unsigned int i = 0; i < tga->width * tga->channels; i++)
-    {
-        for (unsigned int j = 0; j < tga->height / 2; j++)
-        {
-            swap_byte(&tga->data[i + tga->width * tga->channels * j],
-                      &tga->data[i + tga->width * tga->channels * (tga->height - j - 1)]);
-        }
-    }
-}
+static bool start_thread(tga_thread *thread, void *(*func)(void *), void *arg) { return pthread_create(thread, NULL, func, arg) == 0; }
+static void join_thread(tga_thread *thread) { pthread_join(*thread, NULL); }
 
-static void *fopen_wrapper(const char *filename, char const *mode, const void *stream)
+static int count_cores(void)
 {
-    return fopen(filename, mode);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
 }
 
-bool load_tga(const char *filename, tga_image *tga)
-{
-    tga_func_def func_def;
-
-    func_def.open_file = fopen_wrapper;
-    func_def.read_file = fread;
-    func_def.seek_file = fseek;
-    func_def.close_file = fclose;
+#define TGA_THREAD_LOCAL        __thread
 
-    return load_tga_ext(filename, tga, &func_def);
+static uint64_t now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
 }
+#endif
 
-static bool read_mapped(tga_image *tga, const byte **color_data, const tga_func_def *func_def)
+// Runs func on the given number of threads, the calling one included, and waits for all of them.
+// Fewer threads are used when some cannot be started.
+static void run_parallel(int threads, void *(*func)(void *), void *arg)
 {
-    int pixels = tga->width * tga->height;
+    tga_thread *pool = threads > 1 ? (tga_thread *)malloc((threads - 1) * sizeof(tga_thread)) : NULL;
+    int started = 0;
 
-    tga->data = (byte *)malloc(pixels * tga->channels);
-    if (!tga->data)
-        return false;
+    while (pool && started < threads - 1 && start_thread(&pool[started], func, arg))
+        started++;
 
-    if (func_def->read_file(tga->data, sizeof(byte), pixels, func_def->file) != pixels)
-        return false;
+    func(arg);
 
-    for (int i = pixels - 1; i >= 0; i--)
-        rgb_to_bgr(&(*color_data)[tga->data[i] * tga->channels], &tga->data[i * tga->channels], tga->channels);
+    for (int i = 0; i < started; i++)
+        join_thread(&pool[i]);
 
-    return true;
+    free(pool);
 }
 
-static bool read_rgb(tga_image *tga, const tga_func_def *func_def)
-{
-    int pixels = tga->width * tga->height;
-
-    tga->data = (byte *)malloc(pixels * tga->channels);
-    if (!tga->data)
-        return false;
-
-    if (func_def->read_file(tga->data, sizeof(byte), pixels * tga->channels, func_def->file) != (pixels * tga->channels))
-        return false;
+// Metrics of the load or save running on this thread, set by load_tga_metrics and save_tga_metrics
+static TGA_THREAD_LOCAL tga_metrics *active_metrics = NULL;
 
-    for (unsigned int y = 0; y < tga->height; y++)
-    {
-        byte *pixel = &(tga->data[tga->width * tga->channels * y]);
+// Time for a stage of a measured load or save, nothing is timed otherwise
+static uint64_t stamp(const tga_metrics *metrics)
+{
+    return metrics ? now_ns() : 0;
+}
 
-        for (unsigned int i = 0; i < tga->width * tga->channels; i += tga->channels)
-            swap_byte(&pixel[i], &pixel[i + 2]);
-    }
+static void *alloc_bytes(size_t size)
+{
+    if (active_metrics)
+        active_metrics->allocations++;
 
-    return true;
+    return malloc(size);
 }
 
-static bool read_rgb16(tga_image *tga, const tga_func_def *func_def)
+static void *realloc_bytes(void *data, size_t size)
 {
-    int pixels = tga->width * tga->height;
+    if (active_metrics)
+        active_metrics->allocations++;
 
-    tga->data = (byte *)malloc(pixels * tga->channels);
-    if (!tga->data)
-        return false;
+    return realloc(data, size);
+}
 
-    if (func_def->read_file(tga->data, sizeof(word), pixels, func_def->file) != pixels)
-        return false;
+typedef enum
+{
+    TGA_ADMIT_FULL,         // Enough memory to process the image in one piece
+    TGA_ADMIT_STREAM,       // Only enough memory to stream it
+    TGA_ADMIT_REJECTED
+} tga_admission;
 
-    for (int i = pixels - 1; i >= 0; i--)
-        rgb16_to_rgb((word *)&tga->data[i * sizeof(word)], &tga->data[i * tga->channels], tga->channels);
+static struct
+{
+    tga_mutex lock;
+    tga_cond released;
+    tga_budget_policy policy;
+    tga_budget_metrics metrics;
+} budget = { TGA_MUTEX_INIT, TGA_COND_INIT, TGA_BUDGET_WAIT, { 0 } };
 
-    return true;
+void tga_set_budget(size_t limit, tga_budget_policy policy)
+{
+    lock_mutex(&budget.lock);
+    budget.metrics.limit = limit;
+    budget.policy = policy;
+    broadcast_cond(&budget.released);
+    unlock_mutex(&budget.lock);
 }
 
-static bool read_bw(tga_image *tga, const tga_func_def *func_def)
+void tga_get_budget_metrics(tga_budget_metrics *metrics)
 {
-    int bytes = tga->channels == 4 ? sizeof(word) : sizeof(byte);
-    int pixels = tga->width * tga->height;
-
-    tga->data = (byte *)malloc(pixels * tga->channels);
-    if (!tga->data)
-        return false;
-
-    if (func_def->read_file(tga->data, sizeof(byte), pixels * bytes, func_def->file) != (pixels * bytes))
-        return false;
+    if (!metrics)
+        return;
 
-    for (int i = pixels - 1; i >= 0; i--)
-        bw_to_rgb(&tga->data[i * bytes], &tga->data[i * tga->channels], tga->channels);
+    lock_mutex(&budget.lock);
+    *metrics = budget.metrics;
+    unlock_mutex(&budget.lock);
+}
 
-    return true;
+static bool fits_budget(size_t size)
+{
+    return size <= budget.metrics.limit && budget.metrics.used <= budget.metrics.limit - size;
 }
 
-static bool read_mapped_rle(tga_image *tga, const byte **color_data, const tga_func_def *func_def)
+// Reserves the projected peak memory of a load or a save, full is the peak of processing
+// the image in one piece and stream is the peak of streaming it
+static tga_admission reserve_budget(size_t full, size_t stream, size_t *reserved)
 {
-    int pixels = tga->width * tga->height;
-    int data_size = pixels * tga->channels;
-    int rle_size = pixels * sizeof(byte) + pixels;
-    int index_to_temp = data_size;
+    tga_admission admission = TGA_ADMIT_FULL;
+    bool waited = false;
 
-    tga->data = (byte *)malloc(data_size + rle_size);
-    if (!tga->data)
-        return false;
+    *reserved = 0;
 
-    if (!func_def->read_file(&tga->data[index_to_temp], sizeof(byte), rle_size, func_def->file))
-        return false;
+    lock_mutex(&budget.lock);
 
-    for (unsigned int i = 0; i < tga->width * tga->height;)
+    // No budget
+    if (!budget.metrics.limit)
     {
-        byte rle_id = tga->data[index_to_temp];
-        index_to_temp++;
+        unlock_mutex(&budget.lock);
+        return TGA_ADMIT_FULL;
+    }
 
-        // Run-length packet
-        if (rle_id & 0x80)
+    if (!fits_budget(full))
+    {
+        if (budget.policy == TGA_BUDGET_FAIL || stream > budget.metrics.limit)
         {
-            rle_id -= 127;
-
-            while (rle_id)
-            {
-                rgb_to_bgr(&(*color_data)[tga->data[index_to_temp] * tga->channels], &tga->data[i * tga->channels], tga->channels);
-
-                i++;
-                rle_id--;
-            }
-
-            index_to_temp += sizeof(byte);
+            admission = TGA_ADMIT_REJECTED;
         }
-        // Raw packet
         else
         {
-            rle_id++;
+            // Images that could never fit whole are streamed under any policy
+            if (budget.policy == TGA_BUDGET_STREAM || full > budget.metrics.limit)
+                admission = TGA_ADMIT_STREAM;
+
+            size_t size = admission == TGA_ADMIT_STREAM ? stream : full;
 
-            for (int j = 0; j < rle_id; j++)
+            budget.metrics.waiting++;
+
+            while (budget.metrics.limit && !fits_budget(size))
             {
-                rgb_to_bgr(&(*color_data)[tga->data[index_to_temp] * tga->channels], &tga->data[(i + j) * tga->channels], tga->channels);
-                index_to_temp += sizeof(byte);
+                waited = true;
+                wait_cond(&budget.released, &budget.lock);
             }
 
-            i += rle_id;
+            budget.metrics.waiting--;
         }
     }
 
-    char *tmp = realloc(tga->data, data_size);
-    if (tmp)
+    if (admission == TGA_ADMIT_REJECTED)
     {
-        tga->data = tmp;
+        budget.metrics.rejected++;
     }
+    else
+    {
+        *reserved = admission == TGA_ADMIT_STREAM ? stream : full;
+        budget.metrics.used += *reserved;
+        budget.metrics.admitted++;
 
-    return true;
-}
-
-static bool read_rgb_rle(tga_image *tga, const tga_func_def *func_def)
-{
-    int data_size = tga->width * tga->height * tga->channels;
-    int rle_size = data_size + tga->width * tga->height;
-    int index_to_temp = data_size;
+        if (budget.metrics.used > budget.metrics.peak)
+            budget.metrics.peak = budget.metrics.used;
 
-    tga->data = (byte *)malloc(data_size + rle_size);
-    if (!tga->data)
-        return false;
+        if (admission == TGA_ADMIT_STREAM)
+            budget.metrics.streamed++;
 
-    if (!func_def->read_file(&tga->data[index_to_temp], sizeof(byte), rle_size, func_def->file))
-        return false;
+        if (waited)
+            budget.metrics.waited++;
+    }
 
-    for (unsigned int i = 0; i < tga->width * tga->height;)
-    {
-        byte rle_id = tga->data[index_to_temp];
-        index_to_temp++;
+    unlock_mutex(&budget.lock);
+    return admission;
+}
 
-        // Run-length packet
-        if (rle_id & 0x80)
-        {
-            rle_id -= 127;
+static void release_budget(size_t reserved)
+{
+    if (!reserved)
+        return;
 
-            while (rle_id)
-            {
-                rgb_to_bgr(&tga->data[index_to_temp], &tga->data[i * tga->channels], tga->channels);
+    lock_mutex(&budget.lock);
+    budget.metrics.used -= reserved;
+    broadcast_cond(&budget.released);
+    unlock_mutex(&budget.lock);
+}
 
-                i++;
-                rle_id--;
-            }
+// Pixel buffer backed by a temporary file instead of the heap
+typedef struct tga_spill_block
+{
+    void *data;
+    size_t size;
+#if defined(_WIN64) || defined(_WIN32)
+    HANDLE mapping;
+#endif
+    struct tga_spill_block *next;
+} tga_spill_block;
 
-            index_to_temp += tga->channels;
-        }
-        // Raw packet
-        else
-        {
-            rle_id++;
+static struct
+{
+    tga_mutex lock;
+    char directory[1024];
+    size_t threshold;
+    tga_spill_block *blocks;
+} spill = { TGA_MUTEX_INIT, "", 0, NULL };
 
-            for (unsigned int j = 0; j < rle_id * tga->channels; j++)
-            {
-                tga->data[i * tga->channels + j] = tga->data[index_to_temp];
-                index_to_temp++;
-            }
+bool tga_set_spill(const char *directory, size_t threshold)
+{
+    if (directory && strlen(directory) >= sizeof(spill.directory))
+        return false;
 
-            while (rle_id)
-            {
-                swap_byte(&tga->data[i * tga->channels], &tga->data[i * tga->channels + 2]);
+    lock_mutex(&spill.lock);
+    strcpy(spill.directory, directory ? directory : "");
+    spill.threshold = threshold;
+    unlock_mutex(&spill.lock);
 
-                i++;
-                rle_id--;
-            }
-        }
-    }
+    return true;
+}
 
-    char *tmp = realloc(tga->data, data_size);
-    if (tmp)
-    {
-        tga->data = tmp;
-    }
+static bool spills(size_t size)
+{
+    lock_mutex(&spill.lock);
+    bool result = spill.threshold && size >= spill.threshold;
+    unlock_mutex(&spill.lock);
 
-    return true;
+    return result;
 }
 
-static bool read_rgb16_rle(tga_image *tga, const tga_func_def *func_def)
+static tga_spill_block *find_spill(const void *data)
 {
-    int pixels = tga->width * tga->height;
-    int data_size = pixels * tga->channels;
-    int rle_size = pixels * sizeof(word) + pixels;
-    int index_to_temp = data_size;
+    tga_spill_block *block = spill.blocks;
 
-    tga->data = (byte *)malloc(data_size + rle_size);
-    if (!tga->data)
-        return false;
+    while (block && block->data != data)
+        block = block->next;
 
-    if (!func_def->read_file(&tga->data[index_to_temp], sizeof(byte), rle_size, func_def->file))
+    return block;
+}
+
+static bool is_spilled(const void *data)
+{
+    if (!data)
         return false;
 
-    for (unsigned int i = 0; i < tga->width * tga->height;)
-    {
-        byte rle_id = tga->data[index_to_temp];
-        index_to_temp++;
+    lock_mutex(&spill.lock);
+    bool result = find_spill(data) != NULL;
+    unlock_mutex(&spill.lock);
 
-        // Run-length packet
-        if (rle_id & 0x80)
-        {
-            rle_id -= 127;
+    return result;
+}
 
-            while (rle_id)
-            {
-                rgb16_to_rgb((word *)&tga->data[index_to_temp], &tga->data[i * tga->channels], tga->channels);
+// Maps a deleted temporary file, so that the pages are written back to disk under memory pressure instead of swapped
+static byte *map_spill(size_t size)
+{
+    tga_spill_block *block = (tga_spill_block *)malloc(sizeof(tga_spill_block));
+    if (!block)
+        return NULL;
 
-                i++;
-                rle_id--;
-            }
+    char directory[1024];
 
-            index_to_temp += sizeof(word);
-        }
-        // Raw packet
-        else
-        {
-            rle_id++;
+    lock_mutex(&spill.lock);
+    strcpy(directory, spill.directory);
+    unlock_mutex(&spill.lock);
 
-            for (int j = rle_id - 1; j >= 0; j--)
-            {
-                rgb16_to_rgb((word *)&tga->data[index_to_temp], &tga->data[(i + j) * tga->channels], tga->channels);
-                index_to_temp += sizeof(word);
-            }
+#if defined(_WIN64) || defined(_WIN32)
+    char path[MAX_PATH];
 
-            i += rle_id;
-        }
+    if (!directory[0] && !GetTempPathA(sizeof(directory), directory))
+    {
+        free(block);
+        return NULL;
     }
 
-    char *tmp = realloc(tga->data, data_size);
-    if (tmp)
+    if (!GetTempFileNameA(directory, "tga", 0, path))
     {
-        tga->data = tmp;
+        free(block);
+        return NULL;
     }
 
-    return true;
-}
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        DeleteFileA(path);
+        free(block);
+        return NULL;
+    }
 
-static bool read_bw_rle(tga_image *tga, const tga_func_def *func_def)
-{
-    int bytes = tga->channels == 4 ? sizeof(word) : sizeof(byte);
-    int pixels = tga->width * tga->height;
-    int data_size = pixels * tga->channels;
-    int rle_size = pixels * bytes + pixels;
-    int index_to_temp = data_size;
+    // The mapping keeps the file open until it is closed
+    block->mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    CloseHandle(file);
 
-    tga->data = (byte *)malloc(data_size + rle_size);
-    if (!tga->data)
-        return false;
+    if (!block->mapping)
+    {
+        free(block);
+        return NULL;
+    }
 
-    if (!func_def->read_file(&tga->data[index_to_temp], sizeof(byte), rle_size, func_def->file))
-        return false;
+    block->data = MapViewOfFile(block->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!block->data)
+    {
+        CloseHandle(block->mapping);
+        free(block);
+        return NULL;
+    }
+#else
+    char path[1024 + 16];
 
-    for (unsigned int i = 0; i < tga->width * tga->height;)
+    if (!directory[0])
     {
-        byte rle_id = tga->data[index_to_temp];
-        index_to_temp++;
+        const char *temp = getenv("TMPDIR");
+        snprintf(directory, sizeof(directory), "%s", temp && temp[0] ? temp : "/tmp");
+    }
 
-        // Run-length packet
-        if (rle_id & 0x80)
-        {
-            rle_id -= 127;
+    snprintf(path, sizeof(path), "%s/libtga-XXXXXX", directory);
 
-            while (rle_id)
-            {
-                bw_to_rgb(&tga->data[index_to_temp], &tga->data[i * tga->channels], tga->channels);
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        free(block);
+        return NULL;
+    }
 
-                i++;
-                rle_id--;
-            }
+    unlink(path);
 
-            index_to_temp += bytes;
-        }
-        // Raw packet
-        else
-        {
-            rle_id++;
+    // Reserve the disk space up front, a full disk would otherwise fault on first touch of a page
+    if (posix_fallocate(fd, 0, (off_t)size) != 0)
+    {
+        close(fd);
+        free(block);
+        return NULL;
+    }
 
-            for (int j = 0; j < rle_id; j++)
-            {
-                bw_to_rgb(&tga->data[index_to_temp], &tga->data[(i + j) * tga->channels], tga->channels);
-                index_to_temp += bytes;
-            }
+    block->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
 
-            i += rle_id;
-        }
+    if (block->data == MAP_FAILED)
+    {
+        free(block);
+        return NULL;
     }
+#endif
 
-    char *tmp = realloc(tga->data, data_size);
-    if (tmp)
+    block->size = size;
+
+    lock_mutex(&spill.lock);
+    block->next = spill.blocks;
+    spill.blocks = block;
+    unlock_mutex(&spill.lock);
+
+    return (byte *)block->data;
+}
+
+// Allocates a pixel buffer, on the heap or spilled to disk when it reaches the spill threshold
+static byte *alloc_pixels(size_t size)
+{
+    if (spills(size))
     {
-        tga->data = tmp;
+        if (active_metrics)
+            active_metrics->allocations++;
+
+        return map_spill(size);
     }
 
-    return true;
+    return (byte *)alloc_bytes(size);
 }
 
-bool load_tga_ext(const char *filename, tga_image *tga, tga_func_def *func_def)
+static void free_pixels(void *data)
 {
-    if (!tga || !filename || !func_def)
-        return false;
+    if (!data)
+        return;
 
-    byte header[18];
+    lock_mutex(&spill.lock);
 
-    byte id_length = 0;
-    byte color_map_type = 0;
-    byte image_type = 0;
-    word x_origin = 0;
-    word y_origin = 0;
-    word width = 0;
-    word height = 0;
-    byte bits_per_pixel = 0;
+    tga_spill_block **link = &spill.blocks;
 
-    byte *color_data = NULL;
-    int color_channels = 0;
-    bool success = false;
+    while (*link && (*link)->data != data)
+        link = &(*link)->next;
 
-    func_def->file = func_def->open_file(filename, "rb", func_def->file);
-    if (!func_def->file)
-        return false;
+    tga_spill_block *block = *link;
 
-    if (!func_def->read_file(&header, sizeof(header), 1, func_def->file))
-        return false;
+    if (block)
+        *link = block->next;
 
-    image_type = header[2];
+    unlock_mutex(&spill.lock);
 
-    if (image_type == TGA_TYPE_NO_IMAGE)
+    if (!block)
     {
-        func_def->close_file(func_def->file);
-        return false;
+        free(data);
+        return;
     }
 
-    id_length = header[0];
-    color_map_type = header[1];
-    x_origin = (word)header[9] << 8 | (word)header[8];
-    y_origin = (word)header[11] << 8 | (word)header[10];
-    width = (word)header[13] << 8 | (word)header[12];
-    height = (word)header[15] << 8 | (word)header[14];
-    bits_per_pixel = header[16];
+#if defined(_WIN64) || defined(_WIN32)
+    UnmapViewOfFile(block->data);
+    CloseHandle(block->mapping);
+#else
+    munmap(block->data, block->size);
+#endif
 
-    // Skip optional image ID field
-    if (id_length)
-        func_def->seek_file(func_def->file, id_length, SEEK_CUR);
+    free(block);
+}
 
-    // Load color map data if exists
-    if (color_map_type)
-    {
-        word first_entry_index = (word)header[4] << 8 | (word)header[3];
-        word color_map_length = (word)header[6] << 8 | (word)header[5];
-        byte color_map_entry_size = header[7];
-        color_channels = (color_map_entry_size / 8);
-        int palette_size = color_map_length * color_channels;
+static byte *realloc_pixels(byte *data, size_t old_size, size_t size)
+{
+    if (!is_spilled(data) && !spills(size))
+        return (byte *)realloc_bytes(data, size);
 
-        color_data = (byte *)malloc(color_map_length * color_channels);
-        if (!color_data)
-        {
-            func_def->close_file(func_def->file);
-            return false;
-        }
+    byte *resized = alloc_pixels(size);
+    if (!resized)
+        return NULL;
 
-        if (func_def->read_file(color_data, sizeof(byte), palette_size, func_def->file) != palette_size)
-        {
-            free(color_data);
-            func_def->close_file(func_def->file);
-            return false;
-        }
-    }
+    memcpy(resized, data, old_size < size ? old_size : size);
+    free_pixels(data);
 
-    tga->channels = 0;
-    tga->width = width;
-    tga->height = height;
+    return resized;
+}
 
-    if (image_type == TGA_TYPE_MAPPED || image_type == TGA_TYPE_MAPPED_RLE)
-    {
-        tga->channels = color_channels;
-    }
-    else if (image_type == TGA_TYPE_RGB || image_type == TGA_TYPE_RGB_RLE)
-    {
-        if (bits_per_pixel == 32 || bits_per_pixel == 16)
-            tga->channels = 4;
-        else
-            tga->channels = 3;
-    }
-    else if (image_type == TGA_TYPE_BW || image_type == TGA_TYPE_BW_RLE)
-    {
-        if (bits_per_pixel == 16)
-            tga->channels = 4;
-        else
-            tga->channels = 3;
-    }
+static void swap_byte(byte *a, byte *b)
+{
+    byte temp = *a;
+    *a = *b;
+    *b = temp;
+}
 
-    // Color-mapped image
-    if (image_type == TGA_TYPE_MAPPED)
-    {
-        if (bits_per_pixel == 8)
-            success = read_mapped(tga, &color_data, func_def);
-    }
-    // True-color image
-    else if (image_type == TGA_TYPE_RGB)
-    {
-        if (bits_per_pixel == 24 || bits_per_pixel == 32)
-            success = read_rgb(tga, func_def);
-        else if (bits_per_pixel == 15 || bits_per_pixel == 16)
-            success = read_rgb16(tga, func_def);
-    }
-    // Black and white image
-    else if (image_type == TGA_TYPE_BW)
-    {
-        if (bits_per_pixel == 16 || bits_per_pixel == 8)
-            success = read_bw(tga, func_def);
-    }
-    // Run-length encoded color-mapped image
-    else if (image_type == TGA_TYPE_MAPPED_RLE)
-    {
-        if (bits_per_pixel == 8)
-            success = read_mapped_rle(tga, &color_data, func_def);
-    }
-    // Run-length encoded true-color image
-    else if (image_type == TGA_TYPE_RGB_RLE)
-    {
-        if (bits_per_pixel == 24 || bits_per_pixel == 32)
-            success = read_rgb_rle(tga, func_def);
-        else if (bits_per_pixel == 15 || bits_per_pixel == 16)
-            success = read_rgb16_rle(tga, func_def);
-    }
-    // Run-length encoded black and white image
-    else if (image_type == TGA_TYPE_BW_RLE)
-    {
-        if (bits_per_pixel == 16 || bits_per_pixel == 8)
-            success = read_bw_rle(tga, func_def);
-    }
+static void rgb_to_bgr(const byte *origin, byte *dest, int channels)
+{
+    // Do not reorder the following code below as the order is very important
 
-    func_def->close_file(func_def->file);
+    // Alpha
+    if (channels == 4)
+        dest[3] = origin[3];
 
-    if (success)
-    {
-        if (x_origin)
-            flip_tga_horizontally(tga);
+    dest[2] = origin[0];    // B
+    dest[1] = origin[1];    // G
+    dest[0] = origin[2];    // R
+}
 
-        if (y_origin)
-            flip_tga_vertically(tga);
-    }
-    else
-    {
-        free_tga(tga);
-    }
+// 16-bit pixels are stored little-endian and may be unaligned
+static void rgb_to_rgb16(const byte *data, byte *pixel, int channels)
+{
+    word value = 0;
+    value |= (data[0] >> 3) << 10;      // R
+    value |= (data[1] >> 3) << 5;       // G
+    value |= (data[2] >> 3);            // B
 
-    if (image_type == TGA_TYPE_MAPPED || image_type == TGA_TYPE_MAPPED_RLE)
-        free(color_data);
+    // Alpha
+    if (channels == 4)
+        value |= data[3] ? 1 << 15 : 0 << 15;
+    else
+        value |= 1 << 15;
 
-    return success;
+    pixel[0] = (byte)value;
+    pixel[1] = (byte)(value >> 8);
 }
 
-void free_tga(tga_image *tga)
+static void rgb16_to_rgb(const byte *pixel, byte *data, int channels)
 {
-    if (!tga)
-        return;
+    // Read before writing, the pixel may overlap the decoded data
+    word value = (word)(pixel[0] | pixel[1] << 8);
 
-    if (tga->data)
-        free(tga->data);
+    data[0] = ((value >> 10) & 0x1f) << 3;      // R
+    data[1] = ((value >> 5) & 0x1f) << 3;       // G
+    data[2] = (value & 0x1f) << 3;              // B
 
-    memset(tga, 0, sizeof(tga_image));
+    // Alpha
+    if (channels == 4)
+        data[3] = value & 0x8000 ? 255 : 0;
 }
 
-bool save_tga(const char *filename, tga_image *tga, const tga_type type)
+static void rgb_to_bw(const byte *data, byte *pixel, int channels, int pixel_size)
 {
-    tga_func_def func_def;
-
-    func_def.open_file = fopen_wrapper;
-    func_def.write_file = fwrite;
-    func_def.close_file = fclose;
+    pixel[0] = (data[0] + data[1] + data[2]) / 3;
 
-    return save_tga_ext(filename, tga, type, &func_def);
+    // Alpha, 8-bit images have none
+    if (pixel_size == 2)
+        pixel[1] = channels == 4 ? data[3] : 255;
 }
 
-static int generate_palette(const tga_image *tga, int size, byte **palette_data, byte **color_data, const tga_func_def *func_def)
+static void bw_to_rgb(const byte *pixel, byte *data, int channels)
 {
-    int palette_size = 0;
+    // Do not reorder the following code below as the order is very important
 
-    *palette_data = (byte *)malloc(tga->width * tga->height * tga->channels);
-    if (!*palette_data)
-        return 0;
+    // Alpha
+    if (channels == 4)
+        data[3] = pixel[1];
 
-    *color_data = (byte *)malloc(tga->width * tga->height);
-    if (!*color_data)
-    {
-        free(*palette_data);
-        return 0;
-    }
+    // Colors
+    data[2] = pixel[0];
+    data[1] = pixel[0];
+    data[0] = pixel[0];
+}
 
-    for (int i = 0, pixel = 0; i < size; i += tga->channels, pixel++)
-    {
-        bool found = false;
+void flip_tga_horizontally(tga_image *tga)
+{
+    if (!tga || !tga->data)
+        return;
 
-        for (unsigned int j = 0, color = 0; j < palette_size * tga->channels; j += tga->channels, color++)
-        {
-            if (memcmp(&tga->data[i], &(*palette_data)[j], tga->channels) != 0)
-                continue;
+    TGA_PROBE4(flip__start, 0, tga->width, tga->height, tga->channels);
 
-            (*color_data)[pixel] = color;
-            found = true;
-            break;
-        }
+    size_t row_size = (size_t)tga->width * tga->channels;
 
-        if (!found)
-        {
-            memcpy(&(*palette_data)[palette_size * tga->channels], &tga->data[i], tga->channels);
-            (*color_data)[pixel] = palette_size;
-            palette_size++;
+    for (size_t i = 0; i < tga->height; i++)
+    {
+        byte *row = &tga->data[row_size * i];
 
-            // Supports only 256 colors
-            if (palette_size > 256)
-            {
-                free(*palette_data);
-                free(*color_data);
-                func_def->close_file(func_def->file);
-                return 0;
-            }
+        for (size_t j = 0; j < tga->width / 2; j++)
+        {
+            for (unsigned int k = 0; k < tga->channels; k++)
+                swap_byte(&row[j * tga->channels + k], &row[(tga->width - j - 1) * tga->channels + k]);
         }
     }
 
-    // RGB to BGR
-    for (unsigned int j = 0, color = 0; j < palette_size * tga->channels; j += tga->channels)
-        swap_byte(&(*palette_data)[j], &(*palette_data)[j + 2]);
-
-    return palette_size;
+    TGA_PROBE1(flip__done, 0);
 }
 
-static bool write_mapped(const tga_image *tga, const byte *palette_data, const byte *color_data, int palette_size, const tga_func_def *func_def)
+void flip_tga_vertically(tga_image *tga)
 {
-    size_t pixels = tga->width * tga->height;
-
-    if (func_def->write_file((byte *)palette_data, sizeof(byte), palette_size, func_def->file) != palette_size)
-        return false;
-
-    if (func_def->write_file((byte *)color_data, sizeof(byte), pixels, func_def->file) != pixels)
-        return false;
-
-    return true;
-}
+    if (!tga || !tga->data)
+        return;
 
-static bool write_rgb(const tga_image *tga, int size, const tga_func_def *func_def)
-{
-    bool success = true;
+    TGA_PROBE4(flip__start, 1, tga->width, tga->height, tga->channels);
 
-    byte *data = (byte *)malloc(size);
-    if (!data)
-        return false;
+    size_t row_size = (size_t)tga->width * tga->channels;
 
-    for (int i = 0; i < size; i += tga->channels)
-        rgb_to_bgr(&tga->data[i], &data[i], tga->channels);
+    // Row by row, so that only two rows of a spilled image need to be resident at a time
+    for (size_t j = 0; j < tga->height / 2; j++)
+    {
+        byte *top = &tga->data[row_size * j];
+        byte *bottom = &tga->data[row_size * (tga->height - j - 1)];
 
-    if (func_def->write_file(data, sizeof(byte), size, func_def->file) != size)
-        success = false;
+        for (size_t i = 0; i < row_size; i++)
+            swap_byte(&top[i], &bottom[i]);
+    }
 
-    free(data);
-    return success;
+    TGA_PROBE1(flip__done, 1);
 }
 
-static bool write_rgb16(const tga_image *tga, int size, const tga_func_def *func_def)
+typedef struct
 {
-    bool success = true;
-    int image_size = tga->width * tga->height;
-
-    word *data = (word *)malloc(image_size * sizeof(word));
-    if (!data)
-        return false;
-
-    for (int i = 0, j = 0; i < size; i += tga->channels, j++)
-        rgb_to_rgb16(&tga->data[i], &data[j], tga->channels);
-
-    if (func_def->write_file(data, sizeof(word), image_size, func_def->file) != image_size)
-        success = false;
-
-    free(data);
-    return success;
-}
+    int first;
+    int count;
+    float *weights;
+} tga_filter;
 
-static bool write_bw(const tga_image *tga, int size, int bits, const tga_func_def *func_def)
+// Triangle filter weights for one axis, widened when shrinking so that every source pixel contributes
+static tga_filter *make_filters(unsigned int source, unsigned int dest)
 {
-    bool success = true;
-    int image_size = tga->width * tga->height;
-    int bytes = (bits == 16) ? sizeof(word) : sizeof(byte);
+    float scale = (float)dest / source;
+    float radius = scale < 1.0f ? 1.0f / scale : 1.0f;
+    int taps = (int)(radius * 2.0f) + 2;
 
-    byte *data = (byte *)malloc(image_size * sizeof(word));
-    if (!data)
-        return false;
+    tga_filter *filters = (tga_filter *)malloc(dest * (sizeof(tga_filter) + taps * sizeof(float)));
+    if (!filters)
+        return NULL;
 
-    for (int i = 0, j = 0; i < size; i += tga->channels, j += bytes)
-        rgb_to_bw(&tga->data[i], &data[j], tga->channels, bytes);
+    float *weights = (float *)&filters[dest];
 
-    if (func_def->write_file(data, sizeof(byte), image_size * bytes, func_def->file) != image_size * bytes)
-        success = false;
+    for (unsigned int i = 0; i < dest; i++)
+    {
+        float center = (i + 0.5f) / scale - 0.5f;
+        int first = (int)(center - radius) + (center - radius > 0.0f ? 1 : 0);
+        int last = (int)(center + radius);
+        float total = 0.0f;
 
-    free(data);
-    return success;
-}
+        if (first < 0)
+            first = 0;
 
-static int write_rle(const tga_image *tga, const byte *data, int channels, int index, byte *rle)
-{
-    int duplicates = 0;
-    int different = 0;
+        if (last > (int)source - 1)
+            last = source - 1;
 
-    unsigned int row_size = tga->width * tga->channels;
-    unsigned int end_row = index + (row_size - (index) % row_size);
+        if (last - first + 1 > taps)
+            last = first + taps - 1;
 
-    for (unsigned int j = index; j < end_row; j += channels)
-    {
-        // Duplicate pixels
-        if (!different)
+        filters[i].first = first;
+        filters[i].count = 0;
+        filters[i].weights = &weights[i * taps];
+
+        for (int x = first; x <= last; x++)
         {
-            if (j + channels < end_row && memcmp(&data[j], &data[j + channels], channels) == 0)
-            {
-                // A packet cannot contain more than 128 pixels
-                if (duplicates + 1 < 128)
-                {
-                    duplicates++;
-                    continue;
-                }
-            }
+            float distance = (x - center) / radius;
+            float weight = 1.0f - (distance < 0.0f ? -distance : distance);
 
-            // Write a run-length packet
-            if (duplicates)
-            {
-                (*rle) = duplicates;
-                (*rle) |= 1 << 7;
-                return (*rle) - 127;
-            }
+            if (weight < 0.0f)
+                weight = 0.0f;
+
+            filters[i].weights[filters[i].count++] = weight;
+            total += weight;
         }
 
-        // A packet cannot contain more than 128 pixels
-        if (different + 1 < 128 && j + channels < end_row)
+        // Nearest pixel when the filter falls between samples at the edges
+        if (total <= 0.0f)
         {
-            if (memcmp(&data[j], &data[j + channels], channels) != 0)
-            {
-                different++;
-                continue;
-            }
-            else
-            {
-                different--;
-            }
+            int nearest = (int)(center + 0.5f);
+            filters[i].first = nearest < 0 ? 0 : (nearest >= (int)source ? (int)source - 1 : nearest);
+            filters[i].count = 1;
+            filters[i].weights[0] = 1.0f;
+            total = 1.0f;
         }
 
-        // Write a raw packet
-        (*rle) = different;
-        return -(*rle) - 1;
+        for (int j = 0; j < filters[i].count; j++)
+            filters[i].weights[j] /= total;
     }
 
-    return 0;
+    return filters;
 }
 
-static bool write_mapped_rle(tga_image *tga, const byte *palette_data, const byte *color_data, int palette_size, const tga_func_def *func_def)
+bool resize_tga(tga_image *tga, unsigned int width, unsigned int height)
 {
-    if (func_def->write_file((byte *)palette_data, sizeof(byte), palette_size, func_def->file) != palette_size)
+    if (!tga || !tga->data || !width || !height || !tga->width || !tga->height)
         return false;
 
-    bool success = true;
-    int data_size = 0;
-    int size = tga->width * tga->height;
+    if (width == tga->width && height == tga->height)
+        return true;
 
-    byte *data = (byte *)malloc(size * 2);
-    if (!data)
+    unsigned int channels = tga->channels;
+    tga_filter *columns = make_filters(tga->width, width);
+    tga_filter *rows = make_filters(tga->height, height);
+    float *temp = (float *)alloc_pixels((size_t)width * tga->height * channels * sizeof(float));
+    byte *data = alloc_pixels((size_t)width * height * channels);
+
+    if (!columns || !rows || !temp || !data)
+    {
+        free(columns);
+        free(rows);
+        free_pixels(temp);
+        free_pixels(data);
         return false;
+    }
 
-    for (int i = 0, n; i < size; i += n)
+    // Horizontal pass
+    for (unsigned int y = 0; y < tga->height; y++)
     {
-        if (!(n = write_rle(tga, color_data, sizeof(byte), i, &data[data_size])))
+        const byte *source = &tga->data[(size_t)y * tga->width * channels];
+        float *dest = &temp[(size_t)y * width * channels];
+
+        for (unsigned int x = 0; x < width; x++)
         {
-            free(data);
-            return false;
-        }
+            const tga_filter *filter = &columns[x];
 
-        data_size++;
+            for (unsigned int k = 0; k < channels; k++)
+            {
+                float sum = 0.0f;
 
-        if (n > 0)
-        {
-            data[data_size] = color_data[i];
-            data_size++;
+                for (int i = 0; i < filter->count; i++)
+                    sum += source[(filter->first + i) * channels + k] * filter->weights[i];
+
+                dest[x * channels + k] = sum;
+            }
         }
-        else
+    }
+
+    // Vertical pass
+    for (unsigned int y = 0; y < height; y++)
+    {
+        const tga_filter *filter = &rows[y];
+        byte *dest = &data[(size_t)y * width * channels];
+
+        for (unsigned int x = 0; x < width * channels; x++)
         {
-            n = -n;
+            float sum = 0.5f;
 
-            memcpy(&data[data_size], &color_data[i], n);
-            data_size += n;
+            for (int i = 0; i < filter->count; i++)
+                sum += temp[(size_t)(filter->first + i) * width * channels + x] * filter->weights[i];
+
+            dest[x] = sum >= 255.0f ? 255 : (byte)sum;
         }
     }
 
-    if (func_def->write_file(data, sizeof(byte), data_size, func_def->file) != data_size)
-        success = false;
+    free(columns);
+    free(rows);
+    free_pixels(temp);
+    free_pixels(tga->data);
 
-    free(data);
-    return success;
+    tga->data = data;
+    tga->width = width;
+    tga->height = height;
+
+    return true;
 }
 
-static bool write_rgb_rle(const tga_image *tga, int size, const tga_func_def *func_def)
+bool convert_tga_channels(tga_image *tga, unsigned int channels)
 {
-    bool success = true;
-    int data_size = 0;
-
-    byte *data = (byte *)malloc(size + tga->width * tga->height);
-    if (!data)
+    if (!tga || !tga->data || (channels != 3 && channels != 4))
         return false;
 
-    for (int i = 0, n; i < size; i += n * tga->channels)
+    if (channels == tga->channels)
+        return true;
+
+    size_t pixels = (size_t)tga->width * tga->height;
+
+    // Adding alpha grows the buffer, so the pixels are moved back to front
+    if (channels == 4)
     {
-        if (!(n = write_rle(tga, tga->data, tga->channels, i, &data[data_size])))
-        {
-            free(data);
+        byte *data = realloc_pixels(tga->data, pixels * 3, pixels * 4);
+        if (!data)
             return false;
-        }
 
-        data_size++;
+        for (size_t i = pixels; i-- > 0;)
+        {
+            data[i * 4 + 3] = 255;
+            data[i * 4 + 2] = data[i * 3 + 2];
+            data[i * 4 + 1] = data[i * 3 + 1];
+            data[i * 4 + 0] = data[i * 3 + 0];
+        }
 
-        if (n > 0)
+        tga->data = data;
+    }
+    else
+    {
+        for (size_t i = 0; i < pixels; i++)
         {
-            rgb_to_bgr(&tga->data[i], &data[data_size], tga->channels);
-            data_size += tga->channels;
+            tga->data[i * 3 + 0] = tga->data[i * 4 + 0];
+            tga->data[i * 3 + 1] = tga->data[i * 4 + 1];
+            tga->data[i * 3 + 2] = tga->data[i * 4 + 2];
         }
-        else
+
+        byte *data = realloc_pixels(tga->data, pixels * 4, pixels * 3);
+        if (data)
+            tga->data = data;
+    }
+
+    tga->channels = channels;
+    return true;
+}
+
+// Rows compared per job, a multiple of the SSIM window
+#define TGA_COMPARE_BAND        64
+#define TGA_SSIM_WINDOW         8
+
+typedef struct
+{
+    const tga_image *a;
+    const tga_image *b;
+    unsigned int flags;
+    byte *diff;
+
+    tga_mutex lock;
+    unsigned int next;
+    bool differs;
+    unsigned int max_difference[4];
+    size_t mismatches;
+    uint64_t squared_error;
+    double ssim;
+    size_t windows;
+} tga_compare_job;
+
+// Mean SSIM of the color channels of one window
+static double window_ssim(const tga_image *a, const tga_image *b, unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+{
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    unsigned int channels = a->channels < 3 ? a->channels : 3;
+    double ssim = 0.0;
+
+    for (unsigned int c = 0; c < channels; c++)
+    {
+        uint64_t sum_a = 0, sum_b = 0, sum_aa = 0, sum_bb = 0, sum_ab = 0;
+
+        for (unsigned int j = y; j < y + height; j++)
         {
-            n = -n;
+            const byte *row_a = &a->data[((size_t)j * a->width + x) * a->channels + c];
+            const byte *row_b = &b->data[((size_t)j * b->width + x) * b->channels + c];
 
-            for (int j = 0; j < n; j++)
+            for (unsigned int i = 0; i < width; i++)
             {
-                rgb_to_bgr(&tga->data[i + j * tga->channels], &data[data_size], tga->channels);
-                data_size += tga->channels;
+                unsigned int value_a = row_a[i * a->channels];
+                unsigned int value_b = row_b[i * b->channels];
+
+                sum_a += value_a;
+                sum_b += value_b;
+                sum_aa += value_a * value_a;
+                sum_bb += value_b * value_b;
+                sum_ab += value_a * value_b;
             }
         }
-    }
 
-    if (func_def->write_file(data, sizeof(byte), data_size, func_def->file) != data_size)
-        success = false;
+        double n = (double)width * height;
+        double mean_a = sum_a / n;
+        double mean_b = sum_b / n;
+        double variance_a = sum_aa / n - mean_a * mean_a;
+        double variance_b = sum_bb / n - mean_b * mean_b;
+        double covariance = sum_ab / n - mean_a * mean_b;
 
-    free(data);
-    return success;
+        ssim += ((2 * mean_a * mean_b + c1) * (2 * covariance + c2)) /
+                ((mean_a * mean_a + mean_b * mean_b + c1) * (variance_a + variance_b + c2));
+    }
+
+    return ssim / channels;
 }
 
-static bool write_rgb16_rle(const tga_image *tga, int size, const tga_func_def *func_def)
+static void *compare_worker(void *arg)
 {
-    bool success = true;
-    int data_size = 0;
+    tga_compare_job *job = (tga_compare_job *)arg;
+    const tga_image *a = job->a;
+    const tga_image *b = job->b;
+    size_t channels = a->channels;
+    size_t row_size = (size_t)a->width * channels;
 
-    byte *data = (byte *)malloc(tga->width * tga->height * sizeof(word) + tga->width * tga->height);
-    if (!data)
-        return false;
-
-    for (int i = 0, n; i < size; i += n * tga->channels)
+    for (;;)
     {
-        if (!(n = write_rle(tga, tga->data, tga->channels, i, &data[data_size])))
+        lock_mutex(&job->lock);
+
+        unsigned int first = job->next;
+        bool done = first >= a->height || (job->differs && (job->flags & TGA_COMPARE_EXACT));
+
+        job->next += TGA_COMPARE_BAND;
+        unlock_mutex(&job->lock);
+
+        if (done)
+            break;
+
+        unsigned int last = first + TGA_COMPARE_BAND < a->height ? first + TGA_COMPARE_BAND : a->height;
+
+        // Exact comparisons stop at the first difference
+        if (job->flags & TGA_COMPARE_EXACT)
         {
-            free(data);
-            return false;
+            if (memcmp(&a->data[first * row_size], &b->data[first * row_size], (last - first) * row_size) != 0)
+            {
+                lock_mutex(&job->lock);
+                job->differs = true;
+                unlock_mutex(&job->lock);
+            }
+
+            continue;
         }
 
-        data_size++;
+        unsigned int max_difference[4] = { 0 };
+        size_t mismatches = 0;
+        uint64_t squared_error = 0;
+        double ssim = 0.0;
+        size_t windows = 0;
 
-        if (n > 0)
+        for (size_t y = first; y < last; y++)
         {
-            rgb_to_rgb16(&tga->data[i], (word *)&data[data_size], tga->channels);
-            data_size += sizeof(word);
+            const byte *row_a = &a->data[y * row_size];
+            const byte *row_b = &b->data[y * row_size];
+            byte *row_diff = job->diff ? &job->diff[y * row_size] : NULL;
+            uint32_t row_error = 0;
+
+            // Most rows of a regression image match, those only need the difference image cleared
+            if (memcmp(row_a, row_b, row_size) == 0)
+            {
+                for (size_t x = 0; row_diff && x < row_size; x++)
+                    row_diff[x] = channels == 4 && x % 4 == 3 ? 255 : 0;
+
+                continue;
+            }
+
+            for (size_t x = 0; x < row_size; x += channels)
+            {
+                bool mismatch = false;
+
+                for (size_t c = 0; c < channels; c++)
+                {
+                    int delta = row_a[x + c] - row_b[x + c];
+                    unsigned int difference = (unsigned int)(delta < 0 ? -delta : delta);
+
+                    if (difference > max_difference[c])
+                        max_difference[c] = difference;
+
+                    mismatch |= difference != 0;
+                    row_error += difference * difference;
+
+                    if (row_diff)
+                        row_diff[x + c] = c == 3 ? 255 : (byte)difference;
+                }
+
+                mismatches += mismatch;
+
+                // Flush before the 32-bit row sum could overflow
+                if (row_error > UINT32_MAX - 4 * 255 * 255)
+                {
+                    squared_error += row_error;
+                    row_error = 0;
+                }
+            }
+
+            squared_error += row_error;
         }
-        else
-        {
-            n = -n;
 
-            for (int j = 0; j < n; j++)
+        if (job->flags & TGA_COMPARE_SSIM)
+        {
+            for (unsigned int y = first; y < last; y += TGA_SSIM_WINDOW)
             {
-                rgb_to_rgb16(&tga->data[i + j * tga->channels], (word *)&data[data_size], tga->channels);
-                data_size += sizeof(word);
+                unsigned int height = last - y < TGA_SSIM_WINDOW ? last - y : TGA_SSIM_WINDOW;
+
+                for (unsigned int x = 0; x < a->width; x += TGA_SSIM_WINDOW, windows++)
+                {
+                    unsigned int width = a->width - x < TGA_SSIM_WINDOW ? a->width - x : TGA_SSIM_WINDOW;
+                    ssim += window_ssim(a, b, x, y, width, height);
+                }
             }
         }
-    }
 
-    if (func_def->write_file(data, sizeof(byte), data_size, func_def->file) != data_size)
-        success = false;
+        lock_mutex(&job->lock);
 
-    free(data);
-    return success;
+        for (size_t c = 0; c < channels; c++)
+        {
+            if (max_difference[c] > job->max_difference[c])
+                job->max_difference[c] = max_difference[c];
+        }
+
+        job->differs |= mismatches != 0;
+        job->mismatches += mismatches;
+        job->squared_error += squared_error;
+        job->ssim += ssim;
+        job->windows += windows;
+
+        unlock_mutex(&job->lock);
+    }
+
+    return NULL;
 }
 
-static bool write_bw_rle(const tga_image *tga, int size, int bits, const tga_func_def *func_def)
+bool tga_compare(const tga_image *a, const tga_image *b, unsigned int flags, tga_compare_metrics *metrics, tga_image *diff)
 {
-    bool success = true;
-    int bytes = (bits == 16) ? sizeof(word) : sizeof(byte);
-    int data_size = 0;
+    if (!a || !b || !a->data || !b->data || !metrics)
+        return false;
 
-    byte *data = (byte *)malloc(tga->width * tga->height * bytes + tga->width * tga->height);
-    if (!data)
+    if (a->width != b->width || a->height != b->height || a->channels != b->channels || a->channels < 1 || a->channels > 4)
         return false;
 
-    for (int i = 0, n; i < size; i += n * tga->channels)
+    if (flags & TGA_COMPARE_EXACT)
+        diff = NULL;
+
+    tga_compare_job job;
+    size_t size = (size_t)a->width * a->height * a->channels;
+
+    memset(&job, 0, sizeof(job));
+    job.a = a;
+    job.b = b;
+    job.flags = flags;
+
+    if (diff)
     {
-        if (!(n = write_rle(tga, tga->data, tga->channels, i, &data[data_size])))
-        {
-            free(data);
+        job.diff = alloc_pixels(size);
+        if (!job.diff)
             return false;
-        }
+    }
 
-        data_size++;
+    init_mutex(&job.lock);
 
-        if (n > 0)
-        {
-            rgb_to_bw(&tga->data[i], &data[data_size], tga->channels, bytes);
-            data_size += bytes;
-        }
-        else
-        {
-            n = -n;
+    unsigned int bands = (a->height + TGA_COMPARE_BAND - 1) / TGA_COMPARE_BAND;
+    int threads = count_cores();
 
-            for (int j = 0; j < n; j++)
-            {
-                rgb_to_bw(&tga->data[i + j * tga->channels], &data[data_size], tga->channels, bytes);
-                data_size += bytes;
-            }
-        }
+    // Small images are not worth the threads
+    if (size < TGA_STREAM_CHUNK * 4)
+        threads = 1;
+    else if ((unsigned int)threads > bands)
+        threads = (int)bands;
+
+    run_parallel(threads, compare_worker, &job);
+    destroy_mutex(&job.lock);
+
+    memset(metrics, 0, sizeof(tga_compare_metrics));
+    metrics->equal = !job.differs;
+
+    if (!(flags & TGA_COMPARE_EXACT))
+    {
+        memcpy(metrics->max_difference, job.max_difference, sizeof(job.max_difference));
+        metrics->mismatches = job.mismatches;
+        metrics->psnr = job.squared_error ? 10.0 * log10(255.0 * 255.0 * size / job.squared_error) : INFINITY;
+        metrics->ssim = job.windows ? job.ssim / job.windows : 1.0;
     }
 
-    if (func_def->write_file(data, sizeof(byte), data_size, func_def->file) != data_size)
-        success = false;
+    if (diff)
+    {
+        diff->width = a->width;
+        diff->height = a->height;
+        diff->channels = a->channels;
+        diff->data = job.diff;
+    }
 
-    free(data);
-    return success;
+    return true;
 }
 
-bool save_tga_ext(const char *filename, tga_image *tga, tga_type type, tga_func_def *func_def)
+static struct
 {
-    if (!filename || !tga || !tga->data)
-        return false;
+    tga_mutex lock;
+    bool drop;
+    bool direct;
+} page_cache = { TGA_MUTEX_INIT, false, false };
 
-    byte image_type;
-    byte bits;
-    int size = tga->width * tga->height * tga->channels;
-    bool success = false;
+void tga_set_drop_cache(bool drop)
+{
+    lock_mutex(&page_cache.lock);
+    page_cache.drop = drop;
+    unlock_mutex(&page_cache.lock);
+}
 
-    byte color_map_type = 0;
-    word first_entry_index = 0;
-    word color_map_length = 0;
-    byte color_map_entry_size = 0;
-    byte *palette_data = NULL;
-    byte *color_data = NULL;
-    int palette_size = 0;
+void tga_set_direct_io(bool direct)
+{
+    lock_mutex(&page_cache.lock);
+    page_cache.direct = direct;
+    unlock_mutex(&page_cache.lock);
+}
 
-    func_def->file = func_def->open_file(filename, "wb", func_def->file);
-    if (!func_def->file)
-        return false;
+static struct
+{
+    tga_mutex lock;
+    int threads;
+} save_threads = { TGA_MUTEX_INIT, 1 };
 
-    // Generate color palette
-    if (type == TGA_MAPPED || type == TGA_MAPPED_RLE)
+void tga_set_save_threads(int threads)
+{
+    lock_mutex(&save_threads.lock);
+    save_threads.threads = threads < 0 ? 1 : threads;
+    unlock_mutex(&save_threads.lock);
+}
+
+#ifdef __linux__
+
+#define TGA_DIRECT_ALIGN        4096
+#define TGA_DIRECT_CHUNK        (1 << 20)
+
+// File descriptor backend of the functions without a tga_func_def, to avoid the copies and locking of stdio.
+// Small reads, such as the header and the palette, are served from a buffer, larger ones go straight to the caller.
+// With direct I/O every read and write goes through an aligned bounce buffer instead, the unaligned tail of
+// an output is written once O_DIRECT is turned off at close.
+typedef struct
+{
+    int fd;
+    bool write;
+    bool drop;
+    off_t position;
+    off_t buffer_position;
+    size_t buffered;
+    byte *bounce;
+    byte buffer[4096];
+} tga_fd_file;
+
+static int open_fd(const char *filename, int flags)
+{
+    int fd;
+
+    do
+        fd = open(filename, flags, 0666);
+    while (fd < 0 && errno == EINTR);
+
+    return fd;
+}
+
+static void *fd_open(const char *filename, const char *mode, void *stream)
+{
+    int flags = O_CLOEXEC;
+
+    (void)stream;
+
+    if (mode[0] == 'r')
+        flags |= strchr(mode, '+') ? O_RDWR : O_RDONLY;
+    else if (mode[0] == 'w')
+        flags |= (strchr(mode, '+') ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+    else
+        return NULL;
+
+    tga_fd_file *file = (tga_fd_file *)alloc_bytes(sizeof(tga_fd_file));
+    if (!file)
+        return NULL;
+
+    lock_mutex(&page_cache.lock);
+    file->drop = page_cache.drop;
+    bool direct = page_cache.direct;
+    unlock_mutex(&page_cache.lock);
+
+    file->fd = -1;
+    file->bounce = NULL;
+
+    // File systems without direct I/O fall back to the page cache
+    if (direct && posix_memalign((void **)&file->bounce, TGA_DIRECT_ALIGN, TGA_DIRECT_CHUNK) == 0)
     {
-        if (!(color_map_length = generate_palette(tga, size, &palette_data, &color_data, func_def)))
+        file->fd = open_fd(filename, flags | O_DIRECT);
+
+        if (file->fd < 0 && errno == EINVAL)
         {
-            func_def->close_file(func_def->file);
-            return false;
+            free(file->bounce);
+            file->bounce = NULL;
         }
+    }
+    else
+    {
+        file->bounce = NULL;
+    }
 
-        color_map_type = 1;
-        first_entry_index = 0;
-        color_map_entry_size = tga->channels * 8;
-        palette_size = color_map_length * tga->channels;
+    if (!file->bounce)
+        file->fd = open_fd(filename, flags);
+
+    if (file->fd < 0)
+    {
+        free(file->bounce);
+        free(file);
+        return NULL;
     }
 
-    if (type == TGA_MAPPED)
-        image_type = TGA_TYPE_MAPPED;
-    else if (type == TGA_MAPPED_RLE)
-        image_type = TGA_TYPE_MAPPED_RLE;
-    else if (type == TGA_RGB)
-        image_type = TGA_TYPE_RGB;
-    else if (type == TGA_RGB_RLE)
-        image_type = TGA_TYPE_RGB_RLE;
-    else if (type == TGA_RGB16)
-        image_type = TGA_TYPE_RGB;
-    else if (type == TGA_RGB16_RLE)
-        image_type = TGA_TYPE_RGB_RLE;
-    else if (type == TGA_BW)
-        image_type = TGA_TYPE_BW;
-    else if (type == TGA_BW_RLE)
-        image_type = TGA_TYPE_BW_RLE;
-    else if (type == TGA_BW8)
-        image_type = TGA_TYPE_BW;
-    else if (type == TGA_BW8_RLE)
-        image_type = TGA_TYPE_BW_RLE;
+    file->write = mode[0] == 'w';
+    file->position = 0;
+    file->buffer_position = 0;
+    file->buffered = 0;
 
-    if (type == TGA_MAPPED || type == TGA_MAPPED_RLE)
-        bits = 8;
-    else if (type == TGA_RGB || type == TGA_RGB_RLE)
-        bits = tga->channels * 8;
-    else if (type == TGA_RGB16 || type == TGA_RGB16_RLE)
-        bits = tga->channels == 4 ? 16 : 15;
-    else if (type == TGA_BW || type == TGA_BW_RLE)
-        bits = 16;
-    else if (type == TGA_BW8 || type == TGA_BW8_RLE)
-        bits = 8;
+    if (!file->write && !file->bounce)
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-    byte header[18] = { 0, color_map_type, image_type,
-                      (byte)first_entry_index % 256,
-                      (byte)first_entry_index / 256,
-                      (byte)color_map_length % 256,
-                      (byte)color_map_length / 256,
-                      color_map_entry_size, 0, 0, 0, 0,
-                      (byte)(tga->width % 256),
-                      (byte)(tga->width / 256),
-                      (byte)(tga->height % 256),
-                      (byte)(tga->height / 256),
-                      bits, 0 };
+    return file;
+}
+
+static size_t pread_full(int fd, byte *data, size_t size, off_t offset)
+{
+    size_t done = 0;
 
-    if (!func_def->write_file(header, sizeof(header), 1, func_def->file))
+    while (done < size)
     {
-        func_def->close_file(func_def->file);
-        return false;
+        ssize_t n = pread(fd, &data[done], size - done, offset + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        done += n;
     }
 
-    if (type == TGA_MAPPED)
-        success = write_mapped(tga, palette_data, color_data, palette_size, func_def);
+    return done;
+}
+
+static size_t pwrite_full(int fd, const byte *data, size_t size, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t n = pwrite(fd, &data[done], size - done, offset + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        done += n;
+    }
+
+    return done;
+}
+
+static size_t fd_read(void *buffer, size_t size, size_t count, void *stream)
+{
+    tga_fd_file *file = (tga_fd_file *)stream;
+    byte *data = (byte *)buffer;
+    byte *window = file->bounce ? file->bounce : file->buffer;
+    size_t capacity = file->bounce ? TGA_DIRECT_CHUNK : sizeof(file->buffer);
+    size_t bytes = size * count;
+    size_t done = 0;
+
+    if (!bytes)
+        return 0;
+
+    while (done < bytes)
+    {
+        off_t position = file->position + done;
+
+        // Part already in the buffer
+        if (position >= file->buffer_position && position < file->buffer_position + (off_t)file->buffered)
+        {
+            size_t offset = (size_t)(position - file->buffer_position);
+            size_t take = file->buffered - offset < bytes - done ? file->buffered - offset : bytes - done;
+
+            memcpy(&data[done], &window[offset], take);
+            done += take;
+            continue;
+        }
+
+        if (!file->bounce && bytes - done >= capacity)
+        {
+            done += pread_full(file->fd, &data[done], bytes - done, position);
+            break;
+        }
+
+        file->buffer_position = file->bounce ? position & ~(off_t)(TGA_DIRECT_ALIGN - 1) : position;
+        file->buffered = pread_full(file->fd, window, capacity, file->buffer_position);
+
+        if (file->buffer_position + (off_t)file->buffered <= position)
+            break;
+    }
+
+    file->position += done;
+    return done / size;
+}
+
+// Writes the bounce buffer out. Only whole aligned blocks can be written directly, the rest stays
+// buffered unless everything has to go, in which case O_DIRECT is turned off for the remainder.
+static bool flush_direct(tga_fd_file *file, bool all)
+{
+    size_t aligned = file->buffer_position % TGA_DIRECT_ALIGN ? 0 : file->buffered & ~(size_t)(TGA_DIRECT_ALIGN - 1);
+
+    if (aligned && pwrite_full(file->fd, file->bounce, aligned, file->buffer_position) != aligned)
+        return false;
+
+    file->buffer_position += aligned;
+    file->buffered -= aligned;
+
+    if (!file->buffered)
+        return true;
+
+    if (!all && aligned)
+    {
+        memmove(file->bounce, &file->bounce[aligned], file->buffered);
+        return true;
+    }
+
+    int flags = fcntl(file->fd, F_GETFL);
+
+    if (flags < 0 || fcntl(file->fd, F_SETFL, flags & ~O_DIRECT) != 0 ||
+        pwrite_full(file->fd, &file->bounce[aligned], file->buffered, file->buffer_position) != file->buffered)
+        return false;
+
+    file->buffer_position += file->buffered;
+    file->buffered = 0;
+    return true;
+}
+
+static size_t fd_write(void *buffer, size_t size, size_t count, void *stream)
+{
+    tga_fd_file *file = (tga_fd_file *)stream;
+    const byte *data = (const byte *)buffer;
+    size_t bytes = size * count;
+    size_t done = 0;
+
+    if (!size)
+        return 0;
+
+    if (!file->bounce)
+    {
+        file->buffered = 0;
+        done = pwrite_full(file->fd, data, bytes, file->position);
+        file->position += done;
+        return done / size;
+    }
+
+    // Writes are gathered in the bounce buffer, which follows the file position
+    if (file->position != file->buffer_position + (off_t)file->buffered)
+    {
+        if (!flush_direct(file, true))
+            return 0;
+
+        file->buffer_position = file->position;
+    }
+
+    while (done < bytes)
+    {
+        size_t take = TGA_DIRECT_CHUNK - file->buffered < bytes - done ? TGA_DIRECT_CHUNK - file->buffered : bytes - done;
+
+        memcpy(&file->bounce[file->buffered], &data[done], take);
+        file->buffered += take;
+        done += take;
+
+        if (file->buffered == TGA_DIRECT_CHUNK && !flush_direct(file, false))
+        {
+            done -= file->buffered;
+            file->buffered = 0;
+            break;
+        }
+    }
+
+    file->position += done;
+    return done / size;
+}
+
+static long fd_seek(void *stream, long offset, int origin)
+{
+    tga_fd_file *file = (tga_fd_file *)stream;
+    off_t base = 0;
+
+    if (origin == SEEK_CUR)
+    {
+        base = file->position;
+    }
+    else if (origin == SEEK_END)
+    {
+        struct stat st;
+
+        if (file->write && file->bounce && !flush_direct(file, true))
+            return -1;
+        if (fstat(file->fd, &st) != 0)
+            return -1;
+
+        base = st.st_size;
+    }
+
+    if (base + offset < 0)
+        return -1;
+
+    file->position = base + offset;
+    return 0;
+}
+
+static int fd_close(void *stream)
+{
+    tga_fd_file *file = (tga_fd_file *)stream;
+    bool flushed = !file->write || !file->bounce || flush_direct(file, true);
+
+    // Written pages have to reach the disk before they can be dropped
+    if (file->drop && file->write)
+        sync_file_range(file->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    if (file->drop)
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    int result = close(file->fd);
+
+    free(file->bounce);
+    free(file);
+    return flushed ? result : EOF;
+}
+
+#else
+
+static void *fopen_wrapper(const char *filename, char const *mode, const void *stream)
+{
+    return fopen(filename, mode);
+}
+
+#endif
+
+// File functions used by the functions that take no tga_func_def
+static void default_file_funcs(tga_func_def *func_def)
+{
+#ifdef __linux__
+    func_def->open_file = fd_open;
+    func_def->read_file = fd_read;
+    func_def->write_file = fd_write;
+    func_def->seek_file = fd_seek;
+    func_def->close_file = fd_close;
+#else
+    func_def->open_file = fopen_wrapper;
+    func_def->read_file = fread;
+    func_def->write_file = fwrite;
+    func_def->seek_file = fseek;
+    func_def->close_file = fclose;
+#endif
+}
+
+// Reserves the whole size of an output file whose size is known up front, so it is laid out in one extent
+static void preallocate_file(const tga_func_def *func_def, size_t size)
+{
+#ifdef __linux__
+    if (func_def->write_file == fd_write && size)
+        fallocate(((tga_fd_file *)func_def->file)->fd, 0, 0, (off_t)size);
+#endif
+}
+
+// Descriptor that can be written at any offset from several threads, or -1
+static int positional_fd(const tga_func_def *func_def)
+{
+#ifdef __linux__
+    if (func_def->write_file == fd_write && !((tga_fd_file *)func_def->file)->bounce)
+        return ((tga_fd_file *)func_def->file)->fd;
+#endif
+    return -1;
+}
+
+static bool write_at(int fd, const byte *data, size_t size, uint64_t offset)
+{
+#ifdef __linux__
+    return pwrite_full(fd, data, size, (off_t)offset) == size;
+#else
+    return false;
+#endif
+}
+
+typedef struct
+{
+    const byte *data;
+    size_t size;
+    size_t position;
+} tga_memory_stream;
+
+static void *mem_open(const char *filename, const char *mode, void *stream)
+{
+    (void)filename;
+    (void)mode;
+    return stream;
+}
+
+static size_t mem_read(void *buffer, size_t size, size_t count, void *stream)
+{
+    tga_memory_stream *mem = (tga_memory_stream *)stream;
+
+    if (!size)
+        return 0;
+
+    size_t available = (mem->size - mem->position) / size;
+    if (count > available)
+        count = available;
+
+    memcpy(buffer, &mem->data[mem->position], size * count);
+    mem->position += size * count;
+
+    return count;
+}
+
+static long mem_seek(void *stream, long offset, int origin)
+{
+    tga_memory_stream *mem = (tga_memory_stream *)stream;
+    size_t base = 0;
+
+    if (origin == SEEK_CUR)
+        base = mem->position;
+    else if (origin == SEEK_END)
+        base = mem->size;
+
+    if ((offset < 0 && (size_t)-offset > base) || (offset > 0 && (size_t)offset > mem->size - base))
+        return -1;
+
+    mem->position = base + offset;
+    return 0;
+}
+
+static int mem_close(void *stream)
+{
+    (void)stream;
+    return 0;
+}
+
+typedef struct
+{
+    byte *data;
+    size_t size;
+    size_t capacity;
+} tga_memory_buffer;
+
+static size_t mem_write(void *buffer, size_t size, size_t count, void *stream)
+{
+    tga_memory_buffer *mem = (tga_memory_buffer *)stream;
+    size_t bytes = size * count;
+
+    if (mem->size + bytes > mem->capacity)
+    {
+        size_t capacity = mem->capacity ? mem->capacity : 4096;
+
+        while (capacity < mem->size + bytes)
+            capacity *= 2;
+
+        byte *data = (byte *)realloc(mem->data, capacity);
+        if (!data)
+            return 0;
+
+        mem->data = data;
+        mem->capacity = capacity;
+    }
+
+    memcpy(&mem->data[mem->size], buffer, bytes);
+    mem->size += bytes;
+
+    return count;
+}
+
+bool load_tga(const char *filename, tga_image *tga)
+{
+    tga_func_def func_def;
+
+    default_file_funcs(&func_def);
+
+    return load_tga_ext(filename, tga, &func_def);
+}
+
+bool load_tga_mem(const void *data, size_t size, tga_image *tga)
+{
+    if (!data)
+        return false;
+
+    tga_memory_stream mem = { (const byte *)data, size, 0 };
+    tga_func_def func_def;
+
+    func_def.open_file = mem_open;
+    func_def.read_file = mem_read;
+    func_def.seek_file = mem_seek;
+    func_def.close_file = mem_close;
+    func_def.file = &mem;
+
+    return load_tga_ext("", tga, &func_def);
+}
+
+bool load_tga_metrics(const char *filename, tga_image *tga, tga_func_def *func_def, tga_metrics *metrics)
+{
+    tga_func_def defaults;
+
+    if (!func_def)
+    {
+        default_file_funcs(&defaults);
+        defaults.file = NULL;
+        func_def = &defaults;
+    }
+
+    if (metrics)
+        memset(metrics, 0, sizeof(tga_metrics));
+
+    active_metrics = metrics;
+    bool success = load_tga_ext(filename, tga, func_def);
+    active_metrics = NULL;
+
+    return success;
+}
+
+static bool read_mapped(tga_image *tga, const byte **color_data, const tga_func_def *func_def)
+{
+    size_t pixels = (size_t)tga->width * tga->height;
+
+    tga->data = alloc_pixels(pixels * tga->channels);
+    if (!tga->data)
+        return false;
+
+    if (func_def->read_file(tga->data, sizeof(byte), pixels, func_def->file) != pixels)
+        return false;
+
+    for (size_t i = pixels; i-- > 0;)
+        rgb_to_bgr(&(*color_data)[tga->data[i] * tga->channels], &tga->data[i * tga->channels], tga->channels);
+
+    return true;
+}
+
+static bool read_rgb(tga_image *tga, const tga_func_def *func_def)
+{
+    size_t pixels = (size_t)tga->width * tga->height;
+    size_t row_size = (size_t)tga->width * tga->channels;
+
+    tga->data = alloc_pixels(pixels * tga->channels);
+    if (!tga->data)
+        return false;
+
+    if (func_def->read_file(tga->data, sizeof(byte), pixels * tga->channels, func_def->file) != (pixels * tga->channels))
+        return false;
+
+    for (size_t y = 0; y < tga->height; y++)
+    {
+        byte *pixel = &(tga->data[row_size * y]);
+
+        for (size_t i = 0; i < row_size; i += tga->channels)
+            swap_byte(&pixel[i], &pixel[i + 2]);
+    }
+
+    return true;
+}
+
+static bool read_rgb16(tga_image *tga, const tga_func_def *func_def)
+{
+    size_t pixels = (size_t)tga->width * tga->height;
+
+    tga->data = alloc_pixels(pixels * tga->channels);
+    if (!tga->data)
+        return false;
+
+    if (func_def->read_file(tga->data, sizeof(word), pixels, func_def->file) != pixels)
+        return false;
+
+    for (size_t i = pixels; i-- > 0;)
+        rgb16_to_rgb(&tga->data[i * sizeof(word)], &tga->data[i * tga->channels], tga->channels);
+
+    return true;
+}
+
+static bool read_bw(tga_image *tga, const tga_func_def *func_def)
+{
+    size_t bytes = tga->channels == 4 ? sizeof(word) : sizeof(byte);
+    size_t pixels = (size_t)tga->width * tga->height;
+
+    tga->data = alloc_pixels(pixels * tga->channels);
+    if (!tga->data)
+        return false;
+
+    if (func_def->read_file(tga->data, sizeof(byte), pixels * bytes, func_def->file) != (pixels * bytes))
+        return false;
+
+    for (size_t i = pixels; i-- > 0;)
+        bw_to_rgb(&tga->data[i * bytes], &tga->data[i * tga->channels], tga->channels);
+
+    return true;
+}
+
+typedef enum
+{
+    TGA_PIXEL_MAPPED,
+    TGA_PIXEL_RGB,
+    TGA_PIXEL_RGB16,
+    TGA_PIXEL_BW
+} tga_pixel_kind;
+
+// How pixels are stored in a file and what they decode to
+typedef struct
+{
+    tga_pixel_kind kind;
+    int size;
+    int channels;
+    const byte *palette;
+} tga_pixel_format;
+
+// Progress through an RLE packet that may continue in the next chunk of data
+typedef struct
+{
+    int remaining;
+    bool run;
+    byte value[4];
+} tga_rle_state;
+
+static bool get_pixel_format(byte image_type, byte bits_per_pixel, int channels, const byte *palette, tga_pixel_format *format)
+{
+    format->channels = channels;
+    format->palette = palette;
+
+    if ((image_type == TGA_TYPE_MAPPED || image_type == TGA_TYPE_MAPPED_RLE) && bits_per_pixel == 8 && palette)
+    {
+        format->kind = TGA_PIXEL_MAPPED;
+        format->size = sizeof(byte);
+    }
+    else if ((image_type == TGA_TYPE_RGB || image_type == TGA_TYPE_RGB_RLE) && (bits_per_pixel == 24 || bits_per_pixel == 32))
+    {
+        format->kind = TGA_PIXEL_RGB;
+        format->size = channels;
+    }
+    else if ((image_type == TGA_TYPE_RGB || image_type == TGA_TYPE_RGB_RLE) && (bits_per_pixel == 15 || bits_per_pixel == 16))
+    {
+        format->kind = TGA_PIXEL_RGB16;
+        format->size = sizeof(word);
+    }
+    else if ((image_type == TGA_TYPE_BW || image_type == TGA_TYPE_BW_RLE) && (bits_per_pixel == 8 || bits_per_pixel == 16))
+    {
+        format->kind = TGA_PIXEL_BW;
+        format->size = channels == 4 ? sizeof(word) : sizeof(byte);
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+static void decode_pixel(const tga_pixel_format *format, const byte *pixel, byte *data)
+{
+    switch (format->kind)
+    {
+    case TGA_PIXEL_MAPPED:
+        rgb_to_bgr(&format->palette[pixel[0] * format->channels], data, format->channels);
+        break;
+    case TGA_PIXEL_RGB:
+        rgb_to_bgr(pixel, data, format->channels);
+        break;
+    case TGA_PIXEL_RGB16:
+        rgb16_to_rgb(pixel, data, format->channels);
+        break;
+    case TGA_PIXEL_BW:
+        bw_to_rgb(pixel, data, format->channels);
+        break;
+    }
+}
+
+// Decodes uncompressed pixels with the format checked once rather than per pixel
+static void decode_raw(const tga_pixel_format *format, const byte *pixels, byte *data, size_t count)
+{
+    size_t channels = format->channels;
+
+    switch (format->kind)
+    {
+    case TGA_PIXEL_MAPPED:
+        for (size_t i = 0; i < count; i++)
+            rgb_to_bgr(&format->palette[pixels[i] * channels], &data[i * channels], (int)channels);
+        break;
+    case TGA_PIXEL_RGB:
+        if (channels == 4)
+        {
+            for (size_t i = 0; i < count * 4; i += 4)
+            {
+                data[i] = pixels[i + 2];
+                data[i + 1] = pixels[i + 1];
+                data[i + 2] = pixels[i];
+                data[i + 3] = pixels[i + 3];
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < count * 3; i += 3)
+            {
+                data[i] = pixels[i + 2];
+                data[i + 1] = pixels[i + 1];
+                data[i + 2] = pixels[i];
+            }
+        }
+        break;
+    case TGA_PIXEL_RGB16:
+        for (size_t i = 0; i < count; i++)
+            rgb16_to_rgb(&pixels[i * sizeof(word)], &data[i * channels], (int)channels);
+        break;
+    case TGA_PIXEL_BW:
+        for (size_t i = 0; i < count; i++)
+            bw_to_rgb(&pixels[i * format->size], &data[i * channels], (int)channels);
+        break;
+    }
+}
+
+// Copies the first decoded pixel over the rest of a run
+static void fill_run(byte *data, size_t count, int channels)
+{
+    if (channels == 4)
+    {
+        for (size_t i = 4; i < count * 4; i++)
+            data[i] = data[i - 4];
+    }
+    else
+    {
+        for (size_t i = 3; i < count * 3; i++)
+            data[i] = data[i - 3];
+    }
+}
+
+// Decodes up to the given number of pixels from a chunk of RLE data and returns the number of
+// bytes used. A packet header or pixel cut off at the end of the chunk is left for the next call.
+static size_t decode_rle(tga_rle_state *state, const tga_pixel_format *format, const byte *rle, size_t size,
+                         byte *data, size_t pixels, size_t *decoded)
+{
+    size_t used = 0;
+    size_t done = 0;
+    int channels = format->channels;
+
+    while (done < pixels)
+    {
+        if (!state->remaining)
+        {
+            if (used >= size)
+                break;
+
+            byte rle_id = rle[used];
+
+            // Run-length packet
+            if (rle_id & 0x80)
+            {
+                if (size - used < 1 + (size_t)format->size)
+                    break;
+
+                memcpy(state->value, &rle[used + 1], format->size);
+                state->run = true;
+                used += 1 + format->size;
+            }
+            // Raw packet
+            else
+            {
+                state->run = false;
+                used++;
+            }
+
+            state->remaining = (rle_id & 0x7f) + 1;
+        }
+
+        size_t count = (size_t)state->remaining < pixels - done ? (size_t)state->remaining : pixels - done;
+        byte *dest = &data[done * channels];
+
+        if (state->run)
+        {
+            decode_pixel(format, state->value, dest);
+            fill_run(dest, count, channels);
+        }
+        else
+        {
+            size_t available = (size - used) / format->size;
+            if (count > available)
+                count = available;
+
+            if (!count)
+                break;
+
+            decode_raw(format, &rle[used], dest, count);
+            used += count * format->size;
+        }
+
+        state->remaining -= (int)count;
+        done += count;
+    }
+
+    *decoded = done;
+    return used;
+}
+
+// Decodes the given number of pixels from the packet stream at the current file position a chunk at
+// a time and stores the number of packet bytes they used, the chunk buffer holds TGA_STREAM_CHUNK bytes
+static bool stream_rle(tga_rle_state *state, const tga_pixel_format *format, byte *chunk, byte *data, size_t pixels,
+                       size_t *consumed, const tga_func_def *func_def)
+{
+    size_t done = 0;
+    size_t filled = 0;
+
+    *consumed = 0;
+
+    while (done < pixels)
+    {
+        size_t count = func_def->read_file(&chunk[filled], sizeof(byte), TGA_STREAM_CHUNK - filled, func_def->file);
+        size_t decoded;
+
+        filled += count;
+
+        size_t used = decode_rle(state, format, chunk, filled, &data[done * format->channels], pixels - done, &decoded);
+
+        memmove(chunk, &chunk[used], filled - used);
+        filled -= used;
+        done += decoded;
+        *consumed += used;
+
+        // Truncated file
+        if (!count && !decoded)
+            break;
+    }
+
+    return done == pixels;
+}
+
+// Decodes RLE data a chunk at a time, without the temporary copy of the whole packet stream
+static bool read_rle_streamed(tga_image *tga, const tga_pixel_format *format, const tga_func_def *func_def)
+{
+    size_t pixels = (size_t)tga->width * tga->height;
+    size_t consumed;
+    tga_rle_state state = { 0 };
+
+    tga->data = alloc_pixels(pixels * tga->channels);
+    byte *chunk = (byte *)alloc_bytes(TGA_STREAM_CHUNK);
+    if (!tga->data || !chunk)
+    {
+        free(chunk);
+        return false;
+    }
+
+    bool success = stream_rle(&state, format, chunk, tga->data, pixels, &consumed, func_def);
+
+    free(chunk);
+    return success;
+}
+
+// Decodes RLE data from a temporary copy of the whole packet stream, kept after the pixels in the
+// same buffer so the decoded pixels never catch up with the packets still to be decoded
+static bool read_rle(tga_image *tga, const tga_pixel_format *format, const tga_func_def *func_def)
+{
+    size_t pixels = (size_t)tga->width * tga->height;
+    size_t data_size = pixels * tga->channels;
+    size_t rle_size = pixels * format->size + pixels;
+    size_t decoded;
+    tga_rle_state state = { 0 };
+
+    tga->data = (byte *)alloc_bytes(data_size + rle_size);
+    if (!tga->data)
+        return false;
+
+    size_t read = func_def->read_file(&tga->data[data_size], sizeof(byte), rle_size, func_def->file);
+
+    // Packets are cut off at the last pixel, a file that ends before it is truncated
+    decode_rle(&state, format, &tga->data[data_size], read, tga->data, pixels, &decoded);
+    if (decoded != pixels)
+        return false;
+
+    byte *tmp = (byte *)realloc_bytes(tga->data, data_size);
+    if (tmp)
+    {
+        tga->data = tmp;
+    }
+
+    return true;
+}
+
+// Parsed TGA header, with the palette when the image has one
+typedef struct
+{
+    byte image_type;
+    byte bits_per_pixel;
+    bool flip_x;
+    bool flip_y;
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;
+    byte *palette;
+    size_t palette_size;
+    long data_offset;
+} tga_header;
+
+// Reads the header, skips the image ID and loads the palette, leaving the file at the pixel data
+static bool read_header(tga_header *info, const tga_func_def *func_def)
+{
+    byte header[18];
+
+    memset(info, 0, sizeof(tga_header));
+
+    if (!func_def->read_file(&header, sizeof(header), 1, func_def->file))
+        return false;
+
+    info->image_type = header[2];
+
+    if (info->image_type == TGA_TYPE_NO_IMAGE)
+        return false;
+
+    byte id_length = header[0];
+    byte color_map_type = header[1];
+    word x_origin = (word)header[9] << 8 | (word)header[8];
+    word y_origin = (word)header[11] << 8 | (word)header[10];
+
+    info->flip_x = x_origin != 0;
+    info->flip_y = y_origin != 0;
+    info->width = (word)header[13] << 8 | (word)header[12];
+    info->height = (word)header[15] << 8 | (word)header[14];
+    info->bits_per_pixel = header[16];
+    info->data_offset = sizeof(header) + id_length;
+
+    // Skip optional image ID field, by reading it when the source cannot seek
+    if (id_length && (!func_def->seek_file || func_def->seek_file(func_def->file, id_length, SEEK_CUR) != 0))
+    {
+        byte id[255];
+
+        if (func_def->read_file(id, sizeof(byte), id_length, func_def->file) != id_length)
+            return false;
+    }
+
+    int color_channels = 0;
+
+    // Load color map data if exists
+    if (color_map_type)
+    {
+        word color_map_length = (word)header[6] << 8 | (word)header[5];
+        byte color_map_entry_size = header[7];
+        color_channels = (color_map_entry_size / 8);
+
+        info->palette_size = (size_t)color_map_length * color_channels;
+        info->data_offset += (long)info->palette_size;
+
+        // Every 8-bit index has an entry, the ones past the end of the color map are black
+        size_t padded = (size_t)256 * color_channels;
+        if (padded < info->palette_size)
+            padded = info->palette_size;
+
+        info->palette = (byte *)alloc_bytes(padded);
+        if (!info->palette)
+            return false;
+
+        memset(&info->palette[info->palette_size], 0, padded - info->palette_size);
+
+        if (func_def->read_file(info->palette, sizeof(byte), info->palette_size, func_def->file) != info->palette_size)
+        {
+            free(info->palette);
+            info->palette = NULL;
+            return false;
+        }
+    }
+
+    if (info->image_type == TGA_TYPE_MAPPED || info->image_type == TGA_TYPE_MAPPED_RLE)
+    {
+        // Palette entries are decoded as 24 or 32-bit colors
+        if (color_channels != 3 && color_channels != 4)
+        {
+            free(info->palette);
+            info->palette = NULL;
+            return false;
+        }
+
+        info->channels = color_channels;
+    }
+    else if (info->image_type == TGA_TYPE_RGB || info->image_type == TGA_TYPE_RGB_RLE)
+    {
+        if (info->bits_per_pixel == 32 || info->bits_per_pixel == 16)
+            info->channels = 4;
+        else
+            info->channels = 3;
+    }
+    else if (info->image_type == TGA_TYPE_BW || info->image_type == TGA_TYPE_BW_RLE)
+    {
+        if (info->bits_per_pixel == 16)
+            info->channels = 4;
+        else
+            info->channels = 3;
+    }
+
+    return true;
+}
+
+// Reads the pixels of a file one row at a time in file order
+typedef struct
+{
+    const tga_func_def *func_def;
+    const tga_header *header;
+    const tga_pixel_format *format;
+    bool rle;
+    byte *chunk;                // TGA_STREAM_CHUNK bytes and at least one row of the file
+    size_t filled;
+    tga_rle_state state;
+} tga_row_reader;
+
+static bool read_row(tga_row_reader *reader, byte *data)
+{
+    const tga_func_def *func_def = reader->func_def;
+    size_t width = reader->header->width;
+    size_t channels = reader->header->channels;
+
+    if (!reader->rle)
+    {
+        size_t row_size = width * reader->format->size;
+
+        if (func_def->read_file(reader->chunk, sizeof(byte), row_size, func_def->file) != row_size)
+            return false;
+
+        decode_raw(reader->format, reader->chunk, data, width);
+        return true;
+    }
+
+    size_t done = 0;
+
+    while (done < width)
+    {
+        size_t count = func_def->read_file(&reader->chunk[reader->filled], sizeof(byte), TGA_STREAM_CHUNK - reader->filled, func_def->file);
+        size_t decoded;
+
+        reader->filled += count;
+
+        size_t used = decode_rle(&reader->state, reader->format, reader->chunk, reader->filled, &data[done * channels], width - done, &decoded);
+
+        memmove(reader->chunk, &reader->chunk[used], reader->filled - used);
+        reader->filled -= used;
+        done += decoded;
+
+        // Truncated file
+        if (!count && !decoded)
+            break;
+    }
+
+    return done == width;
+}
+
+static struct
+{
+    tga_mutex lock;
+    size_t size;
+} read_ahead = { TGA_MUTEX_INIT, 0 };
+
+void tga_set_read_ahead(size_t size)
+{
+    lock_mutex(&read_ahead.lock);
+    read_ahead.size = size;
+    unlock_mutex(&read_ahead.lock);
+}
+
+// Buffer in front of the file functions of a load, so that small reads become few large ones
+typedef struct
+{
+    const tga_func_def *source;
+    byte *buffer;
+    size_t capacity;
+    size_t position;
+    size_t filled;
+} tga_read_buffer;
+
+static size_t buffered_read(void *buffer, size_t size, size_t count, void *stream)
+{
+    tga_read_buffer *ahead = (tga_read_buffer *)stream;
+    byte *data = (byte *)buffer;
+    size_t bytes = size * count;
+    size_t done = 0;
+
+    while (done < bytes)
+    {
+        if (ahead->position == ahead->filled)
+        {
+            // Large reads go straight to the destination
+            if (bytes - done >= ahead->capacity)
+            {
+                done += ahead->source->read_file(&data[done], sizeof(byte), bytes - done, ahead->source->file);
+                break;
+            }
+
+            ahead->filled = ahead->source->read_file(ahead->buffer, sizeof(byte), ahead->capacity, ahead->source->file);
+            ahead->position = 0;
+
+            if (!ahead->filled)
+                break;
+        }
+
+        size_t take = ahead->filled - ahead->position < bytes - done ? ahead->filled - ahead->position : bytes - done;
+
+        memcpy(&data[done], &ahead->buffer[ahead->position], take);
+        ahead->position += take;
+        done += take;
+    }
+
+    return size ? done / size : 0;
+}
+
+// Walks the RLE packets of pixel data as it goes by, resuming where the last piece ended
+typedef struct
+{
+    size_t pixel_size;
+    uint64_t pixels;            // Left to the end of the image
+    size_t skip;                // Bytes of the current packet still to go
+    uint64_t packets;
+    uint64_t run_pixels;
+    uint64_t raw_pixels;
+    uint64_t run_lengths[8];
+    uint64_t raw_lengths[8];
+} tga_packet_scan;
+
+static void scan_packets(tga_packet_scan *scan, const byte *data, size_t size)
+{
+    size_t i = 0;
+
+    while (i < size && (scan->skip || scan->pixels))
+    {
+        if (scan->skip)
+        {
+            size_t take = scan->skip < size - i ? scan->skip : size - i;
+
+            scan->skip -= take;
+            i += take;
+            continue;
+        }
+
+        byte header = data[i++];
+        uint64_t count = (header & 0x7f) + 1;
+
+        if (count > scan->pixels)
+            count = scan->pixels;
+
+        int bucket = 0;
+
+        while ((1u << bucket) < count)
+            bucket++;
+
+        scan->pixels -= count;
+        scan->packets++;
+
+        if (header & 0x80)
+        {
+            scan->run_pixels += count;
+            scan->run_lengths[bucket]++;
+            scan->skip = scan->pixel_size;
+        }
+        else
+        {
+            scan->raw_pixels += count;
+            scan->raw_lengths[bucket]++;
+            scan->skip = (size_t)count * scan->pixel_size;
+        }
+    }
+}
+
+// Layer over the file functions of a measured load or save, timing and counting what goes through them
+typedef struct
+{
+    const tga_func_def *source;
+    tga_metrics *metrics;
+    uint64_t io_ns;             // Spent in read_file and write_file
+    uint64_t last_ns;           // Of the last call
+    uint64_t position;
+    uint64_t body;              // Offset of the pixel data, whose packets are scanned once scan.pixel_size is set
+    tga_packet_scan scan;
+} tga_meter;
+
+static void meter_bytes(tga_meter *meter, const byte *data, size_t bytes)
+{
+    if (meter->scan.pixel_size && meter->position + bytes > meter->body)
+    {
+        size_t skip = meter->position < meter->body ? (size_t)(meter->body - meter->position) : 0;
+        scan_packets(&meter->scan, &data[skip], bytes - skip);
+    }
+
+    meter->position += bytes;
+}
+
+static size_t metered_read(void *buffer, size_t size, size_t count, void *stream)
+{
+    tga_meter *meter = (tga_meter *)stream;
+    uint64_t start = now_ns();
+    size_t read = meter->source->read_file(buffer, size, count, meter->source->file);
+
+    meter->last_ns = now_ns() - start;
+    meter->io_ns += meter->last_ns;
+    meter->metrics->bytes_read += (uint64_t)read * size;
+    meter_bytes(meter, (const byte *)buffer, read * size);
+
+    return read;
+}
+
+static size_t metered_write(void *buffer, size_t size, size_t count, void *stream)
+{
+    tga_meter *meter = (tga_meter *)stream;
+    uint64_t start = now_ns();
+    size_t written = meter->source->write_file(buffer, size, count, meter->source->file);
+
+    meter->last_ns = now_ns() - start;
+    meter->io_ns += meter->last_ns;
+    meter->metrics->bytes_written += (uint64_t)written * size;
+    meter_bytes(meter, (const byte *)buffer, written * size);
+
+    return written;
+}
+
+static long metered_seek(void *stream, long offset, int origin)
+{
+    tga_meter *meter = (tga_meter *)stream;
+    long result = meter->source->seek_file(meter->source->file, offset, origin);
+
+    if (result == 0 && origin == SEEK_CUR)
+        meter->position += offset;
+    else if (result == 0 && origin == SEEK_SET)
+        meter->position = offset;
+
+    return result;
+}
+
+// Puts the meter in front of the opened source
+static tga_func_def *meter_file(tga_meter *meter, tga_func_def *metered, const tga_func_def *source, tga_metrics *metrics)
+{
+    memset(meter, 0, sizeof(tga_meter));
+    meter->source = source;
+    meter->metrics = metrics;
+
+    *metered = *source;
+    metered->read_file = source->read_file ? metered_read : NULL;
+    metered->write_file = source->write_file ? metered_write : NULL;
+    metered->seek_file = source->seek_file ? metered_seek : NULL;
+    metered->file = meter;
+
+    return metered;
+}
+
+static void add_packets(tga_metrics *metrics, const tga_packet_scan *scan)
+{
+    metrics->packets += scan->packets;
+    metrics->run_pixels += scan->run_pixels;
+    metrics->raw_pixels += scan->raw_pixels;
+
+    for (int i = 0; i < 8; i++)
+    {
+        metrics->run_lengths[i] += scan->run_lengths[i];
+        metrics->raw_lengths[i] += scan->raw_lengths[i];
+    }
+}
+
+static bool read_image(const char *filename, tga_image *tga, tga_func_def *func_def)
+{
+    tga_header header;
+    bool success = false;
+
+    tga_pixel_format format;
+    size_t reserved = 0;
+
+    tga_metrics *metrics = active_metrics;
+    tga_meter meter;
+    tga_func_def metered;
+    uint64_t start = stamp(metrics);
+
+    tga->data = NULL;
+
+    func_def->file = func_def->open_file(filename, "rb", func_def->file);
+    if (!func_def->file)
+        return false;
+
+    if (metrics)
+        metrics->open_ns += now_ns() - start;
+
+    tga_func_def *source = func_def;
+    tga_func_def buffered;
+    tga_read_buffer ahead = { source, NULL, 0, 0, 0 };
+
+    lock_mutex(&read_ahead.lock);
+    ahead.capacity = read_ahead.size;
+    unlock_mutex(&read_ahead.lock);
+
+    // Reads go through the read-ahead buffer from here on, which cannot seek
+    if (ahead.capacity && (ahead.buffer = (byte *)alloc_bytes(ahead.capacity)) != NULL)
+    {
+        buffered = *source;
+        buffered.read_file = buffered_read;
+        buffered.seek_file = NULL;
+        buffered.file = &ahead;
+        func_def = &buffered;
+    }
+
+    if (metrics)
+        func_def = meter_file(&meter, &metered, func_def, metrics);
+
+    start = stamp(metrics);
+
+    if (!read_header(&header, func_def))
+    {
+        source->close_file(source->file);
+        free(ahead.buffer);
+        return false;
+    }
+
+    // The palette is the last thing read_header reads
+    if (metrics)
+    {
+        uint64_t palette = header.palette_size ? meter.last_ns : 0;
+
+        metrics->header_ns += now_ns() - start - palette;
+        metrics->palette_ns += palette;
+    }
+
+    byte image_type = header.image_type;
+    byte bits_per_pixel = header.bits_per_pixel;
+    byte *color_data = header.palette;
+    size_t palette_bytes = header.palette_size;
+
+    tga->width = header.width;
+    tga->height = header.height;
+    tga->channels = header.channels;
+
+    bool rle = image_type == TGA_TYPE_MAPPED_RLE || image_type == TGA_TYPE_RGB_RLE || image_type == TGA_TYPE_BW_RLE;
+    bool spilled = false;
+    tga_admission admission = TGA_ADMIT_REJECTED;
+
+    // Project the peak memory of the load before anything large is allocated, sizes that
+    // overflow the address space of 32-bit platforms are rejected along the way
+    if ((uint64_t)tga->width * tga->height * 8 <= SIZE_MAX &&
+        get_pixel_format(image_type, bits_per_pixel, tga->channels, color_data, &format))
+    {
+        size_t pixels = (size_t)tga->width * tga->height;
+        size_t data_size = pixels * tga->channels;
+
+        // Spilled pixels live in the page cache, not in the budget
+        spilled = spills(data_size);
+        if (spilled)
+            data_size = 0;
+
+        size_t stream = data_size + palette_bytes + (rle ? TGA_STREAM_CHUNK : 0);
+        size_t full = data_size + palette_bytes + (rle ? pixels * (format.size + 1) : 0);
+
+        // Spilled RLE images are always streamed
+        if (spilled && rle)
+            full = stream;
+
+        admission = reserve_budget(full, stream, &reserved);
+
+        if (metrics && rle)
+        {
+            meter.body = meter.position;
+            meter.scan.pixel_size = format.size;
+            meter.scan.pixels = pixels;
+        }
+    }
+
+    uint64_t io = metrics ? meter.io_ns : 0;
+    start = stamp(metrics);
+
+    TGA_PROBE4(decode__start, image_type, bits_per_pixel, tga->width, tga->height);
+
+    // Unsupported format or over budget
+    if (admission == TGA_ADMIT_REJECTED)
+    {
+        success = false;
+    }
+    // Not enough memory for a temporary copy of the packets
+    else if ((admission == TGA_ADMIT_STREAM || spilled) && rle)
+    {
+        success = read_rle_streamed(tga, &format, func_def);
+    }
+    // Color-mapped image
+    else if (image_type == TGA_TYPE_MAPPED)
+    {
+        if (bits_per_pixel == 8)
+            success = read_mapped(tga, &color_data, func_def);
+    }
+    // True-color image
+    else if (image_type == TGA_TYPE_RGB)
+    {
+        if (bits_per_pixel == 24 || bits_per_pixel == 32)
+            success = read_rgb(tga, func_def);
+        else if (bits_per_pixel == 15 || bits_per_pixel == 16)
+            success = read_rgb16(tga, func_def);
+    }
+    // Black and white image
+    else if (image_type == TGA_TYPE_BW)
+    {
+        if (bits_per_pixel == 16 || bits_per_pixel == 8)
+            success = read_bw(tga, func_def);
+    }
+    // Run-length encoded image
+    else if (rle)
+    {
+        success = read_rle(tga, &format, func_def);
+    }
+
+    TGA_PROBE3(decode__done, image_type, success, success ? (size_t)tga->width * tga->height * tga->channels : 0);
+
+    if (metrics)
+    {
+        metrics->read_ns += meter.io_ns - io;
+        metrics->decode_ns += now_ns() - start - (meter.io_ns - io);
+        add_packets(metrics, &meter.scan);
+    }
+
+    start = stamp(metrics);
+    source->close_file(source->file);
+    free(ahead.buffer);
+
+    if (metrics)
+        metrics->close_ns += now_ns() - start;
+
+    if (success)
+    {
+        start = stamp(metrics);
+
+        if (header.flip_x)
+            flip_tga_horizontally(tga);
+
+        if (header.flip_y)
+            flip_tga_vertically(tga);
+
+        if (metrics)
+            metrics->flip_ns += now_ns() - start;
+    }
+    else
+    {
+        free_tga(tga);
+    }
+
+    free(color_data);
+    release_budget(reserved);
+
+    return success;
+}
+
+bool load_tga_ext(const char *filename, tga_image *tga, tga_func_def *func_def)
+{
+    if (!tga || !filename || !func_def)
+        return false;
+
+    TGA_PROBE1(load__start, filename);
+
+    bool success = read_image(filename, tga, func_def);
+
+    TGA_PROBE5(load__done, filename, success, success ? tga->width : 0, success ? tga->height : 0, success ? tga->channels : 0);
+    return success;
+}
+
+void free_tga(tga_image *tga)
+{
+    if (!tga)
+        return;
+
+    if (tga->data)
+        free_pixels(tga->data);
+
+    memset(tga, 0, sizeof(tga_image));
+}
+
+// Reads a whole file into the scratch buffer, which grows when the file does not fit
+static bool read_whole_file(const char *filename, byte **scratch, size_t *capacity, size_t *size)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return false;
+
+    // Unbuffered, so that a file that fits is read straight into the scratch buffer with a single call
+    setvbuf(file, NULL, _IONBF, 0);
+
+    *size = 0;
+
+    for (;;)
+    {
+        *size += fread(&(*scratch)[*size], sizeof(byte), *capacity - *size, file);
+
+        if (*size < *capacity)
+            break;
+
+        byte *grown = (byte *)realloc(*scratch, *capacity * 2);
+        if (!grown)
+        {
+            fclose(file);
+            return false;
+        }
+
+        *scratch = grown;
+        *capacity *= 2;
+    }
+
+    bool success = !ferror(file);
+
+    fclose(file);
+    return success;
+}
+
+// Decodes a whole file held in memory into the slab, past the images decoded so far
+static bool decode_into_slab(const byte *file, size_t file_size, byte **slab, size_t *slab_size, size_t *slab_capacity, tga_image *tga)
+{
+    tga_memory_stream mem = { file, file_size, 0 };
+    tga_func_def func_def;
+
+    func_def.read_file = mem_read;
+    func_def.seek_file = mem_seek;
+    func_def.file = &mem;
+
+    tga_header header;
+    tga_pixel_format format;
+
+    if (!read_header(&header, &func_def))
+        return false;
+
+    if (!header.width || !header.height || mem.position > file_size ||
+        !get_pixel_format(header.image_type, header.bits_per_pixel, header.channels, header.palette, &format))
+    {
+        free(header.palette);
+        return false;
+    }
+
+    size_t pixels = (size_t)header.width * header.height;
+    size_t data_size = pixels * header.channels;
+
+    if (*slab_size + data_size > *slab_capacity)
+    {
+        size_t capacity = *slab_capacity ? *slab_capacity : TGA_STREAM_CHUNK;
+
+        while (capacity < *slab_size + data_size)
+            capacity *= 2;
+
+        byte *grown = (byte *)realloc(*slab, capacity);
+        if (!grown)
+        {
+            free(header.palette);
+            return false;
+        }
+
+        *slab = grown;
+        *slab_capacity = capacity;
+    }
+
+    const byte *body = &file[mem.position];
+    size_t body_size = file_size - mem.position;
+    byte *data = &(*slab)[*slab_size];
+    bool success;
+
+    if (header.image_type == TGA_TYPE_MAPPED_RLE || header.image_type == TGA_TYPE_RGB_RLE || header.image_type == TGA_TYPE_BW_RLE)
+    {
+        tga_rle_state state = { 0 };
+        size_t decoded;
+
+        decode_rle(&state, &format, body, body_size, data, pixels, &decoded);
+        success = decoded == pixels;
+    }
+    else
+    {
+        success = body_size / format.size >= pixels;
+
+        if (success)
+            decode_raw(&format, body, data, pixels);
+    }
+
+    free(header.palette);
+
+    if (!success)
+        return false;
+
+    tga->width = header.width;
+    tga->height = header.height;
+    tga->channels = header.channels;
+    tga->data = data;
+
+    if (header.flip_x)
+        flip_tga_horizontally(tga);
+
+    if (header.flip_y)
+        flip_tga_vertically(tga);
+
+    *slab_size += data_size;
+    return true;
+}
+
+bool load_tga_batch(const char *const *filenames, int count, tga_image *images)
+{
+    if (!filenames || !images || count < 0)
+        return false;
+
+    size_t capacity = TGA_STREAM_CHUNK;
+    byte *scratch = (byte *)malloc(capacity);
+    size_t *offsets = (size_t *)malloc((count ? count : 1) * sizeof(size_t));
+
+    byte *slab = NULL;
+    size_t slab_size = 0;
+    size_t slab_capacity = 0;
+    bool success = scratch && offsets;
+
+    for (int i = 0; i < count; i++)
+    {
+        size_t size;
+
+        memset(&images[i], 0, sizeof(tga_image));
+        offsets[i] = slab_size;
+
+        if (!scratch || !offsets || !filenames[i] || !read_whole_file(filenames[i], &scratch, &capacity, &size) ||
+            !decode_into_slab(scratch, size, &slab, &slab_size, &slab_capacity, &images[i]))
+        {
+            memset(&images[i], 0, sizeof(tga_image));
+            success = false;
+        }
+    }
+
+    free(scratch);
+
+    if (slab && slab_size < slab_capacity)
+    {
+        byte *shrunk = (byte *)realloc(slab, slab_size);
+        if (shrunk)
+            slab = shrunk;
+    }
+
+    // The slab may have moved while it grew, so pointers are only set once it is final
+    for (int i = 0; i < count && offsets; i++)
+    {
+        if (images[i].data)
+            images[i].data = &slab[offsets[i]];
+    }
+
+    if (!slab_size)
+        free(slab);
+
+    free(offsets);
+    return success;
+}
+
+void free_tga_batch(tga_image *images, int count)
+{
+    if (!images)
+        return;
+
+    // The first loaded image starts the slab
+    for (int i = 0; i < count; i++)
+    {
+        if (images[i].data)
+        {
+            free(images[i].data);
+            break;
+        }
+    }
+
+    memset(images, 0, count * sizeof(tga_image));
+}
+
+typedef struct
+{
+    const char *const *filenames;
+    int count;
+    const tga_array_desc *desc;
+    byte *data;
+    bool *failed;
+    bool verify;                // Only check the headers
+
+    tga_mutex lock;
+    int next;
+} tga_array_job;
+
+static int next_array_slice(tga_array_job *job)
+{
+    lock_mutex(&job->lock);
+    int slice = job->next < job->count ? job->next++ : -1;
+    unlock_mutex(&job->lock);
+
+    return slice;
+}
+
+// Stores a decoded row in a slice, converting the channels, the layout and the orientation on the way
+static void store_array_row(const tga_array_desc *desc, byte *slice, unsigned int y, const byte *row, unsigned int channels, bool flip_x)
+{
+    size_t width = desc->width;
+    size_t plane = (size_t)desc->width * desc->height;
+    float *values = (float *)slice;
+
+    for (size_t x = 0; x < width; x++)
+    {
+        const byte *pixel = &row[(flip_x ? width - x - 1 : x) * channels];
+
+        for (size_t c = 0; c < desc->channels; c++)
+        {
+            byte value = c < channels ? pixel[c] : 255;
+            size_t index = desc->layout == TGA_ARRAY_NCHW ? c * plane + y * width + x : (y * width + x) * desc->channels + c;
+
+            if (desc->normalize)
+                values[index] = value * (1.0f / 255.0f);
+            else
+                slice[index] = value;
+        }
+    }
+}
+
+// Decodes a file row by row straight into its slice, the chunk holds TGA_STREAM_CHUNK bytes and at least one
+// file row and the row buffer holds one decoded row
+static bool decode_array_slice(const tga_array_job *job, int slice, byte *chunk, byte *row)
+{
+    const tga_array_desc *desc = job->desc;
+    tga_func_def func_def;
+
+    default_file_funcs(&func_def);
+    func_def.file = NULL;
+
+    func_def.file = func_def.open_file(job->filenames[slice], "rb", func_def.file);
+    if (!func_def.file)
+        return false;
+
+    tga_header header;
+    tga_pixel_format format;
+    bool success = read_header(&header, &func_def);
+
+    if (success)
+    {
+        success = header.width == desc->width && header.height == desc->height &&
+                  get_pixel_format(header.image_type, header.bits_per_pixel, header.channels, header.palette, &format);
+    }
+
+    if (!success || job->verify)
+    {
+        func_def.close_file(func_def.file);
+        free(header.palette);
+        return success;
+    }
+
+    size_t slice_size = (size_t)desc->width * desc->height * desc->channels * (desc->normalize ? sizeof(float) : sizeof(byte));
+    byte *data = &job->data[slice * slice_size];
+    bool rle = header.image_type == TGA_TYPE_MAPPED_RLE || header.image_type == TGA_TYPE_RGB_RLE || header.image_type == TGA_TYPE_BW_RLE;
+
+    // Rows already in the requested form are decoded in place
+    bool direct = desc->layout == TGA_ARRAY_NHWC && !desc->normalize && desc->channels == header.channels && !header.flip_x;
+
+    tga_row_reader reader = { &func_def, &header, &format, rle, chunk, 0, { 0 } };
+
+    for (unsigned int i = 0; success && i < header.height; i++)
+    {
+        unsigned int y = header.flip_y ? header.height - i - 1 : i;
+        byte *dest = direct ? &data[(size_t)y * desc->width * desc->channels] : row;
+
+        success = read_row(&reader, dest);
+
+        if (success && !direct)
+            store_array_row(desc, data, y, row, header.channels, header.flip_x);
+    }
+
+    func_def.close_file(func_def.file);
+    free(header.palette);
+    return success;
+}
+
+static void *array_worker(void *arg)
+{
+    tga_array_job *job = (tga_array_job *)arg;
+    size_t chunk_size = (size_t)job->desc->width * 4 > TGA_STREAM_CHUNK ? (size_t)job->desc->width * 4 : TGA_STREAM_CHUNK;
+
+    byte *chunk = job->verify ? NULL : (byte *)malloc(chunk_size);
+    byte *row = job->verify ? NULL : (byte *)malloc((size_t)job->desc->width * 4);
+    bool ready = job->verify || (chunk && row);
+
+    for (int slice; (slice = next_array_slice(job)) >= 0;)
+    {
+        if (!job->failed[slice] && (!ready || !decode_array_slice(job, slice, chunk, row)))
+            job->failed[slice] = true;
+    }
+
+    free(chunk);
+    free(row);
+    return NULL;
+}
+
+bool load_tga_array(const char *const *filenames, int count, void *data, const tga_array_desc *desc, bool *failed)
+{
+    if (!filenames || count < 0 || !data || !desc || !desc->width || !desc->height ||
+        desc->channels < 1 || desc->channels > 4 || (desc->layout != TGA_ARRAY_NHWC && desc->layout != TGA_ARRAY_NCHW))
+        return false;
+
+    tga_array_job job;
+
+    job.filenames = filenames;
+    job.count = count;
+    job.desc = desc;
+    job.data = (byte *)data;
+    job.failed = failed ? failed : (bool *)calloc(count ? count : 1, sizeof(bool));
+    job.verify = true;
+
+    if (!job.failed)
+        return false;
+
+    for (int i = 0; i < count; i++)
+        job.failed[i] = !filenames[i];
+
+    int threads = desc->threads > 0 ? desc->threads : count_cores();
+    if (threads > count)
+        threads = count;
+
+    init_mutex(&job.lock);
+
+    // All headers are checked before anything is decoded, so that a mismatch leaves the buffer untouched
+    job.next = 0;
+    run_parallel(threads, array_worker, &job);
+
+    bool success = true;
+
+    for (int i = 0; i < count; i++)
+        success = success && !job.failed[i];
+
+    if (success)
+    {
+        job.verify = false;
+        job.next = 0;
+        run_parallel(threads, array_worker, &job);
+
+        for (int i = 0; i < count; i++)
+            success = success && !job.failed[i];
+    }
+
+    destroy_mutex(&job.lock);
+
+    if (!failed)
+        free(job.failed);
+
+    return success;
+}
+
+// Fixed-point studio range coefficients, scaled by 256, for Y, U and V from R, G and B
+static const int yuv_coefficients[2][3][3] =
+{
+    { { 66, 129, 25 }, { -38, -74, 112 }, { 112, -94, -18 } },     // BT.601
+    { { 47, 157, 16 }, { -26, -87, 112 }, { 112, -102, -10 } }      // BT.709
+};
+
+static void store_luma(const int (*k)[3], const byte *row, unsigned int width, unsigned int channels, bool flip_x, byte *luma)
+{
+    for (unsigned int x = 0; x < width; x++)
+    {
+        const byte *pixel = &row[(size_t)(flip_x ? width - x - 1 : x) * channels];
+        luma[x] = (byte)(((k[0][0] * pixel[0] + k[0][1] * pixel[1] + k[0][2] * pixel[2] + 128) >> 8) + 16);
+    }
+}
+
+static void store_chroma_444(const int (*k)[3], const byte *row, unsigned int width, unsigned int channels, bool flip_x, byte *u, byte *v)
+{
+    for (unsigned int x = 0; x < width; x++)
+    {
+        const byte *pixel = &row[(size_t)(flip_x ? width - x - 1 : x) * channels];
+
+        u[x] = (byte)(((k[1][0] * pixel[0] + k[1][1] * pixel[1] + k[1][2] * pixel[2] + 128) >> 8) + 128);
+        v[x] = (byte)(((k[2][0] * pixel[0] + k[2][1] * pixel[1] + k[2][2] * pixel[2] + 128) >> 8) + 128);
+    }
+}
+
+// Averages blocks of up to 2x2 pixels of one or two rows into chroma samples, step is 1 for planar
+// output and 2 for interleaved output
+static void store_chroma(const int (*k)[3], const byte *first, const byte *second, unsigned int width, unsigned int channels,
+                         bool flip_x, byte *u, byte *v, size_t step)
+{
+    for (unsigned int x = 0; x < width; x += 2)
+    {
+        int r = 0, g = 0, b = 0, count = 0;
+
+        for (unsigned int i = x; i < x + 2 && i < width; i++)
+        {
+            size_t index = (size_t)(flip_x ? width - i - 1 : i) * channels;
+
+            r += first[index];
+            g += first[index + 1];
+            b += first[index + 2];
+            count++;
+
+            if (second)
+            {
+                r += second[index];
+                g += second[index + 1];
+                b += second[index + 2];
+                count++;
+            }
+        }
+
+        // The sums are weighted by 256 * count, the offsets keep them positive before the division
+        int scale = 256 * count;
+        size_t c = x / 2 * step;
+
+        u[c] = (byte)((k[1][0] * r + k[1][1] * g + k[1][2] * b + 128 * scale + scale / 2) / scale);
+        v[c] = (byte)((k[2][0] * r + k[2][1] * g + k[2][2] * b + 128 * scale + scale / 2) / scale);
+    }
+}
+
+bool load_tga_yuv(const char *filename, tga_yuv_image *yuv, tga_yuv_format format, tga_yuv_matrix matrix)
+{
+    tga_func_def func_def;
+
+    default_file_funcs(&func_def);
+
+    return load_tga_yuv_ext(filename, yuv, format, matrix, &func_def);
+}
+
+bool load_tga_yuv_ext(const char *filename, tga_yuv_image *yuv, tga_yuv_format format, tga_yuv_matrix matrix, tga_func_def *func_def)
+{
+    if (!filename || !yuv || !func_def || (matrix != TGA_YUV_BT601 && matrix != TGA_YUV_BT709) ||
+        (format != TGA_YUV_444 && format != TGA_YUV_I420 && format != TGA_YUV_NV12))
+        return false;
+
+    memset(yuv, 0, sizeof(tga_yuv_image));
+
+    func_def->file = func_def->open_file(filename, "rb", func_def->file);
+    if (!func_def->file)
+        return false;
+
+    tga_header header;
+    tga_pixel_format pixel_format;
+
+    if (!read_header(&header, func_def))
+    {
+        func_def->close_file(func_def->file);
+        return false;
+    }
+
+    if (!header.width || !header.height ||
+        !get_pixel_format(header.image_type, header.bits_per_pixel, header.channels, header.palette, &pixel_format))
+    {
+        func_def->close_file(func_def->file);
+        free(header.palette);
+        return false;
+    }
+
+    unsigned int width = header.width;
+    unsigned int height = header.height;
+    unsigned int chroma_width = format == TGA_YUV_444 ? width : (width + 1) / 2;
+    unsigned int chroma_height = format == TGA_YUV_444 ? height : (height + 1) / 2;
+    size_t luma_size = (size_t)width * height;
+    size_t chroma_size = (size_t)chroma_width * chroma_height;
+    size_t row_size = (size_t)width * header.channels;
+    size_t chunk_size = (size_t)width * 4 > TGA_STREAM_CHUNK ? (size_t)width * 4 : TGA_STREAM_CHUNK;
+
+    byte *data = (byte *)malloc(luma_size + 2 * chroma_size);
+    byte *chunk = (byte *)malloc(chunk_size);
+    byte *rows = (byte *)malloc(2 * row_size);
+    bool success = data && chunk && rows;
+
+    yuv->width = width;
+    yuv->height = height;
+    yuv->format = format;
+    yuv->planes[0] = data;
+    yuv->strides[0] = width;
+
+    if (format == TGA_YUV_NV12)
+    {
+        yuv->planes[1] = data + luma_size;
+        yuv->strides[1] = chroma_width * 2;
+    }
+    else
+    {
+        yuv->planes[1] = data + luma_size;
+        yuv->planes[2] = data + luma_size + chroma_size;
+        yuv->strides[1] = chroma_width;
+        yuv->strides[2] = chroma_width;
+    }
+
+    const int (*k)[3] = yuv_coefficients[matrix];
+    bool rle = header.image_type == TGA_TYPE_MAPPED_RLE || header.image_type == TGA_TYPE_RGB_RLE || header.image_type == TGA_TYPE_BW_RLE;
+    tga_row_reader reader = { func_def, &header, &pixel_format, rle, chunk, 0, { 0 } };
+
+    bool pending = false;
+
+    // Rows arrive in file order, the first row of a chroma pair waits in the other buffer until the second one is decoded
+    for (unsigned int i = 0; success && i < height; i++)
+    {
+        unsigned int y = header.flip_y ? height - i - 1 : i;
+        byte *row = &rows[(i % 2) * row_size];
+        const byte *previous = &rows[((i + 1) % 2) * row_size];
+
+        success = read_row(&reader, row);
+        if (!success)
+            break;
+
+        store_luma(k, row, width, header.channels, header.flip_x, &yuv->planes[0][(size_t)y * width]);
+
+        if (format == TGA_YUV_444)
+        {
+            size_t offset = (size_t)y * width;
+            store_chroma_444(k, row, width, header.channels, header.flip_x, &yuv->planes[1][offset], &yuv->planes[2][offset]);
+            continue;
+        }
+
+        // The last row of an odd height has no pair
+        bool single = (y ^ 1) >= height;
+
+        if (!single && !pending)
+        {
+            pending = true;
+            continue;
+        }
+
+        const byte *other = single ? NULL : previous;
+        size_t offset = (size_t)(y / 2) * yuv->strides[1];
+
+        if (format == TGA_YUV_NV12)
+            store_chroma(k, row, other, width, header.channels, header.flip_x, &yuv->planes[1][offset], &yuv->planes[1][offset + 1], 2);
+        else
+            store_chroma(k, row, other, width, header.channels, header.flip_x, &yuv->planes[1][offset], &yuv->planes[2][offset], 1);
+
+        pending = false;
+    }
+
+    func_def->close_file(func_def->file);
+
+    free(header.palette);
+    free(chunk);
+    free(rows);
+
+    if (!success)
+    {
+        free(data);
+        memset(yuv, 0, sizeof(tga_yuv_image));
+    }
+
+    return success;
+}
+
+void free_tga_yuv(tga_yuv_image *yuv)
+{
+    if (!yuv)
+        return;
+
+    free(yuv->planes[0]);
+    memset(yuv, 0, sizeof(tga_yuv_image));
+}
+
+struct tga_decoder
+{
+    tga_row_func func;
+    void *user;
+    tga_image image;            // Assembled when there is no callback
+
+    tga_memory_buffer prefix;   // Header, image ID and palette until all of them have arrived
+    bool ready;
+    bool failed;
+    tga_header header;
+    tga_pixel_format format;
+    bool rle;
+
+    unsigned int rows;          // Rows finished so far, in file order
+    byte *row;                  // Row being decoded
+    size_t done;                // Pixels of the row decoded so far, or bytes received for uncompressed rows
+    byte *raw;                  // Uncompressed row as stored
+    tga_rle_state state;
+    byte carry[16];             // Packet cut off at the end of the previous chunk
+    size_t carried;
+};
+
+tga_decoder *tga_decoder_create(tga_row_func func, void *user)
+{
+    tga_decoder *decoder = (tga_decoder *)calloc(1, sizeof(tga_decoder));
+    if (!decoder)
+        return NULL;
+
+    decoder->func = func;
+    decoder->user = user;
+
+    return decoder;
+}
+
+void tga_decoder_destroy(tga_decoder *decoder)
+{
+    if (!decoder)
+        return;
+
+    free_tga(&decoder->image);
+    free(decoder->prefix.data);
+    free(decoder->header.palette);
+    free(decoder->row);
+    free(decoder->raw);
+    free(decoder);
+}
+
+bool tga_decoder_info(const tga_decoder *decoder, unsigned int *width, unsigned int *height, unsigned int *channels)
+{
+    if (!decoder || !decoder->ready)
+        return false;
+
+    if (width)
+        *width = decoder->header.width;
+
+    if (height)
+        *height = decoder->header.height;
+
+    if (channels)
+        *channels = decoder->header.channels;
+
+    return true;
+}
+
+// Parses the header once it has arrived with the image ID and the palette, returns the bytes of the chunk it used
+static size_t push_prefix(tga_decoder *decoder, const byte *data, size_t size)
+{
+    tga_memory_buffer *prefix = &decoder->prefix;
+    size_t needed = 18;
+    bool sized = prefix->size >= 18;
+
+    if (sized)
+    {
+        const byte *header = prefix->data;
+        needed += header[0] + (header[1] ? ((size_t)header[6] << 8 | header[5]) * (header[7] / 8) : 0);
+    }
+
+    size_t take = needed - prefix->size < size ? needed - prefix->size : size;
+
+    if (mem_write((void *)data, sizeof(byte), take, prefix) != take)
+    {
+        decoder->failed = true;
+        return take;
+    }
+
+    // The header itself gives the size of the rest
+    if (!sized && prefix->size == 18)
+        return take + push_prefix(decoder, &data[take], size - take);
+
+    if (prefix->size < needed)
+        return take;
+
+    tga_memory_stream mem = { prefix->data, prefix->size, 0 };
+    tga_func_def func_def;
+
+    func_def.read_file = mem_read;
+    func_def.seek_file = mem_seek;
+    func_def.file = &mem;
+
+    if (!read_header(&decoder->header, &func_def) || !decoder->header.width || !decoder->header.height ||
+        !get_pixel_format(decoder->header.image_type, decoder->header.bits_per_pixel, decoder->header.channels,
+                          decoder->header.palette, &decoder->format))
+    {
+        decoder->failed = true;
+        return take;
+    }
+
+    tga_header *header = &decoder->header;
+    size_t row_size = (size_t)header->width * header->channels;
+
+    decoder->rle = header->image_type == TGA_TYPE_MAPPED_RLE || header->image_type == TGA_TYPE_RGB_RLE || header->image_type == TGA_TYPE_BW_RLE;
+    decoder->raw = decoder->rle ? NULL : (byte *)malloc((size_t)header->width * decoder->format.size);
+
+    if (decoder->func)
+    {
+        decoder->row = (byte *)malloc(row_size);
+    }
+    else
+    {
+        decoder->image.width = header->width;
+        decoder->image.height = header->height;
+        decoder->image.channels = header->channels;
+        decoder->image.data = alloc_pixels(row_size * header->height);
+    }
+
+    if ((!decoder->rle && !decoder->raw) || (decoder->func ? !decoder->row : !decoder->image.data))
+        decoder->failed = true;
+
+    free(prefix->data);
+    memset(prefix, 0, sizeof(tga_memory_buffer));
+
+    decoder->ready = true;
+    return take;
+}
+
+static byte *decoder_row(tga_decoder *decoder)
+{
+    unsigned int y = decoder->header.flip_y ? decoder->header.height - decoder->rows - 1 : decoder->rows;
+    return decoder->func ? decoder->row : &decoder->image.data[(size_t)y * decoder->header.width * decoder->header.channels];
+}
+
+static void finish_row(tga_decoder *decoder)
+{
+    const tga_header *header = &decoder->header;
+    unsigned int y = header->flip_y ? header->height - decoder->rows - 1 : decoder->rows;
+    byte *row = decoder_row(decoder);
+
+    if (header->flip_x)
+    {
+        for (unsigned int x = 0; x < header->width / 2; x++)
+        {
+            for (unsigned int k = 0; k < header->channels; k++)
+                swap_byte(&row[x * header->channels + k], &row[(header->width - x - 1) * header->channels + k]);
+        }
+    }
+
+    if (decoder->func)
+        decoder->func(row, y, decoder->user);
+
+    decoder->rows++;
+    decoder->done = 0;
+}
+
+// Decodes packets into the rows, returns the bytes used. Stops short only when a packet is cut off or the image is complete.
+static size_t decode_packets(tga_decoder *decoder, const byte *data, size_t size)
+{
+    size_t used = 0;
+    size_t channels = decoder->header.channels;
+
+    while (used < size && decoder->rows < decoder->header.height)
+    {
+        size_t decoded;
+        size_t width = decoder->header.width;
+
+        used += decode_rle(&decoder->state, &decoder->format, &data[used], size - used,
+                           &decoder_row(decoder)[decoder->done * channels], width - decoder->done, &decoded);
+
+        decoder->done += decoded;
+
+        if (decoder->done == width)
+            finish_row(decoder);
+        else if (!decoded)
+            break;
+    }
+
+    return used;
+}
+
+static void push_pixels(tga_decoder *decoder, const byte *data, size_t size)
+{
+    const tga_header *header = &decoder->header;
+
+    if (!decoder->rle)
+    {
+        size_t row_size = (size_t)header->width * decoder->format.size;
+
+        while (size && decoder->rows < header->height)
+        {
+            size_t take = row_size - decoder->done < size ? row_size - decoder->done : size;
+
+            memcpy(&decoder->raw[decoder->done], data, take);
+            decoder->done += take;
+            data += take;
+            size -= take;
+
+            if (decoder->done == row_size)
+            {
+                decode_raw(&decoder->format, decoder->raw, decoder_row(decoder), header->width);
+                finish_row(decoder);
+            }
+        }
+
+        return;
+    }
+
+    while (size && decoder->rows < header->height)
+    {
+        if (!decoder->carried)
+        {
+            size_t used = decode_packets(decoder, data, size);
+
+            data += used;
+            size -= used;
+
+            // What is left is a packet cut off at the end of the chunk
+            if (size && decoder->rows < header->height)
+            {
+                memcpy(decoder->carry, data, size);
+                decoder->carried = size;
+            }
+
+            return;
+        }
+
+        // Complete the cut off packet with the start of the new chunk
+        size_t carried = decoder->carried;
+        size_t take = sizeof(decoder->carry) - carried < size ? sizeof(decoder->carry) - carried : size;
+
+        memcpy(&decoder->carry[carried], data, take);
+
+        size_t total = carried + take;
+        size_t used = decode_packets(decoder, decoder->carry, total);
+
+        if (used >= carried)
+        {
+            data += used - carried;
+            size -= used - carried;
+            decoder->carried = 0;
+        }
+        else
+        {
+            memmove(decoder->carry, &decoder->carry[used], total - used);
+            decoder->carried = total - used;
+            data += take;
+            size -= take;
+        }
+    }
+}
+
+bool tga_push(tga_decoder *decoder, const void *data, size_t size)
+{
+    if (!decoder || (!data && size) || decoder->failed)
+        return false;
+
+    const byte *bytes = (const byte *)data;
+
+    if (!decoder->ready)
+    {
+        size_t used = push_prefix(decoder, bytes, size);
+
+        bytes += used;
+        size -= used;
+    }
+
+    if (decoder->ready && !decoder->failed)
+        push_pixels(decoder, bytes, size);
+
+    return !decoder->failed;
+}
+
+bool tga_decoder_finish(tga_decoder *decoder, tga_image *tga)
+{
+    if (!decoder || decoder->failed || !decoder->ready || decoder->rows < decoder->header.height)
+        return false;
+
+    if (tga && !decoder->func)
+    {
+        *tga = decoder->image;
+        memset(&decoder->image, 0, sizeof(tga_image));
+    }
+
+    return true;
+}
+
+// Start of a band of rows in an RLE packet stream, packets may continue from the previous band
+typedef struct
+{
+    long offset;
+    tga_rle_state state;
+} tga_band_start;
+
+struct tga_lazy_image
+{
+    tga_func_def func_def;
+    tga_mutex lock;
+    tga_header header;
+    tga_pixel_format format;
+    bool rle;
+
+    unsigned int band_rows;
+    unsigned int band_count;
+    byte **bands;               // Decoded bands in file order, NULL until first accessed
+    tga_band_start *starts;     // Known band starts of RLE images
+    unsigned int indexed;
+    byte *chunk;
+};
+
+tga_lazy_image *tga_lazy_open(const char *filename)
+{
+    tga_func_def func_def;
+
+    default_file_funcs(&func_def);
+
+    return tga_lazy_open_ext(filename, &func_def);
+}
+
+tga_lazy_image *tga_lazy_open_ext(const char *filename, tga_func_def *func_def)
+{
+    if (!filename || !func_def)
+        return NULL;
+
+    tga_lazy_image *lazy = (tga_lazy_image *)calloc(1, sizeof(tga_lazy_image));
+    if (!lazy)
+        return NULL;
+
+    lazy->func_def = *func_def;
+    lazy->func_def.file = lazy->func_def.open_file(filename, "rb", func_def->file);
+    if (!lazy->func_def.file)
+    {
+        free(lazy);
+        return NULL;
+    }
+
+    tga_header *header = &lazy->header;
+
+    if (!read_header(header, &lazy->func_def) || !header->width || !header->height ||
+        !get_pixel_format(header->image_type, header->bits_per_pixel, header->channels, header->palette, &lazy->format))
+    {
+        lazy->func_def.close_file(lazy->func_def.file);
+        free(header->palette);
+        free(lazy);
+        return NULL;
+    }
+
+    size_t row_size = (size_t)header->width * header->channels;
+
+    lazy->rle = header->image_type == TGA_TYPE_MAPPED_RLE || header->image_type == TGA_TYPE_RGB_RLE || header->image_type == TGA_TYPE_BW_RLE;
+    lazy->band_rows = row_size < TGA_STREAM_CHUNK ? (unsigned int)(TGA_STREAM_CHUNK / row_size) : 1;
+
+    if (lazy->band_rows > header->height)
+        lazy->band_rows = header->height;
+
+    lazy->band_count = (header->height + lazy->band_rows - 1) / lazy->band_rows;
+    lazy->bands = (byte **)calloc(lazy->band_count, sizeof(byte *));
+    lazy->starts = (tga_band_start *)calloc(lazy->rle ? lazy->band_count : 1, sizeof(tga_band_start));
+    lazy->chunk = (byte *)malloc(TGA_STREAM_CHUNK);
+
+    if (!lazy->bands || !lazy->starts || !lazy->chunk)
+    {
+        tga_lazy_close(lazy);
+        return NULL;
+    }
+
+    lazy->starts[0].offset = header->data_offset;
+    lazy->indexed = 1;
+
+    init_mutex(&lazy->lock);
+    return lazy;
+}
+
+void tga_lazy_close(tga_lazy_image *lazy)
+{
+    if (!lazy)
+        return;
+
+    // A handle that failed to open has no lock yet
+    if (lazy->indexed)
+        destroy_mutex(&lazy->lock);
+
+    for (unsigned int i = 0; lazy->bands && i < lazy->band_count; i++)
+        free(lazy->bands[i]);
+
+    lazy->func_def.close_file(lazy->func_def.file);
+
+    free(lazy->bands);
+    free(lazy->starts);
+    free(lazy->chunk);
+    free(lazy->header.palette);
+    free(lazy);
+}
+
+void tga_lazy_info(const tga_lazy_image *lazy, unsigned int *width, unsigned int *height, unsigned int *channels)
+{
+    if (width)
+        *width = lazy ? lazy->header.width : 0;
+
+    if (height)
+        *height = lazy ? lazy->header.height : 0;
+
+    if (channels)
+        *channels = lazy ? lazy->header.channels : 0;
+}
+
+// Decodes the pixels of a band of an RLE image from its start and records the start of the next band
+static bool decode_rle_band(tga_lazy_image *lazy, unsigned int band, byte *data, size_t pixels)
+{
+    tga_band_start start = lazy->starts[band];
+    size_t consumed;
+
+    if (lazy->func_def.seek_file(lazy->func_def.file, start.offset, SEEK_SET) != 0)
+        return false;
+
+    if (!stream_rle(&start.state, &lazy->format, lazy->chunk, data, pixels, &consumed, &lazy->func_def))
+        return false;
+
+    if (band + 1 == lazy->indexed && lazy->indexed < lazy->band_count)
+    {
+        lazy->starts[band + 1].offset = start.offset + (long)consumed;
+        lazy->starts[band + 1].state = start.state;
+        lazy->indexed++;
+    }
+
+    return true;
+}
+
+static bool decode_raw_band(tga_lazy_image *lazy, unsigned int band, byte *data, size_t pixels)
+{
+    const tga_pixel_format *format = &lazy->format;
+    size_t first = (size_t)band * lazy->band_rows * lazy->header.width;
+    long offset = lazy->header.data_offset + (long)(first * format->size);
+
+    if (lazy->func_def.seek_file(lazy->func_def.file, offset, SEEK_SET) != 0)
+        return false;
+
+    size_t chunk_pixels = TGA_STREAM_CHUNK / (size_t)format->size;
+
+    for (size_t done = 0, count; done < pixels; done += count)
+    {
+        count = pixels - done < chunk_pixels ? pixels - done : chunk_pixels;
+
+        if (lazy->func_def.read_file(lazy->chunk, format->size, count, lazy->func_def.file) != count)
+            return false;
+
+        for (size_t i = 0; i < count; i++)
+            decode_pixel(format, &lazy->chunk[i * format->size], &data[(done + i) * format->channels]);
+    }
+
+    return true;
+}
+
+static bool decode_band(tga_lazy_image *lazy, unsigned int band)
+{
+    unsigned int width = lazy->header.width;
+    unsigned int channels = lazy->header.channels;
+    unsigned int rows = band + 1 < lazy->band_count ? lazy->band_rows : lazy->header.height - band * lazy->band_rows;
+    size_t pixels = (size_t)rows * width;
+
+    // Room for a whole band, the bands before it are decoded into the same buffer
+    byte *data = (byte *)malloc((size_t)lazy->band_rows * width * channels);
+    if (!data)
+        return false;
+
+    bool success = true;
+
+    if (lazy->rle)
+    {
+        // Bands before the first one accessed are decoded once to find where their packets end
+        for (unsigned int i = lazy->indexed - 1; success && i < band; i++)
+            success = decode_rle_band(lazy, i, data, (size_t)lazy->band_rows * width);
+
+        success = success && decode_rle_band(lazy, band, data, pixels);
+    }
+    else
+    {
+        success = decode_raw_band(lazy, band, data, pixels);
+    }
+
+    if (!success)
+    {
+        free(data);
+        return false;
+    }
+
+    if (lazy->header.flip_x)
+    {
+        for (unsigned int y = 0; y < rows; y++)
+        {
+            byte *row = &data[(size_t)y * width * channels];
+
+            for (unsigned int x = 0; x < width / 2; x++)
+            {
+                for (unsigned int k = 0; k < channels; k++)
+                    swap_byte(&row[x * channels + k], &row[(width - x - 1) * channels + k]);
+            }
+        }
+    }
+
+    lazy->bands[band] = data;
+    return true;
+}
+
+const unsigned char *tga_lazy_row(tga_lazy_image *lazy, unsigned int y)
+{
+    if (!lazy || y >= lazy->header.height)
+        return NULL;
+
+    unsigned int row = lazy->header.flip_y ? lazy->header.height - y - 1 : y;
+    unsigned int band = row / lazy->band_rows;
+    const byte *data = NULL;
+
+    lock_mutex(&lazy->lock);
+
+    if (lazy->bands[band] || decode_band(lazy, band))
+        data = &lazy->bands[band][(size_t)(row % lazy->band_rows) * lazy->header.width * lazy->header.channels];
+
+    unlock_mutex(&lazy->lock);
+    return data;
+}
+
+bool tga_lazy_read(tga_lazy_image *lazy, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned char *data)
+{
+    if (!lazy || !data || x > lazy->header.width || width > lazy->header.width - x ||
+        y > lazy->header.height || height > lazy->header.height - y)
+        return false;
+
+    size_t channels = lazy->header.channels;
+
+    for (unsigned int i = 0; i < height; i++)
+    {
+        const byte *row = tga_lazy_row(lazy, y + i);
+        if (!row)
+            return false;
+
+        memcpy(&data[(size_t)i * width * channels], &row[x * channels], width * channels);
+    }
+
+    return true;
+}
+
+#define HASH_PRIME1     0x9e3779b185ebca87ULL
+#define HASH_PRIME2     0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3     0x165667b19e3779f9ULL
+
+static uint64_t read_u64(const byte *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+           (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint64_t rotate_left(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static uint64_t hash_round(uint64_t hash, uint64_t value)
+{
+    return rotate_left(hash + value * HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+// A fast non-cryptographic hash, it does not depend on the byte order of the machine
+uint64_t tga_hash(const void *data, size_t size)
+{
+    const byte *p = (const byte *)data;
+    uint64_t hash = HASH_PRIME3 + size;
+
+    // Four independent lanes keep the multipliers busy on large buffers
+    if (size >= 32)
+    {
+        uint64_t lanes[4] = { HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, 0 - HASH_PRIME1 };
+
+        for (; size >= 32; p += 32, size -= 32)
+        {
+            lanes[0] = hash_round(lanes[0], read_u64(&p[0]));
+            lanes[1] = hash_round(lanes[1], read_u64(&p[8]));
+            lanes[2] = hash_round(lanes[2], read_u64(&p[16]));
+            lanes[3] = hash_round(lanes[3], read_u64(&p[24]));
+        }
+
+        hash += rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+
+        for (int i = 0; i < 4; i++)
+            hash = (hash ^ hash_round(0, lanes[i])) * HASH_PRIME1 + HASH_PRIME3;
+    }
+
+    for (; size >= 8; p += 8, size -= 8)
+        hash = rotate_left(hash ^ hash_round(0, read_u64(p)), 27) * HASH_PRIME1 + HASH_PRIME3;
+
+    for (; size; p++, size--)
+        hash = rotate_left(hash ^ (*p * HASH_PRIME3), 11) * HASH_PRIME1;
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+bool save_tga(const char *filename, tga_image *tga, const tga_type type)
+{
+    tga_func_def func_def;
+
+    default_file_funcs(&func_def);
+
+    return save_tga_ext(filename, tga, type, &func_def);
+}
+
+static int generate_palette(const tga_image *tga, size_t size, byte **palette_data, byte **color_data)
+{
+    int palette_size = 0;
+
+    // Room for one color more than supported, to notice the overflow
+    *palette_data = (byte *)alloc_bytes(257 * tga->channels);
+    if (!*palette_data)
+        return 0;
+
+    *color_data = alloc_pixels((size_t)tga->width * tga->height);
+    if (!*color_data)
+    {
+        free(*palette_data);
+        return 0;
+    }
+
+    for (size_t i = 0, pixel = 0; i < size; i += tga->channels, pixel++)
+    {
+        bool found = false;
+
+        for (unsigned int j = 0, color = 0; j < palette_size * tga->channels; j += tga->channels, color++)
+        {
+            if (memcmp(&tga->data[i], &(*palette_data)[j], tga->channels) != 0)
+                continue;
+
+            (*color_data)[pixel] = color;
+            found = true;
+            break;
+        }
+
+        if (!found)
+        {
+            memcpy(&(*palette_data)[palette_size * tga->channels], &tga->data[i], tga->channels);
+            (*color_data)[pixel] = palette_size;
+            palette_size++;
+
+            // Supports only 256 colors
+            if (palette_size > 256)
+            {
+                free(*palette_data);
+                free_pixels(*color_data);
+                return 0;
+            }
+        }
+    }
+
+    // RGB to BGR
+    for (unsigned int j = 0; j < palette_size * tga->channels; j += tga->channels)
+        swap_byte(&(*palette_data)[j], &(*palette_data)[j + 2]);
+
+    return palette_size;
+}
+
+static bool write_mapped(const tga_image *tga, const byte *palette_data, const byte *color_data, int palette_size, const tga_func_def *func_def)
+{
+    size_t pixels = (size_t)tga->width * tga->height;
+
+    if (func_def->write_file((byte *)palette_data, sizeof(byte), palette_size, func_def->file) != (size_t)palette_size)
+        return false;
+
+    if (func_def->write_file((byte *)color_data, sizeof(byte), pixels, func_def->file) != pixels)
+        return false;
+
+    return true;
+}
+
+static bool write_rgb(const tga_image *tga, size_t size, const tga_func_def *func_def)
+{
+    bool success = true;
+
+    byte *data = (byte *)alloc_bytes(size);
+    if (!data)
+        return false;
+
+    for (size_t i = 0; i < size; i += tga->channels)
+        rgb_to_bgr(&tga->data[i], &data[i], tga->channels);
+
+    if (func_def->write_file(data, sizeof(byte), size, func_def->file) != size)
+        success = false;
+
+    free(data);
+    return success;
+}
+
+static bool write_rgb16(const tga_image *tga, size_t size, const tga_func_def *func_def)
+{
+    bool success = true;
+    size_t image_size = (size_t)tga->width * tga->height;
+
+    byte *data = (byte *)alloc_bytes(image_size * sizeof(word));
+    if (!data)
+        return false;
+
+    for (size_t i = 0, j = 0; i < size; i += tga->channels, j += sizeof(word))
+        rgb_to_rgb16(&tga->data[i], &data[j], tga->channels);
+
+    if (func_def->write_file(data, sizeof(word), image_size, func_def->file) != image_size)
+        success = false;
+
+    free(data);
+    return success;
+}
+
+static bool write_bw(const tga_image *tga, size_t size, int bits, const tga_func_def *func_def)
+{
+    bool success = true;
+    size_t image_size = (size_t)tga->width * tga->height;
+    size_t bytes = (bits == 16) ? sizeof(word) : sizeof(byte);
+
+    byte *data = (byte *)alloc_bytes(image_size * sizeof(word));
+    if (!data)
+        return false;
+
+    for (size_t i = 0, j = 0; i < size; i += tga->channels, j += bytes)
+        rgb_to_bw(&tga->data[i], &data[j], tga->channels, (int)bytes);
+
+    if (func_def->write_file(data, sizeof(byte), image_size * bytes, func_def->file) != image_size * bytes)
+        success = false;
+
+    free(data);
+    return success;
+}
+
+static int write_rle(const tga_image *tga, const byte *data, int channels, size_t index, byte *rle)
+{
+    int duplicates = 0;
+    int different = 0;
+
+    size_t row_size = (size_t)tga->width * channels;
+    size_t end_row = index + (row_size - (index) % row_size);
+
+    for (size_t j = index; j < end_row; j += channels)
+    {
+        // Duplicate pixels
+        if (!different)
+        {
+            if (j + channels < end_row && memcmp(&data[j], &data[j + channels], channels) == 0)
+            {
+                // A packet cannot contain more than 128 pixels
+                if (duplicates + 1 < 128)
+                {
+                    duplicates++;
+                    continue;
+                }
+            }
+
+            // Write a run-length packet
+            if (duplicates)
+            {
+                (*rle) = duplicates;
+                (*rle) |= 1 << 7;
+                return (*rle) - 127;
+            }
+        }
+
+        // A packet cannot contain more than 128 pixels
+        if (different + 1 < 128 && j + channels < end_row)
+        {
+            if (memcmp(&data[j], &data[j + channels], channels) != 0)
+            {
+                different++;
+                continue;
+            }
+            else
+            {
+                different--;
+            }
+        }
+
+        // Write a raw packet
+        (*rle) = different;
+        return -(*rle) - 1;
+    }
+
+    return 0;
+}
+
+static bool write_mapped_rle(tga_image *tga, const byte *palette_data, const byte *color_data, int palette_size, const tga_func_def *func_def)
+{
+    if (func_def->write_file((byte *)palette_data, sizeof(byte), palette_size, func_def->file) != (size_t)palette_size)
+        return false;
+
+    bool success = true;
+    size_t data_size = 0;
+    size_t size = (size_t)tga->width * tga->height;
+
+    byte *data = (byte *)alloc_bytes(size * 2);
+    if (!data)
+        return false;
+
+    for (size_t i = 0; i < size;)
+    {
+        int n = write_rle(tga, color_data, sizeof(byte), i, &data[data_size]);
+        if (!n)
+        {
+            free(data);
+            return false;
+        }
+
+        data_size++;
+
+        if (n > 0)
+        {
+            data[data_size] = color_data[i];
+            data_size++;
+        }
+        else
+        {
+            n = -n;
+
+            memcpy(&data[data_size], &color_data[i], n);
+            data_size += n;
+        }
+
+        i += n;
+    }
+
+    if (func_def->write_file(data, sizeof(byte), data_size, func_def->file) != data_size)
+        success = false;
+
+    free(data);
+    return success;
+}
+
+static bool write_rgb_rle(const tga_image *tga, size_t size, const tga_func_def *func_def)
+{
+    bool success = true;
+    size_t data_size = 0;
+
+    byte *data = (byte *)alloc_bytes(size + (size_t)tga->width * tga->height);
+    if (!data)
+        return false;
+
+    for (size_t i = 0; i < size;)
+    {
+        int n = write_rle(tga, tga->data, tga->channels, i, &data[data_size]);
+        if (!n)
+        {
+            free(data);
+            return false;
+        }
+
+        data_size++;
+
+        if (n > 0)
+        {
+            rgb_to_bgr(&tga->data[i], &data[data_size], tga->channels);
+            data_size += tga->channels;
+        }
+        else
+        {
+            n = -n;
+
+            for (int j = 0; j < n; j++)
+            {
+                rgb_to_bgr(&tga->data[i + j * tga->channels], &data[data_size], tga->channels);
+                data_size += tga->channels;
+            }
+        }
+
+        i += (size_t)n * tga->channels;
+    }
+
+    if (func_def->write_file(data, sizeof(byte), data_size, func_def->file) != data_size)
+        success = false;
+
+    free(data);
+    return success;
+}
+
+static bool write_rgb16_rle(const tga_image *tga, size_t size, const tga_func_def *func_def)
+{
+    bool success = true;
+    size_t data_size = 0;
+    size_t pixels = (size_t)tga->width * tga->height;
+
+    byte *data = (byte *)alloc_bytes(pixels * sizeof(word) + pixels);
+    if (!data)
+        return false;
+
+    for (size_t i = 0; i < size;)
+    {
+        int n = write_rle(tga, tga->data, tga->channels, i, &data[data_size]);
+        if (!n)
+        {
+            free(data);
+            return false;
+        }
+
+        data_size++;
+
+        if (n > 0)
+        {
+            rgb_to_rgb16(&tga->data[i], &data[data_size], tga->channels);
+            data_size += sizeof(word);
+        }
+        else
+        {
+            n = -n;
+
+            for (int j = 0; j < n; j++)
+            {
+                rgb_to_rgb16(&tga->data[i + j * tga->channels], &data[data_size], tga->channels);
+                data_size += sizeof(word);
+            }
+        }
+
+        i += (size_t)n * tga->channels;
+    }
+
+    if (func_def->write_file(data, sizeof(byte), data_size, func_def->file) != data_size)
+        success = false;
+
+    free(data);
+    return success;
+}
+
+static bool write_bw_rle(const tga_image *tga, size_t size, int bits, const tga_func_def *func_def)
+{
+    bool success = true;
+    int bytes = (bits == 16) ? sizeof(word) : sizeof(byte);
+    size_t data_size = 0;
+    size_t pixels = (size_t)tga->width * tga->height;
+
+    byte *data = (byte *)alloc_bytes(pixels * bytes + pixels);
+    if (!data)
+        return false;
+
+    for (size_t i = 0; i < size;)
+    {
+        int n = write_rle(tga, tga->data, tga->channels, i, &data[data_size]);
+        if (!n)
+        {
+            free(data);
+            return false;
+        }
+
+        data_size++;
+
+        if (n > 0)
+        {
+            rgb_to_bw(&tga->data[i], &data[data_size], tga->channels, bytes);
+            data_size += bytes;
+        }
+        else
+        {
+            n = -n;
+
+            for (int j = 0; j < n; j++)
+            {
+                rgb_to_bw(&tga->data[i + j * tga->channels], &data[data_size], tga->channels, bytes);
+                data_size += bytes;
+            }
+        }
+
+        i += (size_t)n * tga->channels;
+    }
+
+    if (func_def->write_file(data, sizeof(byte), data_size, func_def->file) != data_size)
+        success = false;
+
+    free(data);
+    return success;
+}
+
+static void encode_pixel(tga_type type, int bytes, const byte *pixel, byte *data, int channels)
+{
+    if (type == TGA_MAPPED || type == TGA_MAPPED_RLE)
+    {
+        data[0] = pixel[0];
+    }
+    else if (type == TGA_RGB || type == TGA_RGB_RLE)
+    {
+        rgb_to_bgr(pixel, data, channels);
+    }
+    else if (type == TGA_RGB16 || type == TGA_RGB16_RLE)
+    {
+        rgb_to_rgb16(pixel, data, channels);
+    }
+    else
+    {
+        rgb_to_bw(pixel, data, channels, bytes);
+    }
+}
+
+// Source of an image saved from float pixels, quantized a row at a time while it is written
+typedef struct
+{
+    const tga_float_image *image;
+    unsigned int flags;
+    int levels;                 // 255, or 31 when the file keeps 5 bits per channel
+} tga_quantizer;
+
+// Thresholds of a 4x4 ordered dither
+static const byte bayer_matrix[4][4] =
+{
+    { 0, 8, 2, 10 },
+    { 12, 4, 14, 6 },
+    { 3, 11, 1, 9 },
+    { 15, 7, 13, 5 }
+};
+
+// Linear to sRGB at 4096 evenly spaced points, filled on first use
+static struct
+{
+    tga_mutex lock;
+    bool ready;
+    float table[4097];
+} srgb = { TGA_MUTEX_INIT, false, { 0 } };
+
+static void init_srgb(void)
+{
+    lock_mutex(&srgb.lock);
+
+    for (int i = 0; !srgb.ready && i <= 4096; i++)
+    {
+        float value = i / 4096.0f;
+        srgb.table[i] = value <= 0.0031308f ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+    }
+
+    srgb.ready = true;
+    unlock_mutex(&srgb.lock);
+}
+
+static float linear_to_srgb(float value)
+{
+    float position = value * 4096.0f;
+    int index = (int)position;
+
+    if (index >= 4096)
+        return srgb.table[4096];
+
+    return srgb.table[index] + (srgb.table[index + 1] - srgb.table[index]) * (position - index);
+}
+
+static float half_to_float(uint16_t half)
+{
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0x1f)
+    {
+        bits = sign | 0x7f800000 | mantissa << 13;
+    }
+    else if (exponent)
+    {
+        bits = sign | (exponent + 112) << 23 | mantissa << 13;
+    }
+    else if (mantissa)
+    {
+        // Subnormal, normalized for the wider exponent
+        exponent = 113;
+
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+
+        bits = sign | exponent << 23 | (mantissa & 0x3ff) << 13;
+    }
+    else
+    {
+        bits = sign;
+    }
+
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Clamps, encodes and dithers a row of float pixels into 8-bit pixels. Values quantized to 5 bits are
+// expanded so that the 16-bit conversion recovers them exactly.
+static void quantize_row(const tga_quantizer *quantizer, unsigned int y, byte *row)
+{
+    const tga_float_image *image = quantizer->image;
+    size_t count = (size_t)image->width * image->channels;
+    size_t offset = (size_t)y * count;
+    int levels = quantizer->levels;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t channel = i % image->channels;
+        float value;
+
+        if (image->format == TGA_FLOAT16)
+            value = half_to_float(((const uint16_t *)image->data)[offset + i]);
+        else
+            value = ((const float *)image->data)[offset + i];
+
+        // NaN compares false and ends up as 0
+        value = value > 0.0f ? (value < 1.0f ? value : 1.0f) : 0.0f;
+
+        if (channel == 3)
+        {
+            row[i] = (byte)(value * 255.0f + 0.5f);
+            continue;
+        }
+
+        if (quantizer->flags & TGA_FLOAT_SRGB)
+            value = linear_to_srgb(value);
+
+        float threshold = quantizer->flags & TGA_FLOAT_DITHER ? (bayer_matrix[y & 3][(i / image->channels) & 3] + 0.5f) / 16.0f : 0.5f;
+        int level = (int)(value * levels + threshold);
+
+        if (level > levels)
+            level = levels;
+
+        row[i] = (byte)(levels == 255 ? level : level << 3 | level >> 2);
+    }
+}
+
+// Converts and writes the image a band of rows at a time instead of converting it whole.
+// Color-mapped images pass their color indices, the palette is written by the caller.
+// Images saved from floats are quantized on the way.
+// Bytes of a pixel in the file
+static int encoded_bytes(const tga_image *tga, tga_type type, int bits)
+{
+    if (type == TGA_MAPPED || type == TGA_MAPPED_RLE)
+        return sizeof(byte);
+    else if (type == TGA_RGB || type == TGA_RGB_RLE)
+        return tga->channels;
+    else if (type == TGA_RGB16 || type == TGA_RGB16_RLE)
+        return sizeof(word);
+    else
+        return bits == 16 ? sizeof(word) : sizeof(byte);
+}
+
+// Pixels of a row to encode: palette indices, quantized float pixels, or the image itself
+static const byte *source_row(const tga_image *tga, const byte *color_data, const tga_quantizer *quantizer, size_t row, byte *quantized)
+{
+    if (color_data)
+        return &color_data[row * tga->width];
+
+    if (quantizer)
+    {
+        quantize_row(quantizer, (unsigned int)row, quantized);
+        return quantized;
+    }
+
+    return &tga->data[row * tga->width * tga->channels];
+}
+
+static bool write_streamed(const tga_image *tga, tga_type type, int bits, const byte *color_data, const tga_quantizer *quantizer,
+                           const tga_func_def *func_def)
+{
+    bool rle = type == TGA_MAPPED_RLE || type == TGA_RGB_RLE || type == TGA_RGB16_RLE || type == TGA_BW_RLE || type == TGA_BW8_RLE;
+    int stride = color_data ? sizeof(byte) : tga->channels;
+    int bytes = encoded_bytes(tga, type, bits);
+
+    size_t row_size = (size_t)tga->width * bytes + (rle ? tga->width : 0);
+    if (!row_size || !tga->height)
+        return true;
+
+    size_t rows = row_size < TGA_STREAM_CHUNK ? TGA_STREAM_CHUNK / row_size : 1;
+    bool success = true;
+
+    byte *data = (byte *)alloc_bytes(row_size * rows);
+    byte *quantized = quantizer ? (byte *)alloc_bytes((size_t)tga->width * tga->channels) : NULL;
+
+    if (!data || (quantizer && !quantized))
+    {
+        free(data);
+        free(quantized);
+        return false;
+    }
+
+    for (size_t y = 0; success && y < tga->height; y += rows)
+    {
+        size_t size = 0;
+
+        for (size_t row = y; row < y + rows && row < tga->height; row++)
+        {
+            const byte *source = source_row(tga, color_data, quantizer, row, quantized);
+            int row_end = tga->width * stride;
+
+            if (!rle)
+            {
+                for (int i = 0; i < row_end; i += stride, size += bytes)
+                    encode_pixel(type, bytes, &source[i], &data[size], tga->channels);
+
+                continue;
+            }
+
+            // RLE packets never cross rows, so every row starts a new packet
+            for (int i = 0, n; i < row_end; i += n * stride)
+            {
+                n = write_rle(tga, source, stride, i, &data[size]);
+                size++;
+
+                if (n > 0)
+                {
+                    encode_pixel(type, bytes, &source[i], &data[size], tga->channels);
+                    size += bytes;
+                }
+                else
+                {
+                    n = -n;
+
+                    for (int j = 0; j < n; j++, size += bytes)
+                        encode_pixel(type, bytes, &source[i + j * stride], &data[size], tga->channels);
+                }
+            }
+        }
+
+        if (func_def->write_file(data, sizeof(byte), size, func_def->file) != size)
+            success = false;
+    }
+
+    free(data);
+    free(quantized);
+    return success;
+}
+
+// Rows converted and written per job of a parallel save, about this many bytes
+#define TGA_SAVE_BAND           (TGA_STREAM_CHUNK * 4)
+
+typedef struct
+{
+    const tga_image *tga;
+    tga_type type;
+    int bytes;
+    const byte *color_data;
+    const tga_quantizer *quantizer;
+    int fd;
+    uint64_t offset;            // Of the first row in the file
+    size_t row_size;
+    size_t rows;                // Per band
+
+    bool timed;
+
+    tga_mutex lock;
+    size_t next;
+    bool failed;
+    uint64_t encode_ns;         // Summed over the threads
+    uint64_t write_ns;
+} tga_save_job;
+
+static void *save_worker(void *arg)
+{
+    tga_save_job *job = (tga_save_job *)arg;
+    const tga_image *tga = job->tga;
+    int stride = job->color_data ? sizeof(byte) : tga->channels;
+
+    byte *data = (byte *)malloc(job->row_size * job->rows);
+    byte *quantized = job->quantizer ? (byte *)malloc((size_t)tga->width * tga->channels) : NULL;
+
+    for (;;)
+    {
+        lock_mutex(&job->lock);
+
+        size_t first = job->next;
+        bool done = first >= tga->height || job->failed;
+
+        if (!done && (!data || (job->quantizer && !quantized)))
+            done = job->failed = true;
+
+        job->next += job->rows;
+        unlock_mutex(&job->lock);
+
+        if (done)
+            break;
+
+        size_t last = first + job->rows < tga->height ? first + job->rows : tga->height;
+        byte *pixel = data;
+        uint64_t start = job->timed ? now_ns() : 0;
+
+        for (size_t row = first; row < last; row++)
+        {
+            const byte *source = source_row(tga, job->color_data, job->quantizer, row, quantized);
+
+            for (size_t i = 0; i < (size_t)tga->width * stride; i += stride, pixel += job->bytes)
+                encode_pixel(job->type, job->bytes, &source[i], pixel, tga->channels);
+        }
+
+        uint64_t encoded = job->timed ? now_ns() : 0;
+
+        // Every band has a fixed place in the file, so they can be written in any order
+        bool written = write_at(job->fd, data, (last - first) * job->row_size, job->offset + first * job->row_size);
+
+        if (!written || job->timed)
+        {
+            uint64_t end = job->timed ? now_ns() : 0;
+
+            lock_mutex(&job->lock);
+            job->failed |= !written;
+            job->encode_ns += encoded - start;
+            job->write_ns += end - encoded;
+            unlock_mutex(&job->lock);
+        }
+    }
+
+    free(data);
+    free(quantized);
+    return NULL;
+}
+
+// Converts and writes bands of an uncompressed image on several threads, straight to their offsets in the file.
+// When write_ns is given, it gets the share of the time spent writing.
+static bool write_parallel(const tga_image *tga, tga_type type, int bits, const byte *color_data, const tga_quantizer *quantizer,
+                           int fd, uint64_t offset, int threads, uint64_t *write_ns)
+{
+    tga_save_job job;
+
+    memset(&job, 0, sizeof(job));
+    job.tga = tga;
+    job.type = type;
+    job.bytes = encoded_bytes(tga, type, bits);
+    job.color_data = color_data;
+    job.quantizer = quantizer;
+    job.fd = fd;
+    job.offset = offset;
+    job.row_size = (size_t)tga->width * job.bytes;
+    job.rows = job.row_size < TGA_SAVE_BAND ? TGA_SAVE_BAND / job.row_size : 1;
+    job.timed = write_ns != NULL;
+
+    size_t bands = (tga->height + job.rows - 1) / job.rows;
+    if ((size_t)threads > bands)
+        threads = (int)bands;
+
+    uint64_t start = job.timed ? now_ns() : 0;
+
+    init_mutex(&job.lock);
+    run_parallel(threads, save_worker, &job);
+    destroy_mutex(&job.lock);
+
+    // The threads overlap, so the wall time is split in the proportion of their sums
+    if (job.timed && job.encode_ns + job.write_ns)
+        *write_ns = (uint64_t)((double)(now_ns() - start) * job.write_ns / (job.encode_ns + job.write_ns));
+
+    return !job.failed;
+}
+
+// Size of the file written for an uncompressed type, which is known before encoding. 0 for RLE types.
+static size_t raw_file_size(const tga_image *tga, tga_type type, int bits, int palette_size, byte id_length)
+{
+    if (type == TGA_MAPPED_RLE || type == TGA_RGB_RLE || type == TGA_RGB16_RLE || type == TGA_BW_RLE || type == TGA_BW8_RLE)
+        return 0;
+
+    return 18 + id_length + palette_size + (size_t)tga->width * tga->height * encoded_bytes(tga, type, bits);
+}
+
+static bool write_image(const char *filename, tga_image *tga, tga_type type, const char *id, const tga_quantizer *quantizer,
+                        tga_func_def *func_def)
+{
+    // The header holds 16-bit dimensions
+    if (tga->width > 0xffff || tga->height > 0xffff)
+        return false;
+
+    size_t pixels = (size_t)tga->width * tga->height;
+    size_t full = 0;
+    size_t stream = TGA_STREAM_CHUNK + (size_t)tga->width * (tga->channels + 1);
+    size_t reserved = 0;
+
+    // Peak memory of the conversion buffers of each writer
+    if (type == TGA_MAPPED || type == TGA_MAPPED_RLE)
+    {
+        size_t palette = pixels + 257 * tga->channels;
+
+        full = palette + (type == TGA_MAPPED_RLE ? pixels * 2 : 0);
+        stream += palette;
+    }
+    else if (type == TGA_RGB)
+        full = pixels * tga->channels;
+    else if (type == TGA_RGB_RLE)
+        full = pixels * tga->channels + pixels;
+    else if (type == TGA_RGB16 || type == TGA_BW || type == TGA_BW8)
+        full = pixels * sizeof(word);
+    else if (type == TGA_RGB16_RLE || type == TGA_BW_RLE)
+        full = pixels * sizeof(word) + pixels;
+    else if (type == TGA_BW8_RLE)
+        full = pixels * 2;
+    else
+        return false;
+
+    // Spilled images are always streamed, converting them whole would pull them back into memory.
+    // So are float images, they are quantized as they are written.
+    bool spilled = quantizer || is_spilled(tga->data);
+    if (spilled)
+        full = stream;
+
+    tga_admission admission = reserve_budget(full, stream, &reserved);
+    if (admission == TGA_ADMIT_REJECTED)
+        return false;
+
+    byte image_type;
+    byte bits;
+    size_t size = pixels * tga->channels;
+    bool success = false;
+
+    byte color_map_type = 0;
+    word first_entry_index = 0;
+    word color_map_length = 0;
+    byte color_map_entry_size = 0;
+    byte *palette_data = NULL;
+    byte *color_data = NULL;
+    int palette_size = 0;
+
+    tga_metrics *metrics = active_metrics;
+    tga_meter meter;
+    tga_func_def metered;
+    uint64_t start = stamp(metrics);
+
+    func_def->file = func_def->open_file(filename, "wb", func_def->file);
+    if (!func_def->file)
+    {
+        release_budget(reserved);
+        return false;
+    }
+
+    // Preallocation, positional writes and close work on the file itself, the rest goes through the meter
+    tga_func_def *output = func_def;
+
+    if (metrics)
+    {
+        metrics->open_ns += now_ns() - start;
+        func_def = meter_file(&meter, &metered, output, metrics);
+        start = now_ns();
+    }
+
+    // Generate color palette
+    if (type == TGA_MAPPED || type == TGA_MAPPED_RLE)
+    {
+        TGA_PROBE2(palette__start, tga->width, tga->height);
+        color_map_length = generate_palette(tga, size, &palette_data, &color_data);
+        TGA_PROBE1(palette__done, color_map_length);
+
+        if (!color_map_length)
+        {
+            output->close_file(output->file);
+            release_budget(reserved);
+            return false;
+        }
+
+        color_map_type = 1;
+        first_entry_index = 0;
+        color_map_entry_size = tga->channels * 8;
+        palette_size = color_map_length * tga->channels;
+    }
+
+    if (type == TGA_MAPPED)
+        image_type = TGA_TYPE_MAPPED;
+    else if (type == TGA_MAPPED_RLE)
+        image_type = TGA_TYPE_MAPPED_RLE;
+    else if (type == TGA_RGB)
+        image_type = TGA_TYPE_RGB;
+    else if (type == TGA_RGB_RLE)
+        image_type = TGA_TYPE_RGB_RLE;
+    else if (type == TGA_RGB16)
+        image_type = TGA_TYPE_RGB;
+    else if (type == TGA_RGB16_RLE)
+        image_type = TGA_TYPE_RGB_RLE;
+    else if (type == TGA_BW)
+        image_type = TGA_TYPE_BW;
+    else if (type == TGA_BW_RLE)
+        image_type = TGA_TYPE_BW_RLE;
+    else if (type == TGA_BW8)
+        image_type = TGA_TYPE_BW;
+    else if (type == TGA_BW8_RLE)
+        image_type = TGA_TYPE_BW_RLE;
+
+    if (type == TGA_MAPPED || type == TGA_MAPPED_RLE)
+        bits = 8;
+    else if (type == TGA_RGB || type == TGA_RGB_RLE)
+        bits = tga->channels * 8;
+    else if (type == TGA_RGB16 || type == TGA_RGB16_RLE)
+        bits = tga->channels == 4 ? 16 : 15;
+    else if (type == TGA_BW || type == TGA_BW_RLE)
+        bits = 16;
+    else if (type == TGA_BW8 || type == TGA_BW8_RLE)
+        bits = 8;
+
+    byte id_length = id ? (byte)strlen(id) : 0;
+    size_t file_size = raw_file_size(tga, type, bits, palette_size, id_length);
+    int fd = file_size ? positional_fd(output) : -1;
+    int threads = 1;
+
+    if (fd >= 0)
+    {
+        lock_mutex(&save_threads.lock);
+        threads = save_threads.threads ? save_threads.threads : count_cores();
+        unlock_mutex(&save_threads.lock);
+
+        // Small images are not worth the threads
+        if (file_size < TGA_SAVE_BAND * 2)
+            threads = 1;
+    }
+
+    preallocate_file(output, file_size);
+
+    byte header[18] = { id_length, color_map_type, image_type,
+                      (byte)(first_entry_index % 256),
+                      (byte)(first_entry_index / 256),
+                      (byte)(color_map_length % 256),
+                      (byte)(color_map_length / 256),
+                      color_map_entry_size, 0, 0, 0, 0,
+                      (byte)(tga->width % 256),
+                      (byte)(tga->width / 256),
+                      (byte)(tga->height % 256),
+                      (byte)(tga->height / 256),
+                      bits, 0 };
+
+    // Only RLE types have packets to count
+    if (metrics && !file_size)
+    {
+        meter.body = sizeof(header) + id_length + palette_size;
+        meter.scan.pixel_size = encoded_bytes(tga, type, bits);
+        meter.scan.pixels = pixels;
+    }
+
+    if (!func_def->write_file(header, sizeof(header), 1, func_def->file) ||
+        (id_length && func_def->write_file((void *)id, sizeof(char), id_length, func_def->file) != id_length))
+    {
+        if (type == TGA_MAPPED || type == TGA_MAPPED_RLE)
+        {
+            free(palette_data);
+            free_pixels(color_data);
+        }
+
+        output->close_file(output->file);
+        release_budget(reserved);
+        return false;
+    }
+
+    uint64_t parallel_write = 0;
+
+    TGA_PROBE4(encode__start, type, tga->width, tga->height, threads);
+
+    if (threads > 1)
+    {
+        success = !palette_size || func_def->write_file(palette_data, sizeof(byte), palette_size, func_def->file) == (size_t)palette_size;
+        success = success && write_parallel(tga, type, bits, color_data, quantizer, fd, sizeof(header) + id_length + palette_size, threads,
+                                            metrics ? &parallel_write : NULL);
+
+        if (metrics && success)
+            metrics->bytes_written += file_size - (sizeof(header) + id_length + palette_size);
+    }
+    else if (admission == TGA_ADMIT_STREAM || spilled)
+    {
+        success = !palette_size || func_def->write_file(palette_data, sizeof(byte), palette_size, func_def->file) == (size_t)palette_size;
+        success = success && write_streamed(tga, type, bits, color_data, quantizer, func_def);
+    }
+    else if (type == TGA_MAPPED)
+        success = write_mapped(tga, palette_data, color_data, palette_size, func_def);
     else if (type == TGA_RGB)
         success = write_rgb(tga, size, func_def);
     else if (type == TGA_RGB16)
@@ -1105,16 +4740,1084 @@ bool save_tga_ext(const char *filename, tga_image *tga, tga_type type, tga_func_
     else if (type == TGA_BW_RLE || type == TGA_BW8_RLE)
         success = write_bw_rle(tga, size, bits, func_def);
 
-    if (type == TGA_MAPPED || type == TGA_MAPPED_RLE)
+    TGA_PROBE3(encode__done, type, success, file_size);
+
+    if (type == TGA_MAPPED || type == TGA_MAPPED_RLE)
+    {
+        free(palette_data);
+        free_pixels(color_data);
+    }
+
+    if (metrics)
+    {
+        metrics->write_ns += meter.io_ns + parallel_write;
+        metrics->encode_ns += now_ns() - start - meter.io_ns - parallel_write;
+        add_packets(metrics, &meter.scan);
+        start = now_ns();
+    }
+
+    // Buffered data may only be written out at close
+    if (output->close_file(output->file) != 0)
+        success = false;
+
+    if (metrics)
+        metrics->close_ns += now_ns() - start;
+
+    release_budget(reserved);
+
+    return success;
+}
+
+static bool write_tga(const char *filename, tga_image *tga, tga_type type, const char *id, const tga_quantizer *quantizer,
+                      tga_func_def *func_def)
+{
+    if (!filename || !tga || (!tga->data && !quantizer))
+        return false;
+
+    TGA_PROBE5(save__start, filename, tga->width, tga->height, tga->channels, type);
+
+    bool success = write_image(filename, tga, type, id, quantizer, func_def);
+
+    TGA_PROBE2(save__done, filename, success);
+    return success;
+}
+
+bool save_tga_ext(const char *filename, tga_image *tga, tga_type type, tga_func_def *func_def)
+{
+    return write_tga(filename, tga, type, NULL, NULL, func_def);
+}
+
+bool save_tga_metrics(const char *filename, tga_image *tga, tga_type type, tga_func_def *func_def, tga_metrics *metrics)
+{
+    tga_func_def defaults;
+
+    if (!func_def)
+    {
+        default_file_funcs(&defaults);
+        defaults.file = NULL;
+        func_def = &defaults;
+    }
+
+    if (metrics)
+        memset(metrics, 0, sizeof(tga_metrics));
+
+    active_metrics = metrics;
+    bool success = write_tga(filename, tga, type, NULL, NULL, func_def);
+    active_metrics = NULL;
+
+    return success;
+}
+
+bool save_tga_float(const char *filename, const tga_float_image *image, tga_type type, unsigned int flags)
+{
+    tga_func_def func_def;
+
+    default_file_funcs(&func_def);
+
+    return save_tga_float_ext(filename, image, type, flags, &func_def);
+}
+
+bool save_tga_float_ext(const char *filename, const tga_float_image *image, tga_type type, unsigned int flags, tga_func_def *func_def)
+{
+    if (!filename || !image || !image->data || !func_def || (image->channels != 3 && image->channels != 4) ||
+        (image->format != TGA_FLOAT32 && image->format != TGA_FLOAT16))
+        return false;
+
+    if (flags & TGA_FLOAT_SRGB)
+        init_srgb();
+
+    tga_quantizer quantizer = { image, flags, type == TGA_RGB16 || type == TGA_RGB16_RLE ? 31 : 255 };
+    tga_image tga = { image->width, image->height, image->channels, NULL };
+
+    if (type != TGA_MAPPED && type != TGA_MAPPED_RLE)
+        return write_tga(filename, &tga, type, NULL, &quantizer, func_def);
+
+    // The palette is built from the whole image, so it is quantized up front
+    size_t row_size = (size_t)image->width * image->channels;
+
+    tga.data = alloc_pixels(row_size * image->height);
+    if (!tga.data)
+        return false;
+
+    for (unsigned int y = 0; y < image->height; y++)
+        quantize_row(&quantizer, y, &tga.data[y * row_size]);
+
+    bool success = write_tga(filename, &tga, type, NULL, NULL, func_def);
+
+    free_pixels(tga.data);
+    return success;
+}
+
+bool save_tga_mem(tga_image *tga, tga_type type, void **data, size_t *size)
+{
+    if (!data || !size)
+        return false;
+
+    tga_memory_buffer mem = { NULL, 0, 0 };
+    tga_func_def func_def;
+
+    func_def.open_file = mem_open;
+    func_def.write_file = mem_write;
+    func_def.close_file = mem_close;
+    func_def.file = &mem;
+
+    if (!write_tga("", tga, type, NULL, NULL, &func_def))
+    {
+        free(mem.data);
+        return false;
+    }
+
+    *data = mem.data;
+    *size = mem.size;
+
+    return true;
+}
+
+// Image ID field of files written by save_tga_if_changed, followed by 16 hex digits
+#define TGA_HASH_ID     "libtga:"
+
+static uint64_t hash_image(const tga_image *tga, tga_type type)
+{
+    byte key[24];
+    uint64_t hash = tga_hash(tga->data, (size_t)tga->width * tga->height * tga->channels);
+    uint32_t fields[4] = { tga->width, tga->height, tga->channels, (uint32_t)type };
+
+    for (int i = 0; i < 8; i++)
+        key[i] = (byte)(hash >> (i * 8));
+
+    for (int i = 0; i < 16; i++)
+        key[8 + i] = (byte)(fields[i / 4] >> ((i % 4) * 8));
+
+    return tga_hash(key, sizeof(key));
+}
+
+// Tells whether the file already holds the image. A file with a hash in its image ID
+// is decided by its header alone, any other file is compared with the encoded output.
+static bool is_unchanged(const char *filename, tga_image *tga, tga_type type, const char *id,
+                         tga_memory_buffer *encoded, tga_func_def *func_def)
+{
+    void *stream = func_def->file;
+
+    func_def->file = func_def->open_file(filename, "rb", stream);
+    if (!func_def->file)
+    {
+        func_def->file = stream;
+        return false;
+    }
+
+    byte header[18 + 255];
+    bool unchanged = false;
+
+    if (func_def->read_file(header, 18, 1, func_def->file) == 1)
+    {
+        byte id_length = header[0];
+
+        if (id_length)
+        {
+            unchanged = func_def->read_file(&header[18], sizeof(byte), id_length, func_def->file) == id_length &&
+                        id_length == strlen(id) && memcmp(&header[18], id, id_length) == 0;
+        }
+        else
+        {
+            tga_func_def mem_def = { mem_open, NULL, mem_write, NULL, mem_close, encoded };
+
+            // A failed encode may leave part of the output behind, which must never be written to the file
+            if (!write_tga("", tga, type, NULL, NULL, &mem_def))
+            {
+                free(encoded->data);
+                encoded->data = NULL;
+                encoded->size = 0;
+                encoded->capacity = 0;
+            }
+            else if (encoded->size >= 18 && memcmp(header, encoded->data, 18) == 0)
+            {
+                byte chunk[4096];
+                size_t position = 18;
+                size_t n;
+
+                unchanged = true;
+
+                while (unchanged && (n = func_def->read_file(chunk, sizeof(byte), sizeof(chunk), func_def->file)) > 0)
+                {
+                    if (n > encoded->size - position || memcmp(chunk, &encoded->data[position], n) != 0)
+                        unchanged = false;
+
+                    position += n;
+                }
+
+                if (position != encoded->size)
+                    unchanged = false;
+            }
+        }
+    }
+
+    func_def->close_file(func_def->file);
+    func_def->file = stream;
+
+    return unchanged;
+}
+
+// Compares the image with the file and writes it to the output when it differs
+static bool save_if_changed(const char *filename, const char *output, tga_image *tga, tga_type type, tga_func_def *func_def,
+                            bool *skipped)
+{
+    if (skipped)
+        *skipped = false;
+
+    if (!filename || !output || !tga || !tga->data || !func_def)
+        return false;
+
+    char id[32];
+    snprintf(id, sizeof(id), TGA_HASH_ID "%016llx", (unsigned long long)hash_image(tga, type));
+
+    tga_memory_buffer encoded = { NULL, 0, 0 };
+
+    if (is_unchanged(filename, tga, type, id, &encoded, func_def))
+    {
+        free(encoded.data);
+
+        if (skipped)
+            *skipped = true;
+
+        return true;
+    }
+
+    // Reuse the output that was encoded for the comparison, only the image ID is added
+    if (encoded.data)
+    {
+        byte id_length = (byte)strlen(id);
+        bool success;
+
+        encoded.data[0] = id_length;
+
+        func_def->file = func_def->open_file(output, "wb", func_def->file);
+        if (!func_def->file)
+        {
+            free(encoded.data);
+            return false;
+        }
+
+        success = func_def->write_file(encoded.data, sizeof(byte), 18, func_def->file) == 18 &&
+                  func_def->write_file(id, sizeof(char), id_length, func_def->file) == id_length &&
+                  func_def->write_file(&encoded.data[18], sizeof(byte), encoded.size - 18, func_def->file) == encoded.size - 18;
+
+        if (func_def->close_file(func_def->file) != 0)
+            success = false;
+
+        free(encoded.data);
+        return success;
+    }
+
+    return write_tga(output, tga, type, id, NULL, func_def);
+}
+
+static bool replace_file(const char *from, const char *to)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+bool save_tga_if_changed(const char *filename, tga_image *tga, tga_type type, bool *skipped)
+{
+    tga_func_def func_def;
+    bool unchanged = false;
+
+    if (skipped)
+        *skipped = false;
+
+    if (!filename)
+        return false;
+
+    default_file_funcs(&func_def);
+
+    // Write next to the file and rename, a write cut short by a crash or a full disk never
+    // leaves behind part of a file whose image ID already claims the new contents
+    size_t length = strlen(filename) + 5;
+    char *temp = (char *)malloc(length);
+    if (!temp)
+        return false;
+
+    snprintf(temp, length, "%s.tmp", filename);
+
+    bool success = save_if_changed(filename, temp, tga, type, &func_def, &unchanged);
+
+    if (success && !unchanged)
+        success = replace_file(temp, filename);
+
+    if (!success)
+        remove(temp);
+
+    free(temp);
+
+    if (skipped)
+        *skipped = unchanged;
+
+    return success;
+}
+
+// Writes in place through the given callbacks, which are responsible for replacing the file atomically
+bool save_tga_if_changed_ext(const char *filename, tga_image *tga, tga_type type, tga_func_def *func_def, bool *skipped)
+{
+    return save_if_changed(filename, filename, tga, type, func_def, skipped);
+}
+
+// Rows of a packed image are decoded in bands of about this many bytes
+#define TGA_PACK_BAND           16384
+
+// Start of a row in a packed image, a row of an RLE file from another writer may begin inside a packet
+typedef struct
+{
+    uint32_t offset;            // Packet header
+    uint8_t skip;               // Pixels of the packet that belong to the previous row
+} tga_row_start;
+
+typedef struct tga_cache_entry
+{
+    tga_packed_image *image;
+    unsigned int band;
+    size_t size;
+    byte *data;
+    struct tga_cache_entry *prev;
+    struct tga_cache_entry *next;
+} tga_cache_entry;
+
+struct tga_packed_image
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;
+    tga_pixel_format format;
+    byte *palette;
+    size_t palette_size;
+    bool flip_x;
+    bool flip_y;
+
+    byte *packets;
+    size_t size;
+    tga_row_start *rows;        // In the order load_tga returns the rows
+
+    unsigned int band_rows;
+    unsigned int band_count;
+    tga_cache_entry **bands;    // Guarded by the cache lock
+};
+
+// Decoded bands of all packed images, most recently used first
+static struct
+{
+    tga_mutex lock;
+    size_t limit;
+    size_t used;
+    tga_cache_entry *head;
+    tga_cache_entry *tail;
+} cache = { TGA_MUTEX_INIT, 0, 0, NULL, NULL };
+
+static void unlink_cache_entry(tga_cache_entry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache.head = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache.tail = entry->prev;
+}
+
+static void push_cache_entry(tga_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache.head;
+
+    if (cache.head)
+        cache.head->prev = entry;
+    else
+        cache.tail = entry;
+
+    cache.head = entry;
+}
+
+static void drop_cache_entry(tga_cache_entry *entry)
+{
+    unlink_cache_entry(entry);
+
+    entry->image->bands[entry->band] = NULL;
+    cache.used -= entry->size;
+
+    free(entry->data);
+    free(entry);
+}
+
+static void trim_cache(void)
+{
+    while (cache.tail && cache.used > cache.limit)
+        drop_cache_entry(cache.tail);
+}
+
+void tga_set_pack_cache(size_t size)
+{
+    lock_mutex(&cache.lock);
+    cache.limit = size;
+    trim_cache();
+    unlock_mutex(&cache.lock);
+}
+
+// Finds where every row starts in a packet stream, in display order when flip_y is set, and trims whatever follows the last row
+static bool index_rows(const byte *packets, size_t *size, unsigned int width, unsigned int height, size_t pixel_size,
+                       bool flip_y, tga_row_start *rows)
+{
+    size_t position = 0;
+    unsigned int x = 0;
+    unsigned int row = 0;
+
+    tga_row_start *start = &rows[flip_y ? height - 1 : 0];
+
+    start->offset = 0;
+    start->skip = 0;
+
+    while (row < height)
+    {
+        if (position >= *size || position > UINT32_MAX)
+            return false;
+
+        byte rle_id = packets[position];
+        unsigned int count = (rle_id & 0x7f) + 1;
+        size_t packet_size = 1 + (rle_id & 0x80 ? 1 : count) * pixel_size;
+
+        if (packet_size > *size - position)
+            return false;
+
+        for (unsigned int used = 0; used < count && row < height;)
+        {
+            unsigned int take = count - used < width - x ? count - used : width - x;
+
+            used += take;
+            x += take;
+
+            if (x < width)
+                continue;
+
+            x = 0;
+            row++;
+
+            if (row == height)
+                break;
+
+            start = &rows[flip_y ? height - row - 1 : row];
+            start->offset = (uint32_t)(used < count ? position : position + packet_size);
+            start->skip = (uint8_t)(used < count ? used : 0);
+        }
+
+        position += packet_size;
+    }
+
+    *size = position;
+    return true;
+}
+
+static bool index_packets(tga_packed_image *packed)
+{
+    packed->rows = (tga_row_start *)malloc(packed->height * sizeof(tga_row_start));
+    if (!packed->rows)
+        return false;
+
+    if (!index_rows(packed->packets, &packed->size, packed->width, packed->height, packed->format.size, packed->flip_y, packed->rows))
+        return false;
+
+    byte *packets = (byte *)realloc(packed->packets, packed->size);
+    if (packets)
+        packed->packets = packets;
+
+    return true;
+}
+
+static bool decode_packed_row(const tga_packed_image *packed, unsigned int y, byte *data)
+{
+    tga_row_start start = packed->rows[y];
+    tga_rle_state state = { 0 };
+    size_t position = start.offset;
+    size_t decoded;
+
+    // Resume the packet that the row starts in
+    if (start.skip)
+    {
+        const byte *packet = &packed->packets[position];
+
+        state.remaining = (packet[0] & 0x7f) + 1 - start.skip;
+        state.run = (packet[0] & 0x80) != 0;
+
+        if (state.run)
+        {
+            memcpy(state.value, &packet[1], packed->format.size);
+            position += 1 + packed->format.size;
+        }
+        else
+        {
+            position += 1 + (size_t)start.skip * packed->format.size;
+        }
+    }
+
+    decode_rle(&state, &packed->format, &packed->packets[position], packed->size - position, data, packed->width, &decoded);
+
+    if (packed->flip_x)
     {
-        free(palette_data);
-        free(color_data);
+        size_t channels = packed->channels;
+
+        for (unsigned int x = 0; x < packed->width / 2; x++)
+        {
+            for (size_t k = 0; k < channels; k++)
+                swap_byte(&data[x * channels + k], &data[(packed->width - x - 1) * channels + k]);
+        }
+    }
+
+    return decoded == packed->width;
+}
+
+// Encodes the rows of an uncompressed file into packets that keep the pixels in the file format
+static bool pack_raw(tga_packed_image *packed, tga_memory_buffer *packets, const tga_func_def *func_def)
+{
+    size_t size = packed->format.size;
+    size_t row_size = packed->width * size;
+    tga_image row_image = { packed->width, 1, (unsigned int)size, NULL };
+    bool success = true;
+
+    byte *row = (byte *)malloc(row_size);
+    byte *rle = (byte *)malloc(row_size + packed->width);
+    if (!row || !rle)
+        success = false;
+
+    for (unsigned int y = 0; success && y < packed->height; y++)
+    {
+        size_t rle_size = 0;
+
+        if (func_def->read_file(row, sizeof(byte), row_size, func_def->file) != row_size)
+        {
+            success = false;
+            break;
+        }
+
+        for (size_t i = 0; i < row_size;)
+        {
+            int n = write_rle(&row_image, row, (int)size, i, &rle[rle_size]);
+            rle_size++;
+
+            if (n > 0)
+            {
+                memcpy(&rle[rle_size], &row[i], size);
+                rle_size += size;
+            }
+            else
+            {
+                n = -n;
+
+                memcpy(&rle[rle_size], &row[i], n * size);
+                rle_size += n * size;
+            }
+
+            i += n * size;
+        }
+
+        success = mem_write(rle, sizeof(byte), rle_size, packets) == rle_size;
+    }
+
+    free(row);
+    free(rle);
+    return success;
+}
+
+tga_packed_image *tga_pack_load(const char *filename)
+{
+    tga_func_def func_def;
+
+    default_file_funcs(&func_def);
+
+    return tga_pack_load_ext(filename, &func_def);
+}
+
+tga_packed_image *tga_pack_load_ext(const char *filename, tga_func_def *func_def)
+{
+    if (!filename || !func_def)
+        return NULL;
+
+    func_def->file = func_def->open_file(filename, "rb", func_def->file);
+    if (!func_def->file)
+        return NULL;
+
+    tga_header header;
+    tga_pixel_format format;
+
+    if (!read_header(&header, func_def))
+    {
+        func_def->close_file(func_def->file);
+        return NULL;
+    }
+
+    tga_packed_image *packed = NULL;
+
+    if (header.width && header.height &&
+        get_pixel_format(header.image_type, header.bits_per_pixel, header.channels, header.palette, &format))
+    {
+        packed = (tga_packed_image *)calloc(1, sizeof(tga_packed_image));
+    }
+
+    if (!packed)
+    {
+        func_def->close_file(func_def->file);
+        free(header.palette);
+        return NULL;
+    }
+
+    packed->width = header.width;
+    packed->height = header.height;
+    packed->channels = header.channels;
+    packed->format = format;
+    packed->palette = header.palette;
+    packed->palette_size = header.palette_size;
+    packed->flip_x = header.flip_x;
+    packed->flip_y = header.flip_y;
+
+    tga_memory_buffer packets = { NULL, 0, 0 };
+    bool success;
+
+    // RLE files keep their own packets, the rest of the file is read and trimmed once indexed
+    if (header.image_type == TGA_TYPE_MAPPED_RLE || header.image_type == TGA_TYPE_RGB_RLE || header.image_type == TGA_TYPE_BW_RLE)
+    {
+        byte *chunk = (byte *)malloc(TGA_STREAM_CHUNK);
+        size_t count;
+
+        success = chunk != NULL;
+
+        while (success && (count = func_def->read_file(chunk, sizeof(byte), TGA_STREAM_CHUNK, func_def->file)) > 0)
+            success = mem_write(chunk, sizeof(byte), count, &packets) == count;
+
+        free(chunk);
+    }
+    else
+    {
+        success = pack_raw(packed, &packets, func_def);
+    }
+
+    func_def->close_file(func_def->file);
+
+    packed->packets = packets.data;
+    packed->size = packets.size;
+
+    packed->band_rows = packed->width * packed->channels < TGA_PACK_BAND ? TGA_PACK_BAND / (packed->width * packed->channels) : 1;
+    if (packed->band_rows > packed->height)
+        packed->band_rows = packed->height;
+
+    packed->band_count = (packed->height + packed->band_rows - 1) / packed->band_rows;
+    packed->bands = (tga_cache_entry **)calloc(packed->band_count, sizeof(tga_cache_entry *));
+
+    if (!success || !packed->bands || !index_packets(packed))
+    {
+        tga_pack_free(packed);
+        return NULL;
+    }
+
+    return packed;
+}
+
+tga_packed_image *tga_pack(const tga_image *tga)
+{
+    void *data;
+    size_t size;
+
+    if (!tga || !tga->data || !save_tga_mem((tga_image *)tga, TGA_RGB_RLE, &data, &size))
+        return NULL;
+
+    tga_memory_stream mem = { (const byte *)data, size, 0 };
+    tga_func_def func_def;
+
+    func_def.open_file = mem_open;
+    func_def.read_file = mem_read;
+    func_def.seek_file = mem_seek;
+    func_def.close_file = mem_close;
+    func_def.file = &mem;
+
+    tga_packed_image *packed = tga_pack_load_ext("", &func_def);
+
+    free(data);
+    return packed;
+}
+
+void tga_pack_free(tga_packed_image *packed)
+{
+    if (!packed)
+        return;
+
+    lock_mutex(&cache.lock);
+
+    for (unsigned int i = 0; packed->bands && i < packed->band_count; i++)
+    {
+        if (packed->bands[i])
+            drop_cache_entry(packed->bands[i]);
+    }
+
+    unlock_mutex(&cache.lock);
+
+    free(packed->bands);
+    free(packed->rows);
+    free(packed->packets);
+    free(packed->palette);
+    free(packed);
+}
+
+void tga_pack_info(const tga_packed_image *packed, unsigned int *width, unsigned int *height, unsigned int *channels)
+{
+    if (width)
+        *width = packed ? packed->width : 0;
+
+    if (height)
+        *height = packed ? packed->height : 0;
+
+    if (channels)
+        *channels = packed ? packed->channels : 0;
+}
+
+size_t tga_pack_size(const tga_packed_image *packed)
+{
+    if (!packed)
+        return 0;
+
+    return sizeof(tga_packed_image) + packed->size + packed->palette_size +
+           packed->height * sizeof(tga_row_start) + packed->band_count * sizeof(tga_cache_entry *);
+}
+
+static void copy_rows(const byte *rows, size_t row_size, unsigned int count, size_t x, size_t width, byte *data)
+{
+    for (unsigned int i = 0; i < count; i++)
+        memcpy(&data[i * width], &rows[i * row_size + x], width);
+}
+
+// Copies rows of one band into the caller's buffer, through the cache when it is enabled
+static bool read_packed_band(tga_packed_image *packed, unsigned int band, unsigned int first, unsigned int last,
+                             unsigned int x, unsigned int width, byte *data)
+{
+    size_t channels = packed->channels;
+    size_t row_size = packed->width * channels;
+    unsigned int band_first = band * packed->band_rows;
+    unsigned int band_rows = band + 1 < packed->band_count ? packed->band_rows : packed->height - band_first;
+
+    lock_mutex(&cache.lock);
+
+    tga_cache_entry *entry = packed->bands[band];
+    bool caching = cache.limit != 0;
+
+    if (entry)
+    {
+        unlink_cache_entry(entry);
+        push_cache_entry(entry);
+        copy_rows(&entry->data[(first - band_first) * row_size], row_size, last - first, x * channels, width * channels, data);
+    }
+
+    unlock_mutex(&cache.lock);
+
+    if (entry)
+        return true;
+
+    // Without the cache only the requested rows are decoded
+    if (!caching)
+    {
+        byte *row = (byte *)malloc(row_size);
+        bool success = row != NULL;
+
+        for (unsigned int y = first; success && y < last; y++)
+        {
+            success = decode_packed_row(packed, y, row);
+            memcpy(&data[(y - first) * width * channels], &row[x * channels], width * channels);
+        }
+
+        free(row);
+        return success;
+    }
+
+    entry = (tga_cache_entry *)malloc(sizeof(tga_cache_entry));
+    byte *decoded = (byte *)malloc(band_rows * row_size);
+
+    if (!entry || !decoded)
+    {
+        free(entry);
+        free(decoded);
+        return false;
+    }
+
+    for (unsigned int y = 0; y < band_rows; y++)
+    {
+        if (!decode_packed_row(packed, band_first + y, &decoded[y * row_size]))
+        {
+            free(entry);
+            free(decoded);
+            return false;
+        }
+    }
+
+    copy_rows(&decoded[(first - band_first) * row_size], row_size, last - first, x * channels, width * channels, data);
+
+    entry->image = packed;
+    entry->band = band;
+    entry->size = band_rows * row_size;
+    entry->data = decoded;
+
+    lock_mutex(&cache.lock);
+
+    // Another thread may have decoded the same band meanwhile
+    if (packed->bands[band] || !cache.limit)
+    {
+        free(entry->data);
+        free(entry);
+    }
+    else
+    {
+        packed->bands[band] = entry;
+        push_cache_entry(entry);
+        cache.used += entry->size;
+        trim_cache();
+    }
+
+    unlock_mutex(&cache.lock);
+    return true;
+}
+
+bool tga_pack_read(tga_packed_image *packed, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned char *data)
+{
+    if (!packed || !data || x > packed->width || width > packed->width - x || y > packed->height || height > packed->height - y)
+        return false;
+
+    for (unsigned int row = y; row < y + height;)
+    {
+        unsigned int band = row / packed->band_rows;
+        unsigned int end = (band + 1) * packed->band_rows;
+
+        if (end > y + height)
+            end = y + height;
+
+        if (!read_packed_band(packed, band, row, end, x, width, &data[(size_t)(row - y) * width * packed->channels]))
+            return false;
+
+        row = end;
+    }
+
+    return true;
+}
+
+// Appends pixels [x, x + width) of a row to an RLE stream, packets are copied as they are and split only at the edges
+static size_t crop_rle_row(const byte *packets, tga_row_start start, size_t pixel_size, unsigned int x, unsigned int width, byte *rle)
+{
+    size_t position = start.offset;
+    unsigned int skip = start.skip;
+    unsigned int column = 0;
+    size_t rle_size = 0;
+
+    while (column < x + width)
+    {
+        byte rle_id = packets[position];
+        bool run = (rle_id & 0x80) != 0;
+        unsigned int count = (rle_id & 0x7f) + 1;
+        const byte *pixels = &packets[position + 1];
+
+        position += 1 + (run ? 1 : count) * pixel_size;
+
+        if (!run)
+            pixels += skip * pixel_size;
+
+        count -= skip;
+        skip = 0;
+
+        unsigned int first = column > x ? column : x;
+        unsigned int last = column + count < x + width ? column + count : x + width;
+
+        // Packets are at most 128 pixels, only a run split from a longer run of another writer can exceed that
+        for (unsigned int i = first; i < last;)
+        {
+            unsigned int n = last - i < 128 ? last - i : 128;
+
+            rle[rle_size++] = (byte)((run ? 0x80 : 0) | (n - 1));
+
+            if (run)
+            {
+                memcpy(&rle[rle_size], pixels, pixel_size);
+                rle_size += pixel_size;
+            }
+            else
+            {
+                memcpy(&rle[rle_size], &pixels[(i - column) * pixel_size], n * pixel_size);
+                rle_size += n * pixel_size;
+            }
+
+            i += n;
+        }
+
+        column += count;
+    }
+
+    return rle_size;
+}
+
+// Crops and optionally flips a file without decoding it, rows of RLE images are copied packet by packet.
+// An empty rectangle stands for the whole image.
+static bool transform_file(const char *input, const char *output, unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+                           bool flip, tga_func_def *func_def)
+{
+    if (!input || !output || !func_def)
+        return false;
+
+    func_def->file = func_def->open_file(input, "rb", func_def->file);
+    if (!func_def->file)
+        return false;
+
+    tga_header header;
+    tga_pixel_format format;
+
+    if (!read_header(&header, func_def))
+    {
+        func_def->close_file(func_def->file);
+        return false;
+    }
+
+    if (!width && !height)
+    {
+        width = header.width;
+        height = header.height;
+    }
+
+    if (!get_pixel_format(header.image_type, header.bits_per_pixel, header.channels, header.palette, &format) ||
+        !width || !height || x > header.width || width > header.width - x || y > header.height || height > header.height - y)
+    {
+        func_def->close_file(func_def->file);
+        free(header.palette);
+        return false;
     }
 
+    tga_memory_buffer body = { NULL, 0, 0 };
+    byte *chunk = (byte *)malloc(TGA_STREAM_CHUNK);
+    size_t count;
+    bool success = chunk != NULL;
+
+    while (success && (count = func_def->read_file(chunk, sizeof(byte), TGA_STREAM_CHUNK, func_def->file)) > 0)
+        success = mem_write(chunk, sizeof(byte), count, &body) == count;
+
+    free(chunk);
     func_def->close_file(func_def->file);
+
+    bool rle = header.image_type == TGA_TYPE_MAPPED_RLE || header.image_type == TGA_TYPE_RGB_RLE || header.image_type == TGA_TYPE_BW_RLE;
+    size_t pixel_size = format.size;
+    size_t row_size = (size_t)header.width * pixel_size;
+    tga_row_start *rows = NULL;
+
+    if (success && rle)
+    {
+        rows = (tga_row_start *)malloc(header.height * sizeof(tga_row_start));
+        success = rows && index_rows(body.data, &body.size, header.width, header.height, pixel_size, false, rows);
+    }
+    else if (success)
+    {
+        success = body.size >= row_size * header.height;
+    }
+
+    byte *out = success ? (byte *)malloc((size_t)width * (pixel_size + 1)) : NULL;
+
+    if (!out || !(func_def->file = func_def->open_file(output, "wb", func_def->file)))
+    {
+        free(header.palette);
+        free(body.data);
+        free(rows);
+        free(out);
+        return false;
+    }
+
+    // The image ID is dropped, it may describe the original pixels, and so is a color map that the pixels do not use
+    bool mapped = format.kind == TGA_PIXEL_MAPPED;
+    size_t palette_size = mapped ? header.palette_size : 0;
+    byte file_header[18] = { 0 };
+
+    file_header[1] = mapped ? 1 : 0;
+    file_header[2] = header.image_type;
+    file_header[5] = mapped ? (byte)((palette_size / header.channels) & 0xff) : 0;
+    file_header[6] = mapped ? (byte)((palette_size / header.channels) >> 8) : 0;
+    file_header[7] = mapped ? (byte)(header.channels * 8) : 0;
+    file_header[8] = header.flip_x;
+    file_header[10] = header.flip_y;
+    file_header[12] = (byte)(width & 0xff);
+    file_header[13] = (byte)(width >> 8);
+    file_header[14] = (byte)(height & 0xff);
+    file_header[15] = (byte)(height >> 8);
+    file_header[16] = header.bits_per_pixel;
+
+    success = func_def->write_file(file_header, sizeof(file_header), 1, func_def->file) == 1;
+
+    if (success && palette_size)
+        success = func_def->write_file(header.palette, sizeof(byte), palette_size, func_def->file) == palette_size;
+
+    // Coordinates are given as load_tga returns the image, rows and columns are mapped to the file order
+    unsigned int first = header.flip_x ? header.width - x - width : x;
+
+    for (unsigned int i = 0; success && i < height; i++)
+    {
+        unsigned int row = header.flip_y ? height - i - 1 : i;
+
+        row = flip ? y + height - row - 1 : y + row;
+
+        if (header.flip_y)
+            row = header.height - row - 1;
+
+        if (rle)
+        {
+            size_t size = crop_rle_row(body.data, rows[row], pixel_size, first, width, out);
+            success = func_def->write_file(out, sizeof(byte), size, func_def->file) == size;
+        }
+        else
+        {
+            size_t size = (size_t)width * pixel_size;
+            success = func_def->write_file(&body.data[row * row_size + first * pixel_size], sizeof(byte), size, func_def->file) == size;
+        }
+    }
+
+    if (func_def->close_file(func_def->file) != 0)
+        success = false;
+
+    free(header.palette);
+    free(body.data);
+    free(rows);
+    free(out);
     return success;
 }
 
+bool crop_tga_file(const char *input, const char *output, unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+{
+    tga_func_def func_def;
+
+    default_file_funcs(&func_def);
+
+    return crop_tga_file_ext(input, output, x, y, width, height, &func_def);
+}
+
+bool crop_tga_file_ext(const char *input, const char *output, unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+                       tga_func_def *func_def)
+{
+    if (!width || !height)
+        return false;
+
+    return transform_file(input, output, x, y, width, height, false, func_def);
+}
+
+bool flip_tga_file_vertically(const char *input, const char *output)
+{
+    tga_func_def func_def;
+
+    default_file_funcs(&func_def);
+
+    return flip_tga_file_vertically_ext(input, output, &func_def);
+}
+
+bool flip_tga_file_vertically_ext(const char *input, const char *output, tga_func_def *func_def)
+{
+    return transform_file(input, output, 0, 0, 0, 0, true, func_def);
+}
+
 #if defined(_WIN64) || defined(_WIN32)
 static void *wfopen_wrapper(const char *filename, const char *mode, const void *stream)
 {
@@ -31,13 +31,14 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef unsigned char byte;
-typedef short word;
+typedef unsigned short word;
 
 typedef enum
 {
@@ -61,12 +62,131 @@ typedef struct
     unsigned char *data;
 } tga_image;
 
+typedef enum
+{
+    TGA_BUDGET_WAIT,        // Wait until enough memory is released
+    TGA_BUDGET_STREAM,      // Stream the image with small buffers when it does not fit
+    TGA_BUDGET_FAIL         // Fail right away when the image does not fit
+} tga_budget_policy;
+
+typedef struct
+{
+    size_t limit;
+    size_t used;
+    size_t peak;
+    unsigned int waiting;
+    unsigned long long admitted;
+    unsigned long long waited;
+    unsigned long long streamed;
+    unsigned long long rejected;
+} tga_budget_metrics;
+
+typedef enum
+{
+    TGA_ARRAY_NHWC,         // Interleaved channels, as load_tga returns them
+    TGA_ARRAY_NCHW          // One plane per channel
+} tga_array_layout;
+
+typedef struct
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;  // 1 to 4, missing channels are filled with 255
+    tga_array_layout layout;
+    bool normalize;         // Store floats from 0 to 1 instead of bytes
+    int threads;            // 0 uses every core
+} tga_array_desc;
+
+typedef enum
+{
+    TGA_YUV_444,            // Full resolution Y, U and V planes
+    TGA_YUV_I420,           // Y plane followed by U and V planes at half resolution
+    TGA_YUV_NV12            // Y plane followed by one plane of interleaved U and V at half resolution
+} tga_yuv_format;
+
+typedef enum
+{
+    TGA_YUV_BT601,
+    TGA_YUV_BT709
+} tga_yuv_matrix;
+
+typedef struct
+{
+    unsigned int width;
+    unsigned int height;
+    tga_yuv_format format;
+    unsigned char *planes[3];
+    unsigned int strides[3];
+} tga_yuv_image;
+
+typedef enum
+{
+    TGA_FLOAT32,
+    TGA_FLOAT16
+} tga_float_format;
+
+typedef enum
+{
+    TGA_FLOAT_SRGB = 1,     // Encode linear color to sRGB, alpha stays linear
+    TGA_FLOAT_DITHER = 2    // Ordered dithering instead of rounding
+} tga_float_flags;
+
+typedef struct
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;
+    tga_float_format format;
+    const void *data;
+} tga_float_image;
+
+typedef enum
+{
+    TGA_COMPARE_EXACT = 1,  // Only check equality, stopping at the first difference
+    TGA_COMPARE_SSIM = 2    // Also compute the structural similarity
+} tga_compare_flags;
+
+typedef struct
+{
+    bool equal;
+    unsigned int max_difference[4];     // Per channel
+    size_t mismatches;                  // Pixels that differ in any channel
+    double psnr;                        // Infinite when the images are equal
+    double ssim;                        // Mean over 8x8 windows of the color channels
+} tga_compare_metrics;
+
+typedef struct
+{
+    uint64_t open_ns;
+    uint64_t header_ns;                 // Header and image ID
+    uint64_t palette_ns;
+    uint64_t read_ns;                   // Pixel data read from the file
+    uint64_t decode_ns;                 // RLE decoding and pixel conversion of a load
+    uint64_t flip_ns;
+    uint64_t encode_ns;                 // Palette generation, pixel conversion and RLE encoding of a save
+    uint64_t write_ns;
+    uint64_t close_ns;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t packets;                   // RLE packets read or written
+    uint64_t run_pixels;                // Pixels in run-length packets
+    uint64_t raw_pixels;                // Pixels in raw packets
+    uint64_t run_lengths[8];            // Run-length packets by length: 1, 2, 3-4, 5-8, ... 65-128 pixels
+    uint64_t raw_lengths[8];            // Raw packets by length
+    unsigned int allocations;           // Made on the calling thread
+} tga_metrics;
+
 typedef void *(*open_file_func) (const char *filename, const char *mode, void *stream);
 typedef size_t(*read_file_func) (void *buffer, size_t size, size_t count, void *stream);
 typedef size_t(*write_file_func) (void *buffer, size_t size, size_t count, void *stream);
 typedef long(*seek_file_func) (void *stream, long offset, int origin);
 typedef int(*close_file_func) (void *stream);
 
+typedef struct tga_lazy_image tga_lazy_image;
+typedef struct tga_decoder tga_decoder;
+typedef void (*tga_row_func) (const unsigned char *row, unsigned int y, void *user);
+typedef struct tga_packed_image tga_packed_image;
+
 typedef struct
 {
     open_file_func open_file;
@@ -80,11 +200,59 @@ typedef struct
 
 extern void flip_tga_horizontally(tga_image *tga);
 extern void flip_tga_vertically(tga_image *tga);
+extern bool resize_tga(tga_image *tga, unsigned int width, unsigned int height);
+extern bool convert_tga_channels(tga_image *tga, unsigned int channels);
 extern bool load_tga(const char *filename, tga_image *tga);
 extern bool load_tga_ext(const char *filename, tga_image *tga, tga_func_def *func_def);
+extern bool load_tga_mem(const void *data, size_t size, tga_image *tga);
+extern bool load_tga_metrics(const char *filename, tga_image *tga, tga_func_def *func_def, tga_metrics *metrics);
 extern void free_tga(tga_image *tga);
+extern bool load_tga_batch(const char *const *filenames, int count, tga_image *images);
+extern void free_tga_batch(tga_image *images, int count);
+extern bool load_tga_array(const char *const *filenames, int count, void *data, const tga_array_desc *desc, bool *failed);
+extern bool load_tga_yuv(const char *filename, tga_yuv_image *yuv, tga_yuv_format format, tga_yuv_matrix matrix);
+extern bool load_tga_yuv_ext(const char *filename, tga_yuv_image *yuv, tga_yuv_format format, tga_yuv_matrix matrix, tga_func_def *func_def);
+extern void free_tga_yuv(tga_yuv_image *yuv);
+extern tga_decoder *tga_decoder_create(tga_row_func func, void *user);
+extern bool tga_push(tga_decoder *decoder, const void *data, size_t size);
+extern bool tga_decoder_info(const tga_decoder *decoder, unsigned int *width, unsigned int *height, unsigned int *channels);
+extern bool tga_decoder_finish(tga_decoder *decoder, tga_image *tga);
+extern void tga_decoder_destroy(tga_decoder *decoder);
 extern bool save_tga(const char *filename, tga_image *tga, tga_type type);
 extern bool save_tga_ext(const char *filename, tga_image *tga, tga_type type, tga_func_def *func_def);
+extern bool save_tga_mem(tga_image *tga, tga_type type, void **data, size_t *size);
+extern bool save_tga_metrics(const char *filename, tga_image *tga, tga_type type, tga_func_def *func_def, tga_metrics *metrics);
+extern bool save_tga_float(const char *filename, const tga_float_image *image, tga_type type, unsigned int flags);
+extern bool save_tga_float_ext(const char *filename, const tga_float_image *image, tga_type type, unsigned int flags, tga_func_def *func_def);
+extern bool save_tga_if_changed(const char *filename, tga_image *tga, tga_type type, bool *skipped);
+extern bool save_tga_if_changed_ext(const char *filename, tga_image *tga, tga_type type, tga_func_def *func_def, bool *skipped);
+extern uint64_t tga_hash(const void *data, size_t size);
+extern bool tga_compare(const tga_image *a, const tga_image *b, unsigned int flags, tga_compare_metrics *metrics, tga_image *diff);
+extern void tga_set_budget(size_t limit, tga_budget_policy policy);
+extern void tga_get_budget_metrics(tga_budget_metrics *metrics);
+extern bool tga_set_spill(const char *directory, size_t threshold);
+extern void tga_set_read_ahead(size_t size);
+extern void tga_set_drop_cache(bool drop);
+extern void tga_set_direct_io(bool direct);
+extern void tga_set_save_threads(int threads);
+extern tga_lazy_image *tga_lazy_open(const char *filename);
+extern tga_lazy_image *tga_lazy_open_ext(const char *filename, tga_func_def *func_def);
+extern void tga_lazy_close(tga_lazy_image *lazy);
+extern void tga_lazy_info(const tga_lazy_image *lazy, unsigned int *width, unsigned int *height, unsigned int *channels);
+extern const unsigned char *tga_lazy_row(tga_lazy_image *lazy, unsigned int y);
+extern bool tga_lazy_read(tga_lazy_image *lazy, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned char *data);
+extern tga_packed_image *tga_pack(const tga_image *tga);
+extern tga_packed_image *tga_pack_load(const char *filename);
+extern tga_packed_image *tga_pack_load_ext(const char *filename, tga_func_def *func_def);
+extern void tga_pack_free(tga_packed_image *packed);
+extern void tga_pack_info(const tga_packed_image *packed, unsigned int *width, unsigned int *height, unsigned int *channels);
+extern size_t tga_pack_size(const tga_packed_image *packed);
+extern bool tga_pack_read(tga_packed_image *packed, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned char *data);
+extern void tga_set_pack_cache(size_t size);
+extern bool crop_tga_file(const char *input, const char *output, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+extern bool crop_tga_file_ext(const char *input, const char *output, unsigned int x, unsigned int y, unsigned int width, unsigned int height, tga_func_def *func_def);
+extern bool flip_tga_file_vertically(const char *input, const char *output);
+extern bool flip_tga_file_vertically_ext(const char *input, const char *output, tga_func_def *func_def);
 
 #if defined(_WIN64) || defined(_WIN32)
 extern bool wload_tga(const wchar_t *filename, tga_image *tga);
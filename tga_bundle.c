@@ -0,0 +1,478 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#if !defined(_WIN64) && !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "tga_bundle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if !defined(_WIN64) && !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Bundle layout, all fields little-endian:
+//
+//   header       64 bytes
+//   index        40 bytes per entry, sorted by name
+//   names        NUL-terminated names referenced by the index
+//   entries      each one starts on a page boundary
+#define BUNDLE_MAGIC            "TGABNDL"
+#define BUNDLE_VERSION          1
+#define BUNDLE_HEADER_SIZE      64
+#define BUNDLE_ENTRY_SIZE       40
+#define BUNDLE_PAGE_SIZE        4096
+
+#define BUNDLE_KIND_STORED      0
+#define BUNDLE_KIND_DECODED     1
+
+struct tga_bundle
+{
+    const byte *data;
+    size_t size;
+    int count;
+    const byte *index;
+    const char *names;
+    size_t names_size;
+};
+
+typedef struct
+{
+    const char *name;
+    const char *path;
+} bundle_input;
+
+static void put_u32(byte *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (byte)(value >> (i * 8));
+}
+
+static void put_u64(byte *p, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (byte)(value >> (i * 8));
+}
+
+static uint32_t get_u32(const byte *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(const byte *p)
+{
+    return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static int compare_inputs(const void *a, const void *b)
+{
+    return strcmp(((const bundle_input *)a)->name, ((const bundle_input *)b)->name);
+}
+
+static byte *read_whole_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    byte *data = NULL;
+    long length;
+
+    if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        data = (byte *)malloc(length);
+        if (data && fread(data, 1, length, file) != (size_t)length)
+        {
+            free(data);
+            data = NULL;
+        }
+
+        *size = length;
+    }
+
+    fclose(file);
+    return data;
+}
+
+static bool write_padding(FILE *file, uint64_t *position, uint64_t alignment)
+{
+    static const byte zeros[BUNDLE_PAGE_SIZE];
+    uint64_t padding = (alignment - *position % alignment) % alignment;
+
+    if (padding && fwrite(zeros, 1, (size_t)padding, file) != padding)
+        return false;
+
+    *position += padding;
+    return true;
+}
+
+bool tga_bundle_write(const char *filename, const char *const *names, const char *const *paths, int count, tga_bundle_mode mode)
+{
+    if (!filename || !names || !paths || count < 0)
+        return false;
+
+    bundle_input *inputs = (bundle_input *)malloc((count ? count : 1) * sizeof(bundle_input));
+    byte *index = (byte *)calloc(count ? count : 1, BUNDLE_ENTRY_SIZE);
+    if (!inputs || !index)
+    {
+        free(inputs);
+        free(index);
+        return false;
+    }
+
+    uint64_t names_size = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        inputs[i].name = names[i];
+        inputs[i].path = paths[i];
+        names_size += strlen(names[i]) + 1;
+    }
+
+    qsort(inputs, count, sizeof(bundle_input), compare_inputs);
+
+    // Names must be unique for the lookup to be unambiguous
+    for (int i = 1; i < count; i++)
+    {
+        if (strcmp(inputs[i - 1].name, inputs[i].name) == 0)
+        {
+            free(inputs);
+            free(index);
+            return false;
+        }
+    }
+
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+    {
+        free(inputs);
+        free(index);
+        return false;
+    }
+
+    bool success = names_size <= UINT32_MAX;
+    uint64_t position = 0;
+    uint64_t names_offset = BUNDLE_HEADER_SIZE + (uint64_t)count * BUNDLE_ENTRY_SIZE;
+    uint32_t name_offset = 0;
+
+    // Reserve room for the header and the index, they are written last
+    position = names_offset;
+    if (success && fseek(file, (long)position, SEEK_SET) != 0)
+        success = false;
+
+    for (int i = 0; success && i < count; i++)
+    {
+        size_t length = strlen(inputs[i].name);
+
+        put_u32(&index[i * BUNDLE_ENTRY_SIZE], name_offset);
+        put_u32(&index[i * BUNDLE_ENTRY_SIZE + 4], (uint32_t)length);
+
+        if (fwrite(inputs[i].name, 1, length + 1, file) != length + 1)
+            success = false;
+
+        name_offset += (uint32_t)(length + 1);
+        position += length + 1;
+    }
+
+    uint64_t data_offset = position + (BUNDLE_PAGE_SIZE - position % BUNDLE_PAGE_SIZE) % BUNDLE_PAGE_SIZE;
+
+    for (int i = 0; success && i < count; i++)
+    {
+        byte *entry = &index[i * BUNDLE_ENTRY_SIZE];
+        tga_image tga;
+        size_t file_size = 0;
+
+        byte *file_data = read_whole_file(inputs[i].path, &file_size);
+        if (!file_data || !load_tga_mem(file_data, file_size, &tga))
+        {
+            free(file_data);
+            success = false;
+            break;
+        }
+
+        const byte *data = file_data;
+        uint64_t size = file_size;
+        uint32_t kind = BUNDLE_KIND_STORED;
+
+        if (mode == TGA_BUNDLE_DECODED)
+        {
+            data = tga.data;
+            size = (uint64_t)tga.width * tga.height * tga.channels;
+            kind = BUNDLE_KIND_DECODED;
+        }
+
+        if (!write_padding(file, &position, BUNDLE_PAGE_SIZE) || fwrite(data, 1, (size_t)size, file) != size)
+            success = false;
+
+        put_u32(&entry[8], kind);
+        put_u32(&entry[12], tga.width);
+        put_u32(&entry[16], tga.height);
+        put_u32(&entry[20], tga.channels);
+        put_u64(&entry[24], position);
+        put_u64(&entry[32], size);
+
+        position += size;
+
+        free_tga(&tga);
+        free(file_data);
+    }
+
+    byte header[BUNDLE_HEADER_SIZE] = { 0 };
+    memcpy(header, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+    put_u32(&header[8], BUNDLE_VERSION);
+    put_u32(&header[12], (uint32_t)count);
+    put_u64(&header[16], BUNDLE_HEADER_SIZE);
+    put_u64(&header[24], names_offset);
+    put_u64(&header[32], names_size);
+    put_u64(&header[40], data_offset);
+
+    if (success && (fseek(file, 0, SEEK_SET) != 0 ||
+                    fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+                    fwrite(index, BUNDLE_ENTRY_SIZE, count, file) != (size_t)count))
+    {
+        success = false;
+    }
+
+    if (fclose(file) != 0)
+        success = false;
+
+    if (!success)
+        remove(filename);
+
+    free(inputs);
+    free(index);
+    return success;
+}
+
+static bool validate_bundle(tga_bundle *bundle)
+{
+    const byte *header = bundle->data;
+
+    if (bundle->size < BUNDLE_HEADER_SIZE || memcmp(header, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0)
+        return false;
+
+    if (get_u32(&header[8]) != BUNDLE_VERSION)
+        return false;
+
+    uint64_t count = get_u32(&header[12]);
+    uint64_t index_offset = get_u64(&header[16]);
+    uint64_t names_offset = get_u64(&header[24]);
+    uint64_t names_size = get_u64(&header[32]);
+
+    if (count > INT32_MAX || index_offset > bundle->size || count * BUNDLE_ENTRY_SIZE > bundle->size - index_offset)
+        return false;
+
+    if (names_offset > bundle->size || names_size > bundle->size - names_offset)
+        return false;
+
+    if (names_size && bundle->data[names_offset + names_size - 1] != '\0')
+        return false;
+
+    bundle->count = (int)count;
+    bundle->index = &bundle->data[index_offset];
+    bundle->names = (const char *)&bundle->data[names_offset];
+    bundle->names_size = (size_t)names_size;
+
+    for (int i = 0; i < bundle->count; i++)
+    {
+        const byte *entry = &bundle->index[i * BUNDLE_ENTRY_SIZE];
+        uint64_t name_offset = get_u32(&entry[0]);
+        uint64_t name_length = get_u32(&entry[4]);
+        uint64_t offset = get_u64(&entry[24]);
+        uint64_t size = get_u64(&entry[32]);
+
+        if (name_offset + name_length >= names_size || bundle->names[name_offset + name_length] != '\0')
+            return false;
+
+        if (offset > bundle->size || size > bundle->size - offset)
+            return false;
+
+        // TGA dimensions are 16-bit, which also keeps the product below from wrapping
+        if (get_u32(&entry[8]) == BUNDLE_KIND_DECODED &&
+            (get_u32(&entry[12]) > 65535 || get_u32(&entry[16]) > 65535 || get_u32(&entry[20]) > 4 ||
+             size != (uint64_t)get_u32(&entry[12]) * get_u32(&entry[16]) * get_u32(&entry[20])))
+            return false;
+
+        // Lookups are a binary search over the names
+        if (i && strcmp(tga_bundle_name(bundle, i - 1), tga_bundle_name(bundle, i)) >= 0)
+            return false;
+    }
+
+    return true;
+}
+
+tga_bundle *tga_bundle_open(const char *filename)
+{
+    if (!filename)
+        return NULL;
+
+    tga_bundle *bundle = (tga_bundle *)calloc(1, sizeof(tga_bundle));
+    if (!bundle)
+        return NULL;
+
+#if defined(_WIN64) || defined(_WIN32)
+    bundle->data = read_whole_file(filename, &bundle->size);
+    if (!bundle->data)
+    {
+        free(bundle);
+        return NULL;
+    }
+#else
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        free(bundle);
+        return NULL;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX)
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        free(bundle);
+        return NULL;
+    }
+
+    bundle->data = (const byte *)map;
+    bundle->size = (size_t)st.st_size;
+#endif
+
+    if (!validate_bundle(bundle))
+    {
+        tga_bundle_close(bundle);
+        return NULL;
+    }
+
+#if !defined(_WIN64) && !defined(_WIN32)
+    // Lookups touch the index and the names first, fault them in ahead of time
+    size_t index_end = (size_t)((const byte *)bundle->names - bundle->data) + bundle->names_size;
+    madvise((void *)bundle->data, index_end, MADV_WILLNEED);
+#endif
+
+    return bundle;
+}
+
+void tga_bundle_close(tga_bundle *bundle)
+{
+    if (!bundle)
+        return;
+
+#if defined(_WIN64) || defined(_WIN32)
+    free((void *)bundle->data);
+#else
+    munmap((void *)bundle->data, bundle->size);
+#endif
+
+    free(bundle);
+}
+
+int tga_bundle_count(const tga_bundle *bundle)
+{
+    return bundle ? bundle->count : 0;
+}
+
+const char *tga_bundle_name(const tga_bundle *bundle, int index)
+{
+    if (!bundle || index < 0 || index >= bundle->count)
+        return NULL;
+
+    return &bundle->names[get_u32(&bundle->index[index * BUNDLE_ENTRY_SIZE])];
+}
+
+static const byte *find_entry(const tga_bundle *bundle, const char *name)
+{
+    if (!bundle || !name)
+        return NULL;
+
+    int low = 0;
+    int high = bundle->count - 1;
+
+    while (low <= high)
+    {
+        int middle = low + (high - low) / 2;
+        int result = strcmp(name, tga_bundle_name(bundle, middle));
+
+        if (result == 0)
+            return &bundle->index[middle * BUNDLE_ENTRY_SIZE];
+        else if (result < 0)
+            high = middle - 1;
+        else
+            low = middle + 1;
+    }
+
+    return NULL;
+}
+
+bool tga_bundle_load(const tga_bundle *bundle, const char *name, tga_image *tga)
+{
+    const byte *entry = find_entry(bundle, name);
+    if (!entry || !tga)
+        return false;
+
+    const byte *data = &bundle->data[get_u64(&entry[24])];
+    size_t size = (size_t)get_u64(&entry[32]);
+
+    if (get_u32(&entry[8]) == BUNDLE_KIND_STORED)
+        return load_tga_mem(data, size, tga);
+
+    tga->data = (byte *)malloc(size ? size : 1);
+    if (!tga->data)
+        return false;
+
+    memcpy(tga->data, data, size);
+    tga->width = get_u32(&entry[12]);
+    tga->height = get_u32(&entry[16]);
+    tga->channels = get_u32(&entry[20]);
+
+    return true;
+}
+
+// Returns pixels that point straight into the mapped bundle. The view is read-only,
+// stays valid until the bundle is closed and must not be passed to free_tga.
+bool tga_bundle_view(const tga_bundle *bundle, const char *name, tga_image *tga)
+{
+    const byte *entry = find_entry(bundle, name);
+    if (!entry || !tga || get_u32(&entry[8]) != BUNDLE_KIND_DECODED)
+        return false;
+
+    tga->width = get_u32(&entry[12]);
+    tga->height = get_u32(&entry[16]);
+    tga->channels = get_u32(&entry[20]);
+    tga->data = (byte *)&bundle->data[get_u64(&entry[24])];
+
+    return true;
+}
@@ -0,0 +1,56 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#ifndef __TGA_BUNDLE_H__
+#define __TGA_BUNDLE_H__
+
+#include "tga.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A bundle packs many images into one file with a sorted name index and
+// page-aligned entries, so that it can be mapped once at startup.
+typedef struct tga_bundle tga_bundle;
+
+typedef enum
+{
+    TGA_BUNDLE_STORED,      // Entries keep the original TGA file bytes
+    TGA_BUNDLE_DECODED      // Entries keep decoded pixels, ready to be viewed in place
+} tga_bundle_mode;
+
+extern bool tga_bundle_write(const char *filename, const char *const *names, const char *const *paths, int count, tga_bundle_mode mode);
+extern tga_bundle *tga_bundle_open(const char *filename);
+extern void tga_bundle_close(tga_bundle *bundle);
+extern int tga_bundle_count(const tga_bundle *bundle);
+extern const char *tga_bundle_name(const tga_bundle *bundle, int index);
+extern bool tga_bundle_load(const tga_bundle *bundle, const char *name, tga_image *tga);
+extern bool tga_bundle_view(const tga_bundle *bundle, const char *name, tga_image *tga);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !__TGA_BUNDLE_H__
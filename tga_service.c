@@ -0,0 +1,706 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "tga_service.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SERVICE_STATUS_OK       0
+#define SERVICE_STATUS_FAILED   1
+
+#define SERVICE_TIMEOUT         5       // Seconds a client may take to send its request
+
+typedef enum
+{
+    ENTRY_LOADING,
+    ENTRY_READY,
+    ENTRY_FAILED
+} entry_state;
+
+typedef struct service_entry
+{
+    char *path;
+    dev_t device;
+    ino_t inode;
+    off_t file_size;
+    struct timespec modified;
+
+    entry_state state;
+    int fd;
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;
+    size_t size;
+    unsigned long long last_use;
+    int users;
+    bool dead;                  // Replaced by a newer decode of the file, freed by its last user
+
+    struct service_entry *next;
+} service_entry;
+
+typedef struct
+{
+    int32_t status;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint64_t size;
+} service_reply;
+
+struct tga_server
+{
+    int fd;
+    char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    volatile sig_atomic_t stopped;
+
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    pthread_cond_t idle;        // Signaled when the last client thread is done
+    int clients;
+    service_entry *entries;
+    size_t cache_size;
+    size_t cached;
+    unsigned long long clock;
+};
+
+typedef struct
+{
+    tga_server *server;
+    int fd;
+} service_client;
+
+static bool read_all(int fd, void *buffer, size_t size)
+{
+    byte *p = (byte *)buffer;
+
+    while (size)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool write_all(int fd, const void *buffer, size_t size)
+{
+    const byte *p = (const byte *)buffer;
+
+    while (size)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static void free_entry(tga_server *server, service_entry *entry)
+{
+    if (entry->state == ENTRY_READY)
+    {
+        server->cached -= entry->size;
+        close(entry->fd);
+    }
+
+    free(entry->path);
+    free(entry);
+}
+
+// Drops least recently used images until the cache fits. Entries that are still
+// in use are skipped, other threads are waiting on them.
+static void evict_entries(tga_server *server)
+{
+    while (server->cached > server->cache_size)
+    {
+        service_entry **oldest = NULL;
+
+        for (service_entry **p = &server->entries; *p; p = &(*p)->next)
+        {
+            if (!(*p)->users && (!oldest || (*p)->last_use < (*oldest)->last_use))
+                oldest = p;
+        }
+
+        if (!oldest)
+            break;
+
+        service_entry *entry = *oldest;
+        *oldest = entry->next;
+        free_entry(server, entry);
+    }
+}
+
+static bool same_file(const service_entry *entry, const struct stat *st)
+{
+    return entry->device == st->st_dev && entry->inode == st->st_ino && entry->file_size == st->st_size &&
+           entry->modified.tv_sec == st->st_mtim.tv_sec && entry->modified.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Decodes an image with the library's own loader into a sealed memfd
+static int decode_to_memfd(const char *path, service_entry *entry)
+{
+    tga_image tga;
+
+    if (!load_tga(path, &tga))
+        return -1;
+
+    size_t size = (size_t)tga.width * tga.height * tga.channels;
+    int fd = size ? memfd_create("tga", MFD_CLOEXEC | MFD_ALLOW_SEALING) : -1;
+
+    if (fd >= 0)
+    {
+        const byte *p = tga.data;
+        size_t left = size;
+
+        if (ftruncate(fd, size) != 0)
+            left = 1;
+
+        while (left && size)
+        {
+            ssize_t n = write(fd, p, left);
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n <= 0)
+                break;
+
+            p += n;
+            left -= n;
+        }
+
+        if (left || lseek(fd, 0, SEEK_SET) != 0 ||
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    entry->width = tga.width;
+    entry->height = tga.height;
+    entry->channels = tga.channels;
+    entry->size = size;
+
+    free_tga(&tga);
+    return fd;
+}
+
+// Returns a duplicate of the entry's memfd, decoding the image if nobody has done it yet.
+// Concurrent requests for the same file wait for the first one instead of decoding again.
+static int acquire_image(tga_server *server, const char *path, service_reply *reply)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    pthread_mutex_lock(&server->lock);
+
+    service_entry *entry = NULL;
+
+    for (service_entry **p = &server->entries; *p;)
+    {
+        if (strcmp((*p)->path, path) != 0)
+        {
+            p = &(*p)->next;
+            continue;
+        }
+
+        // The file changed since it was decoded, requests still using the old
+        // decode keep it alive until the last of them is done
+        if (!same_file(*p, &st))
+        {
+            service_entry *stale = *p;
+            *p = stale->next;
+
+            if (stale->users)
+                stale->dead = true;
+            else
+                free_entry(server, stale);
+
+            continue;
+        }
+
+        entry = *p;
+        break;
+    }
+
+    if (!entry)
+    {
+        entry = (service_entry *)calloc(1, sizeof(service_entry));
+        if (!entry || !(entry->path = strdup(path)))
+        {
+            free(entry);
+            pthread_mutex_unlock(&server->lock);
+            return -1;
+        }
+
+        entry->device = st.st_dev;
+        entry->inode = st.st_ino;
+        entry->file_size = st.st_size;
+        entry->modified = st.st_mtim;
+        entry->state = ENTRY_LOADING;
+        entry->fd = -1;
+        entry->users = 1;
+        entry->next = server->entries;
+        server->entries = entry;
+
+        pthread_mutex_unlock(&server->lock);
+        int fd = decode_to_memfd(path, entry);
+        pthread_mutex_lock(&server->lock);
+
+        entry->fd = fd;
+        entry->state = fd >= 0 ? ENTRY_READY : ENTRY_FAILED;
+
+        if (fd >= 0)
+            server->cached += entry->size;
+
+        pthread_cond_broadcast(&server->loaded);
+    }
+    else
+    {
+        entry->users++;
+    }
+
+    while (entry->state == ENTRY_LOADING)
+        pthread_cond_wait(&server->loaded, &server->lock);
+
+    int fd = -1;
+
+    if (entry->state == ENTRY_READY)
+    {
+        fd = fcntl(entry->fd, F_DUPFD_CLOEXEC, 0);
+        reply->width = entry->width;
+        reply->height = entry->height;
+        reply->channels = entry->channels;
+        reply->size = entry->size;
+    }
+
+    entry->last_use = ++server->clock;
+    entry->users--;
+
+    // Already unlinked from the cache
+    if (entry->dead)
+    {
+        if (!entry->users)
+            free_entry(server, entry);
+    }
+    // Failed decodes are not cached, the next request tries again
+    else if (entry->state == ENTRY_FAILED && !entry->users)
+    {
+        for (service_entry **p = &server->entries; *p; p = &(*p)->next)
+        {
+            if (*p == entry)
+            {
+                *p = entry->next;
+                free_entry(server, entry);
+                break;
+            }
+        }
+    }
+
+    evict_entries(server);
+    pthread_mutex_unlock(&server->lock);
+
+    return fd;
+}
+
+static void *serve_client(void *arg)
+{
+    service_client *client = (service_client *)arg;
+    service_reply reply = { SERVICE_STATUS_FAILED, 0, 0, 0, 0 };
+    char path[PATH_MAX];
+    uint32_t length;
+    int fd = -1;
+
+    if (read_all(client->fd, &length, sizeof(length)) && length && length < sizeof(path) &&
+        read_all(client->fd, path, length))
+    {
+        path[length] = '\0';
+
+        if ((fd = acquire_image(client->server, path, &reply)) >= 0)
+            reply.status = SERVICE_STATUS_OK;
+    }
+
+    struct iovec iov = { &reply, sizeof(reply) };
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    if (fd >= 0)
+    {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    while (sendmsg(client->fd, &message, MSG_NOSIGNAL) < 0 && errno == EINTR);
+
+    if (fd >= 0)
+        close(fd);
+
+    close(client->fd);
+
+    // The server may be destroyed as soon as the count drops to zero
+    tga_server *server = client->server;
+    free(client);
+
+    pthread_mutex_lock(&server->lock);
+    if (--server->clients == 0)
+        pthread_cond_broadcast(&server->idle);
+    pthread_mutex_unlock(&server->lock);
+
+    return NULL;
+}
+
+// Only processes of the same user, or root, may have images decoded with the server's privileges
+static bool trusted_client(int fd)
+{
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0)
+        return false;
+
+    return credentials.uid == 0 || credentials.uid == geteuid();
+}
+
+tga_server *tga_server_create(const char *socket_path, size_t cache_size)
+{
+    struct sockaddr_un address;
+
+    if (!socket_path || strlen(socket_path) >= sizeof(address.sun_path))
+        return NULL;
+
+    tga_server *server = (tga_server *)calloc(1, sizeof(tga_server));
+    if (!server)
+        return NULL;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    strcpy(server->socket_path, socket_path);
+
+    server->cache_size = cache_size;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->loaded, NULL);
+    pthread_cond_init(&server->idle, NULL);
+
+    // A socket left over from a previous run would make bind fail, anything else at the path is left alone
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+
+    // Nobody can connect before listen, so the socket is restricted to its owner without a race
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->fd < 0 || bind(server->fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        // Only a socket bound by this server is unlinked on destroy
+        if (server->fd >= 0)
+            close(server->fd);
+
+        server->fd = -1;
+        tga_server_destroy(server);
+        return NULL;
+    }
+
+    if (chmod(socket_path, 0600) != 0 || listen(server->fd, SOMAXCONN) != 0)
+    {
+        tga_server_destroy(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+bool tga_server_run(tga_server *server)
+{
+    if (!server)
+        return false;
+
+    while (!server->stopped)
+    {
+        int fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            break;
+        }
+
+        // A client that never sends its request must not hold a thread forever
+        struct timeval timeout = { SERVICE_TIMEOUT, 0 };
+
+        if (!trusted_client(fd) || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0)
+        {
+            close(fd);
+            continue;
+        }
+
+        service_client *client = (service_client *)malloc(sizeof(service_client));
+        pthread_t thread;
+
+        if (!client)
+        {
+            close(fd);
+            continue;
+        }
+
+        client->server = server;
+        client->fd = fd;
+
+        pthread_mutex_lock(&server->lock);
+        server->clients++;
+        pthread_mutex_unlock(&server->lock);
+
+        if (pthread_create(&thread, NULL, serve_client, client) != 0)
+        {
+            pthread_mutex_lock(&server->lock);
+            server->clients--;
+            pthread_mutex_unlock(&server->lock);
+
+            close(fd);
+            free(client);
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+
+    return server->stopped;
+}
+
+// Only sets a flag and shuts the listening socket down, so it is safe to call from a signal handler
+void tga_server_stop(tga_server *server)
+{
+    if (!server)
+        return;
+
+    server->stopped = 1;
+    shutdown(server->fd, SHUT_RDWR);
+}
+
+void tga_server_destroy(tga_server *server)
+{
+    if (!server)
+        return;
+
+    if (server->fd >= 0)
+    {
+        close(server->fd);
+        unlink(server->socket_path);
+    }
+
+    // Client threads are detached, wait for them to stop using the server
+    pthread_mutex_lock(&server->lock);
+    while (server->clients)
+        pthread_cond_wait(&server->idle, &server->lock);
+
+    while (server->entries)
+    {
+        service_entry *entry = server->entries;
+        server->entries = entry->next;
+        free_entry(server, entry);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->loaded);
+    pthread_cond_destroy(&server->idle);
+    free(server);
+}
+
+bool load_tga_shared(const char *socket_path, const char *filename, tga_shared_image *shared)
+{
+    struct sockaddr_un address;
+    char path[PATH_MAX];
+
+    if (!socket_path || !filename || !shared || strlen(socket_path) >= sizeof(address.sun_path))
+        return false;
+
+    // The server resolves paths on its own, relative paths are relative to the client
+    if (!realpath(filename, path))
+        return false;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+
+    uint32_t length = (uint32_t)strlen(path);
+    service_reply reply;
+    int image_fd = -1;
+
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct iovec iov = { &reply, sizeof(reply) };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received = -1;
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+        write_all(fd, &length, sizeof(length)) && write_all(fd, path, length))
+    {
+        while ((received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    }
+
+    close(fd);
+
+    for (struct cmsghdr *cmsg = received > 0 ? CMSG_FIRSTHDR(&message) : NULL; cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&image_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (received != sizeof(reply) || reply.status != SERVICE_STATUS_OK || image_fd < 0 || reply.size > SIZE_MAX)
+    {
+        if (image_fd >= 0)
+            close(image_fd);
+
+        return false;
+    }
+
+    void *data = mmap(NULL, (size_t)reply.size, PROT_READ, MAP_SHARED, image_fd, 0);
+    close(image_fd);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    shared->image.width = reply.width;
+    shared->image.height = reply.height;
+    shared->image.channels = reply.channels;
+    shared->image.data = (byte *)data;
+    shared->size = (size_t)reply.size;
+
+    return true;
+}
+
+void free_tga_shared(tga_shared_image *shared)
+{
+    if (!shared)
+        return;
+
+    if (shared->image.data)
+        munmap(shared->image.data, shared->size);
+
+    memset(shared, 0, sizeof(tga_shared_image));
+}
+
+#else
+
+tga_server *tga_server_create(const char *socket_path, size_t cache_size)
+{
+    (void)socket_path;
+    (void)cache_size;
+    return NULL;
+}
+
+bool tga_server_run(tga_server *server)
+{
+    (void)server;
+    return false;
+}
+
+void tga_server_stop(tga_server *server)
+{
+    (void)server;
+}
+
+void tga_server_destroy(tga_server *server)
+{
+    (void)server;
+}
+
+bool load_tga_shared(const char *socket_path, const char *filename, tga_shared_image *shared)
+{
+    (void)socket_path;
+    (void)filename;
+    (void)shared;
+    return false;
+}
+
+void free_tga_shared(tga_shared_image *shared)
+{
+    (void)shared;
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#ifndef __TGA_SERVICE_H__
+#define __TGA_SERVICE_H__
+
+#include "tga.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A local decode service (Linux only). The server decodes images once, keeps them in
+// sealed shared memory and hands read-only mappings to every process that asks for them.
+typedef struct tga_server tga_server;
+
+typedef struct
+{
+    tga_image image;    // Read-only pixels mapped from the server's shared memory
+    size_t size;
+} tga_shared_image;
+
+extern tga_server *tga_server_create(const char *socket_path, size_t cache_size);
+extern bool tga_server_run(tga_server *server);
+extern void tga_server_stop(tga_server *server);
+extern void tga_server_destroy(tga_server *server);
+
+extern bool load_tga_shared(const char *socket_path, const char *filename, tga_shared_image *shared);
+extern void free_tga_shared(tga_shared_image *shared);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !__TGA_SERVICE_H__
@@ -0,0 +1,584 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "tga_watch.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define WATCH_BUCKETS   1024
+#define WATCH_EVENTS    (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM)
+
+typedef struct watch_record
+{
+    char *path;
+
+    // What was delivered last time, to recognise rewrites that change nothing
+    byte header[18];
+    uint64_t hash;
+    bool loaded;
+
+    // Debouncing state, owned by the watcher thread
+    bool pending;
+    bool closed;
+    long long deadline;
+    long long size;
+
+    bool busy;
+
+    struct watch_record *next;
+    struct watch_record *next_pending;
+    struct watch_record *next_job;
+} watch_record;
+
+struct tga_watch
+{
+    int inotify_fd;
+    int wake_fd;
+    int debounce_ms;
+    tga_watch_func func;
+    void *user;
+
+    char **directories;
+    int directory_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t jobs_ready;
+    watch_record *buckets[WATCH_BUCKETS];
+    watch_record *pending;
+    watch_record *jobs;
+    watch_record *last_job;
+    bool stopped;
+
+    pthread_t watcher;
+    pthread_t *workers;
+    int worker_count;
+};
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool is_tga(const char *name)
+{
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(&name[length - 4], ".tga") == 0;
+}
+
+static watch_record *find_record(tga_watch *watch, const char *path, bool create)
+{
+    watch_record **bucket = &watch->buckets[tga_hash(path, strlen(path)) % WATCH_BUCKETS];
+
+    for (watch_record *record = *bucket; record; record = record->next)
+    {
+        if (strcmp(record->path, path) == 0)
+            return record;
+    }
+
+    if (!create)
+        return NULL;
+
+    watch_record *record = (watch_record *)calloc(1, sizeof(watch_record));
+    if (!record || !(record->path = strdup(path)))
+    {
+        free(record);
+        return NULL;
+    }
+
+    record->size = -1;
+    record->next = *bucket;
+    *bucket = record;
+
+    return record;
+}
+
+// Records of files that are gone are dropped, so a directory with churning files does not grow the table
+static void drop_record(tga_watch *watch, watch_record *record)
+{
+    watch_record **p = &watch->buckets[tga_hash(record->path, strlen(record->path)) % WATCH_BUCKETS];
+
+    while (*p != record)
+        p = &(*p)->next;
+
+    *p = record->next;
+    free(record->path);
+    free(record);
+}
+
+// Every event pushes the deadline back, the file is looked at once writes have calmed down.
+// A removed file only has its record looked at again, if it has one.
+static void schedule(tga_watch *watch, const char *path, bool closed, bool removed)
+{
+    pthread_mutex_lock(&watch->lock);
+
+    watch_record *record = find_record(watch, path, !removed);
+    if (record)
+    {
+        record->deadline = now_ms() + watch->debounce_ms;
+        record->closed = closed;
+
+        if (!record->pending)
+        {
+            record->pending = true;
+            record->size = -1;
+            record->next_pending = watch->pending;
+            watch->pending = record;
+        }
+    }
+
+    pthread_mutex_unlock(&watch->lock);
+}
+
+static void add_watches(tga_watch *watch, const char *path, bool created)
+{
+    int wd = inotify_add_watch(watch->inotify_fd, path, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0)
+        return;
+
+    if (wd >= watch->directory_count)
+    {
+        int count = wd * 2 + 16;
+        char **directories = (char **)realloc(watch->directories, count * sizeof(char *));
+        if (!directories)
+            return;
+
+        memset(&directories[watch->directory_count], 0, (count - watch->directory_count) * sizeof(char *));
+        watch->directories = directories;
+        watch->directory_count = count;
+    }
+
+    free(watch->directories[wd]);
+    watch->directories[wd] = strdup(path);
+
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        size_t length = strlen(path) + strlen(entry->d_name) + 2;
+        char *child = (char *)malloc(length);
+        if (!child)
+            continue;
+
+        snprintf(child, length, "%s/%s", path, entry->d_name);
+
+        struct stat st;
+        if (stat(child, &st) == 0)
+        {
+            if (S_ISDIR(st.st_mode))
+                add_watches(watch, child, created);
+            // Files may have landed in a new directory before its watch was added
+            else if (created && S_ISREG(st.st_mode) && is_tga(entry->d_name))
+                schedule(watch, child, false, false);
+        }
+
+        free(child);
+    }
+
+    closedir(dir);
+}
+
+static void handle_events(tga_watch *watch)
+{
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    while ((length = read(watch->inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *p = buffer; p < buffer + length;)
+        {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            // The watch is gone, after IN_DELETE_SELF or when the directory is unmounted
+            if ((event->mask & IN_IGNORED) && event->wd >= 0 && event->wd < watch->directory_count)
+            {
+                free(watch->directories[event->wd]);
+                watch->directories[event->wd] = NULL;
+                continue;
+            }
+
+            if (event->wd < 0 || event->wd >= watch->directory_count || !watch->directories[event->wd] || !event->len)
+                continue;
+
+            size_t size = strlen(watch->directories[event->wd]) + strlen(event->name) + 2;
+            char *path = (char *)malloc(size);
+            if (!path)
+                continue;
+
+            snprintf(path, size, "%s/%s", watch->directories[event->wd], event->name);
+
+            if (event->mask & IN_ISDIR)
+            {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    add_watches(watch, path, true);
+            }
+            else if (is_tga(event->name))
+            {
+                bool removed = (event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0;
+                schedule(watch, path, removed || (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0, removed);
+            }
+
+            free(path);
+        }
+    }
+}
+
+// Hands settled files to the workers and returns the time until the next deadline.
+// The pending list, the buckets and the debouncing fields are only changed on the watcher thread,
+// so the files are looked at without holding the lock the workers need.
+static int dispatch_pending(tga_watch *watch)
+{
+    long long now = now_ms();
+    long long next = -1;
+
+    for (watch_record **p = &watch->pending; *p;)
+    {
+        watch_record *record = *p;
+
+        if (record->deadline <= now)
+        {
+            // Only this thread sets busy, so a record seen idle stays idle until it is queued
+            pthread_mutex_lock(&watch->lock);
+            bool busy = record->busy;
+            pthread_mutex_unlock(&watch->lock);
+
+            struct stat st;
+            bool exists = !busy && stat(record->path, &st) == 0;
+
+            if (busy)
+            {
+                // Wait for the worker before looking at the file again
+                record->deadline = now + watch->debounce_ms;
+            }
+            // A writer that still has the file open must have left its size alone for a whole period
+            else if (exists && !record->closed && st.st_size != record->size)
+            {
+                record->size = st.st_size;
+                record->deadline = now + watch->debounce_ms;
+            }
+            else
+            {
+                pthread_mutex_lock(&watch->lock);
+
+                *p = record->next_pending;
+                record->pending = false;
+
+                if (exists)
+                {
+                    record->busy = true;
+                    record->next_job = NULL;
+
+                    if (watch->last_job)
+                        watch->last_job->next_job = record;
+                    else
+                        watch->jobs = record;
+
+                    watch->last_job = record;
+                    pthread_cond_signal(&watch->jobs_ready);
+                }
+
+                pthread_mutex_unlock(&watch->lock);
+
+                if (!exists)
+                    drop_record(watch, record);
+
+                continue;
+            }
+        }
+
+        if (next < 0 || record->deadline < next)
+            next = record->deadline;
+
+        p = &record->next_pending;
+    }
+
+    return next < 0 ? -1 : (int)(next > now ? next - now : 0);
+}
+
+static void *watch_thread(void *arg)
+{
+    tga_watch *watch = (tga_watch *)arg;
+    int timeout = -1;
+
+    for (;;)
+    {
+        struct pollfd fds[2] = { { watch->inotify_fd, POLLIN, 0 }, { watch->wake_fd, POLLIN, 0 } };
+
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+            break;
+
+        if (fds[1].revents & POLLIN)
+            break;
+
+        if (fds[0].revents & POLLIN)
+            handle_events(watch);
+
+        timeout = dispatch_pending(watch);
+    }
+
+    return NULL;
+}
+
+static byte *read_file(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    byte *data = NULL;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (data = (byte *)malloc(st.st_size)))
+    {
+        size_t total = 0;
+        ssize_t n;
+
+        while (total < (size_t)st.st_size && (n = read(fd, &data[total], st.st_size - total)) != 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n < 0)
+                break;
+
+            total += n;
+        }
+
+        if (total != (size_t)st.st_size)
+        {
+            free(data);
+            data = NULL;
+        }
+
+        *size = total;
+    }
+
+    close(fd);
+    return data;
+}
+
+static void *worker_thread(void *arg)
+{
+    tga_watch *watch = (tga_watch *)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&watch->lock);
+
+        while (!watch->jobs && !watch->stopped)
+            pthread_cond_wait(&watch->jobs_ready, &watch->lock);
+
+        watch_record *record = watch->jobs;
+        if (!record)
+        {
+            pthread_mutex_unlock(&watch->lock);
+            break;
+        }
+
+        watch->jobs = record->next_job;
+        if (!watch->jobs)
+            watch->last_job = NULL;
+
+        pthread_mutex_unlock(&watch->lock);
+
+        size_t size = 0;
+        byte *data = read_file(record->path, &size);
+
+        if (data && size >= sizeof(record->header))
+        {
+            uint64_t hash = tga_hash(data, size);
+
+            // Only the worker holding the record touches these fields
+            bool unchanged = record->loaded && record->hash == hash &&
+                             memcmp(record->header, data, sizeof(record->header)) == 0;
+
+            tga_image tga;
+
+            if (!unchanged && load_tga_mem(data, size, &tga))
+            {
+                memcpy(record->header, data, sizeof(record->header));
+                record->hash = hash;
+                record->loaded = true;
+
+                watch->func(record->path, &tga, watch->user);
+            }
+        }
+
+        free(data);
+
+        pthread_mutex_lock(&watch->lock);
+        record->busy = false;
+        pthread_mutex_unlock(&watch->lock);
+    }
+
+    return NULL;
+}
+
+tga_watch *tga_watch_start(const char *directory, int threads, int debounce_ms, tga_watch_func func, void *user)
+{
+    if (!directory || !func)
+        return NULL;
+
+    tga_watch *watch = (tga_watch *)calloc(1, sizeof(tga_watch));
+    if (!watch)
+        return NULL;
+
+    watch->debounce_ms = debounce_ms > 0 ? debounce_ms : 0;
+    watch->func = func;
+    watch->user = user;
+    watch->worker_count = threads > 0 ? threads : 1;
+    watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    watch->wake_fd = eventfd(0, EFD_CLOEXEC);
+    watch->workers = (pthread_t *)calloc(watch->worker_count, sizeof(pthread_t));
+
+    pthread_mutex_init(&watch->lock, NULL);
+    pthread_cond_init(&watch->jobs_ready, NULL);
+
+    if (watch->inotify_fd >= 0 && watch->wake_fd >= 0 && watch->workers)
+        add_watches(watch, directory, false);
+
+    if (!watch->directory_count || pthread_create(&watch->watcher, NULL, watch_thread, watch) != 0)
+    {
+        if (watch->inotify_fd >= 0)
+            close(watch->inotify_fd);
+
+        if (watch->wake_fd >= 0)
+            close(watch->wake_fd);
+
+        for (int i = 0; i < watch->directory_count; i++)
+            free(watch->directories[i]);
+
+        pthread_mutex_destroy(&watch->lock);
+        pthread_cond_destroy(&watch->jobs_ready);
+        free(watch->directories);
+        free(watch->workers);
+        free(watch);
+        return NULL;
+    }
+
+    for (int i = 0; i < watch->worker_count; i++)
+    {
+        if (pthread_create(&watch->workers[i], NULL, worker_thread, watch) != 0)
+        {
+            watch->worker_count = i;
+            break;
+        }
+    }
+
+    // Without workers the files would be queued forever
+    if (!watch->worker_count)
+    {
+        tga_watch_stop(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+void tga_watch_stop(tga_watch *watch)
+{
+    if (!watch)
+        return;
+
+    uint64_t value = 1;
+    while (write(watch->wake_fd, &value, sizeof(value)) < 0 && errno == EINTR);
+    pthread_join(watch->watcher, NULL);
+
+    // Workers finish the files that were already handed to them
+    pthread_mutex_lock(&watch->lock);
+    watch->stopped = true;
+    pthread_cond_broadcast(&watch->jobs_ready);
+    pthread_mutex_unlock(&watch->lock);
+
+    for (int i = 0; i < watch->worker_count; i++)
+        pthread_join(watch->workers[i], NULL);
+
+    for (int i = 0; i < WATCH_BUCKETS; i++)
+    {
+        while (watch->buckets[i])
+        {
+            watch_record *record = watch->buckets[i];
+            watch->buckets[i] = record->next;
+            free(record->path);
+            free(record);
+        }
+    }
+
+    for (int i = 0; i < watch->directory_count; i++)
+        free(watch->directories[i]);
+
+    close(watch->inotify_fd);
+    close(watch->wake_fd);
+    pthread_mutex_destroy(&watch->lock);
+    pthread_cond_destroy(&watch->jobs_ready);
+    free(watch->directories);
+    free(watch->workers);
+    free(watch);
+}
+
+#else
+
+tga_watch *tga_watch_start(const char *directory, int threads, int debounce_ms, tga_watch_func func, void *user)
+{
+    (void)directory;
+    (void)threads;
+    (void)debounce_ms;
+    (void)func;
+    (void)user;
+
+    return NULL;
+}
+
+void tga_watch_stop(tga_watch *watch)
+{
+    (void)watch;
+}
+
+#endif
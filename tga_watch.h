@@ -0,0 +1,48 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#ifndef __TGA_WATCH_H__
+#define __TGA_WATCH_H__
+
+#include "tga.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Watches a directory tree (Linux only) and reloads TGA files once writers have finished
+// with them. Rewrites that leave a file byte-for-byte identical are skipped.
+typedef struct tga_watch tga_watch;
+
+// Called on a worker thread. The callback owns the image and frees it with free_tga.
+typedef void (*tga_watch_func)(const char *filename, tga_image *tga, void *user);
+
+extern tga_watch *tga_watch_start(const char *directory, int threads, int debounce_ms, tga_watch_func func, void *user);
+extern void tga_watch_stop(tga_watch *watch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !__TGA_WATCH_H__
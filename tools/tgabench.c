@@ -0,0 +1,542 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "../tga.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TYPE_COUNT 10
+#define PATTERN_COUNT 6
+#define OP_COUNT 4
+
+typedef enum
+{
+    PATTERN_FLAT,
+    PATTERN_GRADIENT,
+    PATTERN_NOISE,
+    PATTERN_SPRITE,         // Opaque disks with soft edges on a transparent background
+    PATTERN_PHOTO,          // Smooth value noise with a little grain
+    PATTERN_PALETTE         // Blocks of at most 200 colors
+} pattern;
+
+typedef enum
+{
+    OP_LOAD_MEM,
+    OP_SAVE_MEM,
+    OP_LOAD_FILE,
+    OP_SAVE_FILE
+} operation;
+
+typedef struct
+{
+    double median;
+    double best;
+} timing;
+
+typedef struct
+{
+    int warmup;
+    int repetitions;
+    const char *directory;
+    bool patterns[PATTERN_COUNT];
+    bool types[TYPE_COUNT];
+    unsigned int sizes[8];
+    int size_count;
+    unsigned int channels[2];
+    int channel_count;
+} bench_options;
+
+static const char *const type_names[TYPE_COUNT] =
+{
+    "mapped", "rgb", "rgb16", "bw", "bw8", "mapped_rle", "rgb_rle", "rgb16_rle", "bw_rle", "bw8_rle"
+};
+
+static const char *const pattern_names[PATTERN_COUNT] = { "flat", "gradient", "noise", "sprite", "photo", "palette" };
+
+static const char *const op_names[OP_COUNT] = { "load_mem", "save_mem", "load_file", "save_file" };
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Every pattern is seeded the same way, so a corpus is identical from run to run
+static uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static uint32_t hash_cell(uint32_t x, uint32_t y)
+{
+    uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+// Bilinear interpolation of random values on a grid of the specified cell size
+static float value_noise(unsigned int x, unsigned int y, unsigned int cell, uint32_t seed)
+{
+    unsigned int cx = x / cell;
+    unsigned int cy = y / cell;
+    float fx = (float)(x % cell) / cell;
+    float fy = (float)(y % cell) / cell;
+
+    float a = (hash_cell(cx + seed, cy) & 0xff) / 255.0f;
+    float b = (hash_cell(cx + 1 + seed, cy) & 0xff) / 255.0f;
+    float c = (hash_cell(cx + seed, cy + 1) & 0xff) / 255.0f;
+    float d = (hash_cell(cx + 1 + seed, cy + 1) & 0xff) / 255.0f;
+
+    float top = a + (b - a) * fx;
+    float bottom = c + (d - c) * fx;
+
+    return top + (bottom - top) * fy;
+}
+
+static void generate_pixel(pattern kind, unsigned int x, unsigned int y, unsigned int size, uint32_t *state, byte *rgba)
+{
+    switch (kind)
+    {
+    case PATTERN_FLAT:
+        rgba[0] = 64; rgba[1] = 128; rgba[2] = 192; rgba[3] = 255;
+        break;
+    case PATTERN_GRADIENT:
+        rgba[0] = (byte)(x * 255 / (size - 1));
+        rgba[1] = (byte)(y * 255 / (size - 1));
+        rgba[2] = (byte)((x + y) * 255 / (2 * size - 2));
+        rgba[3] = (byte)(255 - x * 255 / (size - 1));
+        break;
+    case PATTERN_NOISE:
+    {
+        uint32_t r = next_random(state);
+        memcpy(rgba, &r, 4);
+        break;
+    }
+    case PATTERN_SPRITE:
+    {
+        uint32_t h = hash_cell(x / 32, y / 32);
+        int dx = (int)(x % 32) - 16;
+        int dy = (int)(y % 32) - 16;
+        int distance = dx * dx + dy * dy;
+
+        if (distance > 13 * 13)
+        {
+            rgba[0] = rgba[1] = rgba[2] = rgba[3] = 0;
+        }
+        else
+        {
+            rgba[0] = (byte)(h & 0xe0);
+            rgba[1] = (byte)(h >> 8 & 0xe0);
+            rgba[2] = (byte)(h >> 16 & 0xe0);
+            rgba[3] = distance > 12 * 12 ? 128 : 255;
+        }
+        break;
+    }
+    case PATTERN_PHOTO:
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            float v = value_noise(x, y, 64, c * 1000) * 0.6f + value_noise(x, y, 16, c * 1000 + 500) * 0.3f;
+            int grain = (int)(next_random(state) % 9) - 4;
+            int value = (int)(v * 255.0f / 0.9f) + grain;
+
+            rgba[c] = (byte)(value < 0 ? 0 : (value > 255 ? 255 : value));
+        }
+
+        rgba[3] = 255;
+        break;
+    }
+    case PATTERN_PALETTE:
+    {
+        uint32_t h = hash_cell(hash_cell(x / 16, y / 16) % 200, 7);
+        memcpy(rgba, &h, 3);
+        rgba[3] = 255;
+        break;
+    }
+    }
+}
+
+static bool generate_image(tga_image *tga, pattern kind, unsigned int size, unsigned int channels)
+{
+    uint32_t state = 0x9e3779b9u + kind;
+    size_t pixels = (size_t)size * size;
+
+    tga->width = size;
+    tga->height = size;
+    tga->channels = channels;
+    tga->data = (byte *)malloc(pixels * channels);
+
+    if (!tga->data)
+        return false;
+
+    for (unsigned int y = 0; y < size; y++)
+    {
+        for (unsigned int x = 0; x < size; x++)
+        {
+            byte rgba[4];
+
+            generate_pixel(kind, x, y, size, &state, rgba);
+            memcpy(&tga->data[((size_t)y * size + x) * channels], rgba, channels);
+        }
+    }
+
+    return true;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static bool run_once(operation op, tga_image *tga, tga_type type, const void *encoded, size_t encoded_size, const char *path)
+{
+    tga_image loaded;
+    void *data;
+    size_t size;
+
+    switch (op)
+    {
+    case OP_LOAD_MEM:
+        if (!load_tga_mem(encoded, encoded_size, &loaded))
+            return false;
+        free_tga(&loaded);
+        return true;
+    case OP_SAVE_MEM:
+        if (!save_tga_mem(tga, type, &data, &size))
+            return false;
+        free(data);
+        return true;
+    case OP_LOAD_FILE:
+        if (!load_tga(path, &loaded))
+            return false;
+        free_tga(&loaded);
+        return true;
+    case OP_SAVE_FILE:
+        return save_tga(path, tga, type);
+    }
+
+    return false;
+}
+
+static bool measure(const bench_options *options, operation op, tga_image *tga, tga_type type, const void *encoded, size_t encoded_size,
+                    const char *path, timing *result)
+{
+    double *times = (double *)malloc(options->repetitions * sizeof(double));
+    if (!times)
+        return false;
+
+    for (int i = 0; i < options->warmup; i++)
+    {
+        if (!run_once(op, tga, type, encoded, encoded_size, path))
+        {
+            free(times);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < options->repetitions; i++)
+    {
+        double start = now_seconds();
+
+        if (!run_once(op, tga, type, encoded, encoded_size, path))
+        {
+            free(times);
+            return false;
+        }
+
+        times[i] = now_seconds() - start;
+    }
+
+    qsort(times, options->repetitions, sizeof(double), compare_double);
+    result->best = times[0];
+    result->median = options->repetitions % 2 ? times[options->repetitions / 2] :
+                     (times[options->repetitions / 2 - 1] + times[options->repetitions / 2]) / 2.0;
+
+    free(times);
+    return true;
+}
+
+static bool parse_names(const char *list, const char *const *names, int count, bool *selected)
+{
+    char *copy = strdup(list);
+    if (!copy)
+        return false;
+
+    memset(selected, 0, count * sizeof(bool));
+
+    for (char *name = strtok(copy, ","); name; name = strtok(NULL, ","))
+    {
+        int i = 0;
+
+        while (i < count && strcmp(name, names[i]) != 0)
+            i++;
+
+        if (i == count)
+        {
+            free(copy);
+            return false;
+        }
+
+        selected[i] = true;
+    }
+
+    free(copy);
+    return true;
+}
+
+static bool parse_numbers(const char *list, unsigned int *numbers, int capacity, int *count)
+{
+    char *end;
+
+    *count = 0;
+
+    while (*list && *count < capacity)
+    {
+        unsigned long value = strtoul(list, &end, 10);
+        if (end == list || !value || (*end && *end != ','))
+            return false;
+
+        numbers[(*count)++] = (unsigned int)value;
+        list = *end ? end + 1 : end;
+    }
+
+    return *count > 0 && !*list;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tgabench [options]\n\n"
+                    "Measures load and save throughput on a synthetic corpus, from memory and from files.\n\n"
+                    "  -p patterns  comma separated: flat, gradient, noise, sprite, photo, palette, all by default\n"
+                    "  -t types     comma separated: mapped, rgb, rgb16, bw, bw8 or the same with _rle, all by default\n"
+                    "  -s sizes     comma separated square sizes, 64,256,1024,4096 by default, up to 16384\n"
+                    "  -c channels  comma separated: 3, 4, both by default\n"
+                    "  -w count     warmup runs, 1 by default\n"
+                    "  -r count     measured runs, the median is reported, 5 by default\n"
+                    "  -d dir       directory of the files, /tmp by default\n"
+                    "  -o file      also write the results as JSON\n");
+}
+
+int main(int argc, char **argv)
+{
+    bench_options options;
+    const char *json_path = NULL;
+    int opt;
+
+    memset(&options, 0, sizeof(options));
+    options.warmup = 1;
+    options.repetitions = 5;
+    options.directory = "/tmp";
+    options.sizes[0] = 64;
+    options.sizes[1] = 256;
+    options.sizes[2] = 1024;
+    options.sizes[3] = 4096;
+    options.size_count = 4;
+    options.channels[0] = 3;
+    options.channels[1] = 4;
+    options.channel_count = 2;
+
+    for (int i = 0; i < PATTERN_COUNT; i++)
+        options.patterns[i] = true;
+
+    for (int i = 0; i < TYPE_COUNT; i++)
+        options.types[i] = true;
+
+    while ((opt = getopt(argc, argv, "p:t:s:c:w:r:d:o:")) != -1)
+    {
+        bool valid = true;
+
+        switch (opt)
+        {
+        case 'p': valid = parse_names(optarg, pattern_names, PATTERN_COUNT, options.patterns); break;
+        case 't': valid = parse_names(optarg, type_names, TYPE_COUNT, options.types); break;
+        case 's': valid = parse_numbers(optarg, options.sizes, 8, &options.size_count); break;
+        case 'c': valid = parse_numbers(optarg, options.channels, 2, &options.channel_count); break;
+        case 'w': options.warmup = atoi(optarg); break;
+        case 'r': options.repetitions = atoi(optarg); break;
+        case 'd': options.directory = optarg; break;
+        case 'o': json_path = optarg; break;
+        default: valid = false; break;
+        }
+
+        if (!valid)
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind != argc || options.warmup < 0 || options.repetitions < 1)
+    {
+        usage();
+        return 1;
+    }
+
+    for (int i = 0; i < options.size_count; i++)
+    {
+        if (options.sizes[i] < 2 || options.sizes[i] > 16384)
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < options.channel_count; i++)
+    {
+        if (options.channels[i] != 3 && options.channels[i] != 4)
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    FILE *json = NULL;
+    if (json_path && !(json = fopen(json_path, "w")))
+    {
+        fprintf(stderr, "Error: Failed to open %s.\n", json_path);
+        return 1;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/tgabench_%d.tga", options.directory, (int)getpid());
+
+    if (json)
+        fprintf(json, "{\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"results\": [", options.warmup, options.repetitions);
+
+    printf("%-8s %5s %2s %-10s %7s", "pattern", "size", "ch", "type", "ratio");
+    for (int i = 0; i < OP_COUNT; i++)
+        printf(" %9s MB/s Mpx/s", op_names[i]);
+    printf("\n");
+
+    bool first = true;
+    int failed = 0;
+
+    // Throughput is counted in decoded bytes, so types of different depths compare directly
+    for (int s = 0; s < options.size_count; s++)
+    {
+        for (int p = 0; p < PATTERN_COUNT; p++)
+        {
+            if (!options.patterns[p])
+                continue;
+
+            for (int c = 0; c < options.channel_count; c++)
+            {
+                tga_image tga;
+                unsigned int size = options.sizes[s];
+
+                if (!generate_image(&tga, (pattern)p, size, options.channels[c]))
+                {
+                    fprintf(stderr, "Error: Failed to generate a %ux%u image.\n", size, size);
+                    return 1;
+                }
+
+                double pixels = (double)size * size;
+                double bytes = pixels * tga.channels;
+
+                for (int t = 0; t < TYPE_COUNT; t++)
+                {
+                    void *encoded;
+                    size_t encoded_size;
+                    timing results[OP_COUNT];
+
+                    if (!options.types[t])
+                        continue;
+
+                    // Palette types refuse images of over 256 colors
+                    if (!save_tga_mem(&tga, (tga_type)t, &encoded, &encoded_size))
+                    {
+                        printf("%-8s %5u %2u %-10s %7s\n", pattern_names[p], size, tga.channels, type_names[t], "-");
+                        continue;
+                    }
+
+                    bool success = save_tga(path, &tga, (tga_type)t);
+
+                    for (int op = 0; success && op < OP_COUNT; op++)
+                        success = measure(&options, (operation)op, &tga, (tga_type)t, encoded, encoded_size, path, &results[op]);
+
+                    free(encoded);
+
+                    if (!success)
+                    {
+                        fprintf(stderr, "Error: Failed to benchmark %s %u %u %s.\n", pattern_names[p], size, tga.channels, type_names[t]);
+                        failed++;
+                        continue;
+                    }
+
+                    printf("%-8s %5u %2u %-10s %6.1f%%", pattern_names[p], size, tga.channels, type_names[t], 100.0 * encoded_size / bytes);
+                    for (int op = 0; op < OP_COUNT; op++)
+                        printf(" %14.1f %5.1f", bytes / results[op].median / 1e6, pixels / results[op].median / 1e6);
+                    printf("\n");
+                    fflush(stdout);
+
+                    if (json)
+                    {
+                        fprintf(json, "%s\n    { \"pattern\": \"%s\", \"width\": %u, \"height\": %u, \"channels\": %u, \"type\": \"%s\", \"encoded_bytes\": %zu",
+                                first ? "" : ",", pattern_names[p], size, size, tga.channels, type_names[t], encoded_size);
+
+                        for (int op = 0; op < OP_COUNT; op++)
+                        {
+                            fprintf(json, ",\n      \"%s\": { \"median_s\": %.9f, \"best_s\": %.9f, \"mb_per_s\": %.3f, \"pixels_per_s\": %.0f }",
+                                    op_names[op], results[op].median, results[op].best, bytes / results[op].median / 1e6,
+                                    pixels / results[op].median);
+                        }
+
+                        fprintf(json, " }");
+                        first = false;
+                    }
+                }
+
+                free(tga.data);
+            }
+        }
+    }
+
+    remove(path);
+
+    if (json)
+    {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,752 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "../tga.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef struct
+{
+    char *name;         // Path relative to the input root, also the journal key
+    char *input;
+    char *output;
+    size_t cost;        // Projected peak memory of the conversion
+} job;
+
+// Owners pop from the bottom of their deque, idle workers steal from the top
+typedef struct
+{
+    pthread_mutex_t lock;
+    job **jobs;
+    int top;
+    int bottom;
+    int capacity;
+} job_deque;
+
+typedef struct
+{
+    tga_type type;
+    bool flip_horizontally;
+    bool flip_vertically;
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;
+    bool if_changed;
+    bool quiet;
+} convert_options;
+
+typedef struct
+{
+    convert_options options;
+
+    job_deque *deques;
+    int workers;
+
+    pthread_mutex_t memory_lock;
+    pthread_cond_t memory_freed;
+    size_t memory_limit;
+    size_t memory_used;
+
+    pthread_mutex_t journal_lock;
+    FILE *journal;
+
+    unsigned long long converted;
+    unsigned long long failed;
+    unsigned long long unchanged;
+    unsigned long long steals;
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long pixels;
+} converter;
+
+typedef struct
+{
+    converter *conv;
+    int index;
+} worker_arg;
+
+static volatile sig_atomic_t interrupted;
+
+static const struct
+{
+    const char *name;
+    tga_type type;
+} type_names[] =
+{
+    { "mapped", TGA_MAPPED }, { "rgb", TGA_RGB }, { "rgb16", TGA_RGB16 }, { "bw", TGA_BW }, { "bw8", TGA_BW8 },
+    { "mapped_rle", TGA_MAPPED_RLE }, { "rgb_rle", TGA_RGB_RLE }, { "rgb16_rle", TGA_RGB16_RLE },
+    { "bw_rle", TGA_BW_RLE }, { "bw8_rle", TGA_BW8_RLE }
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool is_tga(const char *path)
+{
+    size_t length = strlen(path);
+    return length > 4 && strcasecmp(&path[length - 4], ".tga") == 0;
+}
+
+static char *join_path(const char *a, const char *b)
+{
+    size_t length = strlen(a) + strlen(b) + 2;
+    char *path = (char *)malloc(length);
+
+    if (path)
+        snprintf(path, length, "%s%s%s", a, *a && *b ? "/" : "", b);
+
+    return path;
+}
+
+static bool make_parent_directories(const char *path)
+{
+    char *copy = strdup(path);
+    if (!copy)
+        return false;
+
+    for (char *p = copy + 1; *p; p++)
+    {
+        if (*p != '/')
+            continue;
+
+        *p = '\0';
+
+        if (mkdir(copy, 0777) != 0 && errno != EEXIST)
+        {
+            free(copy);
+            return false;
+        }
+
+        *p = '/';
+    }
+
+    free(copy);
+    return true;
+}
+
+// Decoded image, the conversion copy and the encoder's buffer, all at four bytes per pixel
+static size_t estimate_cost(const char *path, const convert_options *options)
+{
+    byte header[18];
+    size_t cost = 0;
+    FILE *file = fopen(path, "rb");
+
+    if (file)
+    {
+        if (fread(header, sizeof(header), 1, file) == 1)
+        {
+            size_t width = header[12] | header[13] << 8;
+            size_t height = header[14] | header[15] << 8;
+            cost = width * height * 4 * 3;
+        }
+
+        fclose(file);
+    }
+
+    if (options->width && options->height)
+        cost += (size_t)options->width * options->height * 4 * 2;
+
+    return cost;
+}
+
+static bool deque_push(job_deque *deque, job *item)
+{
+    if (deque->bottom == deque->capacity)
+    {
+        int capacity = deque->capacity ? deque->capacity * 2 : 64;
+        job **jobs = (job **)realloc(deque->jobs, capacity * sizeof(job *));
+        if (!jobs)
+            return false;
+
+        deque->jobs = jobs;
+        deque->capacity = capacity;
+    }
+
+    deque->jobs[deque->bottom++] = item;
+    return true;
+}
+
+static job *deque_pop(job_deque *deque)
+{
+    job *item = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top)
+        item = deque->jobs[--deque->bottom];
+    pthread_mutex_unlock(&deque->lock);
+
+    return item;
+}
+
+static job *deque_steal(job_deque *deque)
+{
+    job *item = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top)
+        item = deque->jobs[deque->top++];
+    pthread_mutex_unlock(&deque->lock);
+
+    return item;
+}
+
+static void reserve_memory(converter *conv, size_t cost)
+{
+    pthread_mutex_lock(&conv->memory_lock);
+
+    // A job larger than the whole limit still runs, but on its own
+    while (conv->memory_used && conv->memory_used + cost > conv->memory_limit)
+        pthread_cond_wait(&conv->memory_freed, &conv->memory_lock);
+
+    conv->memory_used += cost;
+    pthread_mutex_unlock(&conv->memory_lock);
+}
+
+static void release_memory(converter *conv, size_t cost)
+{
+    pthread_mutex_lock(&conv->memory_lock);
+    conv->memory_used -= cost;
+    pthread_cond_broadcast(&conv->memory_freed);
+    pthread_mutex_unlock(&conv->memory_lock);
+}
+
+static unsigned long long file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (unsigned long long)st.st_size : 0;
+}
+
+static bool convert(converter *conv, const job *item, bool *unchanged)
+{
+    const convert_options *options = &conv->options;
+    tga_image tga;
+
+    if (!load_tga(item->input, &tga))
+        return false;
+
+    bool success = true;
+
+    if (options->channels)
+        success = convert_tga_channels(&tga, options->channels);
+
+    if (success && options->width && options->height)
+        success = resize_tga(&tga, options->width, options->height);
+
+    if (options->flip_horizontally)
+        flip_tga_horizontally(&tga);
+
+    if (options->flip_vertically)
+        flip_tga_vertically(&tga);
+
+    if (success)
+        success = make_parent_directories(item->output);
+
+    // Write next to the destination and rename, an interrupted run never leaves half a file.
+    // save_tga_if_changed does the same with its own <output>.tmp once the image differs.
+    if (success && options->if_changed)
+    {
+        success = save_tga_if_changed(item->output, &tga, options->type, unchanged);
+    }
+    else if (success)
+    {
+        size_t length = strlen(item->output) + 5;
+        char *temp = (char *)malloc(length);
+
+        success = temp != NULL;
+
+        if (success)
+        {
+            snprintf(temp, length, "%s.tmp", item->output);
+            success = save_tga(temp, &tga, options->type) && rename(temp, item->output) == 0;
+
+            if (!success)
+                remove(temp);
+
+            free(temp);
+        }
+    }
+
+    if (success)
+        __atomic_add_fetch(&conv->pixels, (unsigned long long)tga.width * tga.height, __ATOMIC_RELAXED);
+
+    free_tga(&tga);
+    return success;
+}
+
+static void *worker_thread(void *arg)
+{
+    converter *conv = ((worker_arg *)arg)->conv;
+    int index = ((worker_arg *)arg)->index;
+
+    while (!interrupted)
+    {
+        job *item = deque_pop(&conv->deques[index]);
+
+        for (int i = 1; !item && i < conv->workers; i++)
+        {
+            if ((item = deque_steal(&conv->deques[(index + i) % conv->workers])))
+                __atomic_add_fetch(&conv->steals, 1, __ATOMIC_RELAXED);
+        }
+
+        if (!item)
+            break;
+
+        bool unchanged = false;
+
+        reserve_memory(conv, item->cost);
+        bool success = convert(conv, item, &unchanged);
+        release_memory(conv, item->cost);
+
+        if (success)
+        {
+            __atomic_add_fetch(&conv->converted, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&conv->bytes_read, file_size(item->input), __ATOMIC_RELAXED);
+
+            if (unchanged)
+                __atomic_add_fetch(&conv->unchanged, 1, __ATOMIC_RELAXED);
+            else
+                __atomic_add_fetch(&conv->bytes_written, file_size(item->output), __ATOMIC_RELAXED);
+
+            pthread_mutex_lock(&conv->journal_lock);
+            if (conv->journal)
+            {
+                fprintf(conv->journal, "%s\n", item->name);
+                fflush(conv->journal);
+            }
+            pthread_mutex_unlock(&conv->journal_lock);
+        }
+        else
+        {
+            __atomic_add_fetch(&conv->failed, 1, __ATOMIC_RELAXED);
+            fprintf(stderr, "Error: Failed to convert %s.\n", item->input);
+        }
+    }
+
+    return NULL;
+}
+
+typedef struct
+{
+    char **names;
+    uint64_t *hashes;
+    size_t capacity;
+    size_t count;
+} name_set;
+
+static bool set_contains(const name_set *set, const char *name)
+{
+    if (!set->capacity)
+        return false;
+
+    uint64_t hash = tga_hash(name, strlen(name));
+
+    for (size_t i = hash & (set->capacity - 1); set->names[i]; i = (i + 1) & (set->capacity - 1))
+    {
+        if (set->hashes[i] == hash && strcmp(set->names[i], name) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void set_add(name_set *set, const char *name)
+{
+    if ((set->count + 1) * 2 > set->capacity)
+    {
+        name_set grown = { NULL, NULL, set->capacity ? set->capacity * 2 : 1024, 0 };
+
+        grown.names = (char **)calloc(grown.capacity, sizeof(char *));
+        grown.hashes = (uint64_t *)calloc(grown.capacity, sizeof(uint64_t));
+        if (!grown.names || !grown.hashes)
+        {
+            free(grown.names);
+            free(grown.hashes);
+            return;
+        }
+
+        for (size_t i = 0; i < set->capacity; i++)
+        {
+            if (set->names[i])
+            {
+                set_add(&grown, set->names[i]);
+                free(set->names[i]);
+            }
+        }
+
+        free(set->names);
+        free(set->hashes);
+        *set = grown;
+    }
+
+    if (set_contains(set, name))
+        return;
+
+    uint64_t hash = tga_hash(name, strlen(name));
+    size_t i = hash & (set->capacity - 1);
+
+    while (set->names[i])
+        i = (i + 1) & (set->capacity - 1);
+
+    set->names[i] = strdup(name);
+    set->hashes[i] = hash;
+    set->count++;
+}
+
+// The first line records the options, a journal written with other options is started over
+static FILE *open_journal(const char *path, const char *signature, name_set *done)
+{
+    FILE *file = fopen(path, "r");
+    char line[8192];
+
+    if (file)
+    {
+        if (fgets(line, sizeof(line), file) && strcmp(line, signature) == 0)
+        {
+            while (fgets(line, sizeof(line), file))
+            {
+                size_t length = strlen(line);
+
+                // A line cut short by an interruption does not count
+                if (length && line[length - 1] == '\n')
+                {
+                    line[length - 1] = '\0';
+                    set_add(done, line);
+                }
+            }
+
+            fclose(file);
+            return fopen(path, "a");
+        }
+
+        fclose(file);
+    }
+
+    file = fopen(path, "w");
+    if (file)
+    {
+        fputs(signature, file);
+        fflush(file);
+    }
+
+    return file;
+}
+
+typedef struct
+{
+    job *jobs;
+    int count;
+    int capacity;
+} job_list;
+
+static bool add_job(job_list *list, const char *name, const char *input, const char *output)
+{
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        job *jobs = (job *)realloc(list->jobs, capacity * sizeof(job));
+        if (!jobs)
+            return false;
+
+        list->jobs = jobs;
+        list->capacity = capacity;
+    }
+
+    job *item = &list->jobs[list->count++];
+    item->name = strdup(name);
+    item->input = strdup(input);
+    item->output = strdup(output);
+    item->cost = 0;
+
+    return item->name && item->input && item->output;
+}
+
+static bool scan_directory(job_list *list, const char *input_root, const char *output_root, const char *relative)
+{
+    char *path = join_path(input_root, relative);
+    DIR *dir = path ? opendir(path) : NULL;
+
+    free(path);
+    if (!dir)
+        return false;
+
+    bool success = true;
+    struct dirent *entry;
+
+    while (success && (entry = readdir(dir)))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char *name = join_path(relative, entry->d_name);
+        char *input = name ? join_path(input_root, name) : NULL;
+        char *output = name ? join_path(output_root, name) : NULL;
+        struct stat st;
+
+        if (!name || !input || !output)
+            success = false;
+        else if (stat(input, &st) != 0)
+            ;
+        else if (S_ISDIR(st.st_mode))
+            success = scan_directory(list, input_root, output_root, name);
+        else if (S_ISREG(st.st_mode) && is_tga(name))
+            success = add_job(list, name, input, output);
+
+        free(name);
+        free(input);
+        free(output);
+    }
+
+    closedir(dir);
+    return success;
+}
+
+static int compare_cost(const void *a, const void *b)
+{
+    size_t x = ((const job *)a)->cost;
+    size_t y = ((const job *)b)->cost;
+
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static void handle_signal(int signal)
+{
+    (void)signal;
+    interrupted = 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tgaconv [options] <input> <output>\n\n"
+                    "Converts a TGA file, or every TGA file of a directory tree, into the output path.\n\n"
+                    "  -t type     output type: mapped, rgb, rgb16, bw, bw8 or the same with _rle, rgb by default\n"
+                    "  -x          flip horizontally\n"
+                    "  -y          flip vertically\n"
+                    "  -r WxH      resize\n"
+                    "  -c 3|4      convert to 3 or 4 channels\n"
+                    "  -j threads  number of worker threads, one per CPU by default\n"
+                    "  -m MB       memory used by images in flight, 1024 by default\n"
+                    "  -J journal  resume from and record progress in the journal file\n"
+                    "  -u          leave outputs that already hold the same image untouched\n"
+                    "  -q          do not print statistics\n");
+}
+
+int main(int argc, char **argv)
+{
+    converter conv;
+    const char *journal_path = NULL;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    size_t memory_mb = 1024;
+    int opt;
+
+    memset(&conv, 0, sizeof(conv));
+    conv.options.type = TGA_RGB;
+
+    while ((opt = getopt(argc, argv, "t:xyr:c:j:m:J:uq")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+        {
+            size_t i = 0;
+
+            for (; i < sizeof(type_names) / sizeof(type_names[0]); i++)
+            {
+                if (strcmp(optarg, type_names[i].name) == 0)
+                    break;
+            }
+
+            if (i == sizeof(type_names) / sizeof(type_names[0]))
+            {
+                usage();
+                return 1;
+            }
+
+            conv.options.type = type_names[i].type;
+            break;
+        }
+        case 'x': conv.options.flip_horizontally = true; break;
+        case 'y': conv.options.flip_vertically = true; break;
+        case 'r':
+            if (sscanf(optarg, "%ux%u", &conv.options.width, &conv.options.height) != 2 || !conv.options.width || !conv.options.height)
+            {
+                usage();
+                return 1;
+            }
+            break;
+        case 'c': conv.options.channels = (unsigned int)atoi(optarg); break;
+        case 'j': workers = atoi(optarg); break;
+        case 'm': memory_mb = strtoul(optarg, NULL, 10); break;
+        case 'J': journal_path = optarg; break;
+        case 'u': conv.options.if_changed = true; break;
+        case 'q': conv.options.quiet = true; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2 || (conv.options.channels && conv.options.channels != 3 && conv.options.channels != 4))
+    {
+        usage();
+        return 1;
+    }
+
+    const char *input = argv[optind];
+    const char *output = argv[optind + 1];
+    job_list list = { NULL, 0, 0 };
+    struct stat st;
+
+    if (stat(input, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        if (!scan_directory(&list, input, output, ""))
+        {
+            fprintf(stderr, "Error: Failed to scan %s.\n", input);
+            return 1;
+        }
+    }
+    else if (!add_job(&list, input, input, output))
+    {
+        return 1;
+    }
+
+    name_set done = { NULL, NULL, 0, 0 };
+    char signature[256];
+
+    snprintf(signature, sizeof(signature), "tgaconv %d %d %d %ux%u %u %d\n", (int)conv.options.type,
+             conv.options.flip_horizontally, conv.options.flip_vertically,
+             conv.options.width, conv.options.height, conv.options.channels, conv.options.if_changed);
+
+    if (journal_path && !(conv.journal = open_journal(journal_path, signature, &done)))
+    {
+        fprintf(stderr, "Error: Failed to open journal %s.\n", journal_path);
+        return 1;
+    }
+
+    // Jobs finished by an earlier run are dropped, the rest are dealt out largest first
+    int pending = 0;
+    for (int i = 0; i < list.count; i++)
+    {
+        if (!set_contains(&done, list.jobs[i].name))
+        {
+            list.jobs[pending] = list.jobs[i];
+            list.jobs[pending].cost = estimate_cost(list.jobs[pending].input, &conv.options);
+            pending++;
+        }
+    }
+
+    qsort(list.jobs, pending, sizeof(job), compare_cost);
+
+    conv.workers = workers > 0 ? workers : 1;
+    conv.memory_limit = memory_mb * 1024 * 1024;
+    conv.deques = (job_deque *)calloc(conv.workers, sizeof(job_deque));
+    pthread_t *threads = (pthread_t *)calloc(conv.workers, sizeof(pthread_t));
+    worker_arg *args = (worker_arg *)calloc(conv.workers, sizeof(worker_arg));
+
+    if (!conv.deques || !threads || !args)
+        return 1;
+
+    // Each deque is popped from the bottom, so the largest jobs are dealt last to run first
+    for (int i = 0; i < conv.workers; i++)
+        pthread_mutex_init(&conv.deques[i].lock, NULL);
+
+    for (int i = pending - 1; i >= 0; i--)
+    {
+        if (!deque_push(&conv.deques[i % conv.workers], &list.jobs[i]))
+        {
+            fprintf(stderr, "Error: Failed to queue %s.\n", list.jobs[i].input);
+            return 1;
+        }
+    }
+
+    pthread_mutex_init(&conv.memory_lock, NULL);
+    pthread_cond_init(&conv.memory_freed, NULL);
+    pthread_mutex_init(&conv.journal_lock, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    double start = now_seconds();
+
+    int started = 0;
+
+    // Every worker steals from the deques of the others, the threads that started drain them all
+    for (int i = 0; i < conv.workers; i++)
+    {
+        args[i].conv = &conv;
+        args[i].index = i;
+
+        if (pthread_create(&threads[started], NULL, worker_thread, &args[i]) == 0)
+            started++;
+    }
+
+    if (!started)
+    {
+        fprintf(stderr, "Error: Failed to start worker threads.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    double elapsed = now_seconds() - start;
+
+    if (conv.journal)
+        fclose(conv.journal);
+
+    if (!conv.options.quiet)
+    {
+        double seconds = elapsed > 0.0 ? elapsed : 1e-9;
+
+        printf("Converted %llu of %d files (%llu unchanged, %llu failed, %d resumed) in %.3f s with %d threads\n",
+               conv.converted, pending, conv.unchanged, conv.failed, list.count - pending, elapsed, started);
+        printf("  %.1f files/s, %.1f MB/s read, %.1f MB/s written, %.1f Mpixels/s, %llu steals\n",
+               conv.converted / seconds, conv.bytes_read / seconds / 1e6, conv.bytes_written / seconds / 1e6,
+               conv.pixels / seconds / 1e6, conv.steals);
+    }
+
+    if (interrupted)
+        return 130;
+
+    return conv.failed ? 1 : 0;
+}
@@ -0,0 +1,78 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "../tga_service.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+static tga_server *server;
+
+static void handle_signal(int signal)
+{
+    (void)signal;
+    tga_server_stop(server);
+}
+
+int main(int argc, char **argv)
+{
+    size_t cache_size = 1024;
+    int arg = 1;
+
+    if (arg + 1 < argc && strcmp(argv[arg], "-c") == 0)
+    {
+        cache_size = strtoul(argv[arg + 1], NULL, 10);
+        arg += 2;
+    }
+
+    if (arg + 1 != argc)
+    {
+        fprintf(stderr, "Usage: tgad [-c cache_mb] <socket>\n\n"
+                        "  -c  size of the decoded image cache in megabytes, 1024 by default\n");
+        return 1;
+    }
+
+    server = tga_server_create(argv[arg], cache_size * 1024 * 1024);
+    if (!server)
+    {
+        fprintf(stderr, "Error: Failed to listen on %s.\n", argv[arg]);
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    bool success = tga_server_run(server);
+    tga_server_destroy(server);
+
+    return success ? 0 : 1;
+}
@@ -0,0 +1,406 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+// The kernels are static, so the library is compiled into the benchmark
+#include "../tga.c"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define COUNTER_COUNT 4
+
+typedef struct
+{
+    tga_image image;        // Runs of 1 to 16 pixels of at most 200 colors
+    byte *packed;           // Two bytes per pixel, for the 16-bit and grayscale kernels
+    byte *output;
+    unsigned int channels;
+    size_t pixels;
+    size_t sink;            // Keeps results the compiler could otherwise drop
+} kernel_data;
+
+typedef struct
+{
+    const char *name;
+    const char *variant;
+    void (*run)(kernel_data *data);
+} kernel;
+
+typedef struct
+{
+    int fds[COUNTER_COUNT];
+    int error;              // errno of the first counter that could not be opened
+} counter_set;
+
+static const char *const counter_names[COUNTER_COUNT] = { "cycles", "instructions", "cache misses", "branch misses" };
+
+static void run_rgb_to_bgr(kernel_data *data)
+{
+    unsigned int channels = data->channels;
+
+    for (size_t i = 0; i < data->pixels; i++)
+        rgb_to_bgr(&data->image.data[i * channels], &data->output[i * channels], channels);
+}
+
+static void run_rgb_to_rgb16(kernel_data *data)
+{
+    unsigned int channels = data->channels;
+
+    for (size_t i = 0; i < data->pixels; i++)
+        rgb_to_rgb16(&data->image.data[i * channels], &data->packed[i * 2], channels);
+}
+
+static void run_rgb16_to_rgb(kernel_data *data)
+{
+    unsigned int channels = data->channels;
+
+    for (size_t i = 0; i < data->pixels; i++)
+        rgb16_to_rgb(&data->packed[i * 2], &data->output[i * channels], channels);
+}
+
+static void run_rgb_to_bw(kernel_data *data)
+{
+    unsigned int channels = data->channels;
+
+    for (size_t i = 0; i < data->pixels; i++)
+        rgb_to_bw(&data->image.data[i * channels], &data->packed[i * 2], channels, 2);
+}
+
+static void run_bw_to_rgb(kernel_data *data)
+{
+    unsigned int channels = data->channels;
+
+    for (size_t i = 0; i < data->pixels; i++)
+        bw_to_rgb(&data->packed[i * 2], &data->output[i * channels], channels);
+}
+
+// Only the packet scan of the RLE writers, without copying the pixels
+static void run_write_rle(kernel_data *data)
+{
+    size_t size = data->pixels * data->channels;
+
+    for (size_t i = 0; i < size;)
+    {
+        byte header;
+        int n = write_rle(&data->image, data->image.data, data->channels, i, &header);
+        if (!n)
+            break;
+
+        data->sink += header;
+        i += (size_t)(n > 0 ? n : -n) * data->channels;
+    }
+}
+
+static void run_generate_palette(kernel_data *data)
+{
+    byte *palette_data;
+    byte *color_data;
+
+    data->sink += generate_palette(&data->image, data->pixels * data->channels, &palette_data, &color_data);
+
+    free(palette_data);
+    free_pixels(color_data);
+}
+
+static void run_flip_horizontally(kernel_data *data)
+{
+    flip_tga_horizontally(&data->image);
+}
+
+static void run_flip_vertically(kernel_data *data)
+{
+    flip_tga_vertically(&data->image);
+}
+
+// Every kernel of the library is scalar, a vectorized version is added as another variant of the same name
+static const kernel kernels[] =
+{
+    { "rgb_to_bgr", "scalar", run_rgb_to_bgr },
+    { "rgb_to_rgb16", "scalar", run_rgb_to_rgb16 },
+    { "rgb16_to_rgb", "scalar", run_rgb16_to_rgb },
+    { "rgb_to_bw", "scalar", run_rgb_to_bw },
+    { "bw_to_rgb", "scalar", run_bw_to_rgb },
+    { "write_rle", "scalar", run_write_rle },
+    { "palette", "scalar", run_generate_palette },
+    { "flip_x", "scalar", run_flip_horizontally },
+    { "flip_y", "scalar", run_flip_vertically }
+};
+
+static bool create_data(kernel_data *data, unsigned int size, unsigned int channels)
+{
+    uint32_t state = 0x9e3779b9u;
+    byte colors[200][4];
+
+    memset(data, 0, sizeof(kernel_data));
+    data->channels = channels;
+    data->pixels = (size_t)size * size;
+    data->image.width = size;
+    data->image.height = size;
+    data->image.channels = channels;
+    data->image.data = (byte *)malloc(data->pixels * channels);
+    data->packed = (byte *)malloc(data->pixels * 2);
+    data->output = (byte *)malloc(data->pixels * channels);
+
+    if (!data->image.data || !data->packed || !data->output)
+        return false;
+
+    for (int i = 0; i < 200; i++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            colors[i][c] = (byte)state;
+        }
+    }
+
+    for (size_t i = 0; i < data->pixels;)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        size_t run = 1 + (state >> 8) % 16;
+        const byte *color = colors[state % 200];
+
+        for (; run && i < data->pixels; run--, i++)
+            memcpy(&data->image.data[i * channels], color, channels);
+    }
+
+    for (size_t i = 0; i < data->pixels * 2; i++)
+        data->packed[i] = data->image.data[i % (data->pixels * channels)];
+
+    return true;
+}
+
+static void free_data(kernel_data *data)
+{
+    free(data->image.data);
+    free(data->packed);
+    free(data->output);
+}
+
+#ifdef __linux__
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// Counters the kernel or the hardware refuses are left closed and their columns show a dash
+static void open_counters(counter_set *counters)
+{
+    counters->error = 0;
+
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        counters->fds[i] = -1;
+
+#ifdef __linux__
+    static const uint64_t configs[COUNTER_COUNT] =
+    {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        counters->fds[i] = open_counter(PERF_TYPE_HARDWARE, configs[i]);
+
+        if (counters->fds[i] < 0 && !counters->error)
+            counters->error = errno;
+    }
+#else
+    counters->error = ENOSYS;
+#endif
+}
+
+static void close_counters(counter_set *counters)
+{
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        if (counters->fds[i] >= 0)
+            close(counters->fds[i]);
+    }
+}
+
+static void start_counters(counter_set *counters)
+{
+#ifdef __linux__
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        if (counters->fds[i] >= 0)
+        {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+static void stop_counters(counter_set *counters, uint64_t *values)
+{
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        values[i] = 0;
+
+#ifdef __linux__
+        if (counters->fds[i] >= 0)
+        {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            if (read(counters->fds[i], &values[i], sizeof(uint64_t)) != sizeof(uint64_t))
+                values[i] = 0;
+        }
+#endif
+    }
+}
+
+static void print_value(const counter_set *counters, int counter, double value)
+{
+    if (counters->fds[counter] >= 0)
+        printf(" %10.2f", value);
+    else
+        printf(" %10s", "-");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tgakernels [options]\n\n"
+                    "Measures the pixel kernels of the library one at a time, with hardware counters when permitted.\n\n"
+                    "  -s size   square image size, 512 by default\n"
+                    "  -r count  measured runs, the fastest is reported, 9 by default\n"
+                    "  -k name   only run the named kernel\n");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int size = 512;
+    int repetitions = 9;
+    const char *only = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:r:k:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': size = (unsigned int)atoi(optarg); break;
+        case 'r': repetitions = atoi(optarg); break;
+        case 'k': only = optarg; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind != argc || size < 2 || size > 16384 || repetitions < 1)
+    {
+        usage();
+        return 1;
+    }
+
+    counter_set counters;
+    open_counters(&counters);
+
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        if (counters.fds[i] < 0)
+            fprintf(stderr, "Warning: No %s counter: %s.\n", counter_names[i], strerror(counters.error));
+    }
+
+    printf("%-13s %-7s %2s %10s %10s %10s %10s %10s %10s\n", "kernel", "variant", "ch", "ns/px", "cycles/px", "instr/px", "IPC",
+           "cmiss/kpx", "bmiss/kpx");
+
+    for (unsigned int channels = 3; channels <= 4; channels++)
+    {
+        kernel_data data;
+
+        if (!create_data(&data, size, channels))
+        {
+            fprintf(stderr, "Error: Failed to allocate a %ux%u image.\n", size, size);
+            return 1;
+        }
+
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+        {
+            double best = 0.0;
+            uint64_t best_values[COUNTER_COUNT] = { 0 };
+
+            if (only && strcmp(only, kernels[k].name) != 0)
+                continue;
+
+            // One warmup pass faults in the buffers and the code
+            kernels[k].run(&data);
+
+            for (int r = 0; r < repetitions; r++)
+            {
+                uint64_t values[COUNTER_COUNT];
+
+                start_counters(&counters);
+                uint64_t start = now_ns();
+                kernels[k].run(&data);
+                double elapsed = (double)(now_ns() - start);
+                stop_counters(&counters, values);
+
+                if (r == 0 || elapsed < best)
+                {
+                    best = elapsed;
+                    memcpy(best_values, values, sizeof(values));
+                }
+            }
+
+            double pixels = (double)data.pixels;
+
+            printf("%-13s %-7s %2u %10.3f", kernels[k].name, kernels[k].variant, channels, best / pixels);
+            print_value(&counters, 0, best_values[0] / pixels);
+            print_value(&counters, 1, best_values[1] / pixels);
+
+            if (counters.fds[0] >= 0 && counters.fds[1] >= 0 && best_values[0])
+                printf(" %10.2f", (double)best_values[1] / best_values[0]);
+            else
+                printf(" %10s", "-");
+
+            print_value(&counters, 2, best_values[2] * 1000.0 / pixels);
+            print_value(&counters, 3, best_values[3] * 1000.0 / pixels);
+            printf("\n");
+        }
+
+        free_data(&data);
+    }
+
+    close_counters(&counters);
+    return 0;
+}
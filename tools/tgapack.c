@@ -0,0 +1,202 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#if !defined(_WIN64) && !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "../tga_bundle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+typedef struct
+{
+    char **names;
+    char **paths;
+    int count;
+    int capacity;
+} file_list;
+
+static bool add_file(file_list *list, const char *name, const char *path)
+{
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        char **names = (char **)realloc(list->names, capacity * sizeof(char *));
+        if (names)
+            list->names = names;
+
+        char **paths = (char **)realloc(list->paths, capacity * sizeof(char *));
+        if (paths)
+            list->paths = paths;
+
+        if (!names || !paths)
+            return false;
+
+        list->capacity = capacity;
+    }
+
+    list->names[list->count] = strdup(name);
+    list->paths[list->count] = strdup(path);
+    list->count++;
+
+    return list->names[list->count - 1] && list->paths[list->count - 1];
+}
+
+static bool is_tga(const char *path)
+{
+    size_t length = strlen(path);
+    return length > 4 && strcasecmp(&path[length - 4], ".tga") == 0;
+}
+
+// Walks a directory tree, naming every image after its path relative to the root
+static bool add_directory(file_list *list, const char *root, const char *relative)
+{
+    char path[4096];
+
+    // A truncated path would name another file
+    if ((size_t)snprintf(path, sizeof(path), "%s%s%s", root, *relative ? "/" : "", relative) >= sizeof(path))
+    {
+        fprintf(stderr, "Error: Path too long: %s/%s.\n", root, relative);
+        return false;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir)
+        return false;
+
+    bool success = true;
+    struct dirent *entry;
+
+    while (success && (entry = readdir(dir)))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char name[4096];
+        char child[4096];
+        struct stat st;
+
+        if ((size_t)snprintf(name, sizeof(name), "%s%s%s", relative, *relative ? "/" : "", entry->d_name) >= sizeof(name) ||
+            (size_t)snprintf(child, sizeof(child), "%s/%s", root, name) >= sizeof(child))
+        {
+            fprintf(stderr, "Error: Path too long: %s/%s/%s.\n", root, relative, entry->d_name);
+            success = false;
+            break;
+        }
+
+        if (lstat(child, &st) != 0)
+            continue;
+
+        // Links to files are followed, links to directories are not, one back up the tree would recurse forever
+        if (S_ISDIR(st.st_mode))
+            success = add_directory(list, root, name);
+        else if ((S_ISLNK(st.st_mode) ? stat(child, &st) == 0 && S_ISREG(st.st_mode) : S_ISREG(st.st_mode)) && is_tga(name))
+            success = add_file(list, name, child);
+    }
+
+    closedir(dir);
+    return success;
+}
+
+static int list_bundle(const char *filename)
+{
+    tga_bundle *bundle = tga_bundle_open(filename);
+    if (!bundle)
+    {
+        fprintf(stderr, "Error: Failed to open bundle %s.\n", filename);
+        return 1;
+    }
+
+    for (int i = 0; i < tga_bundle_count(bundle); i++)
+    {
+        tga_image tga;
+        const char *name = tga_bundle_name(bundle, i);
+
+        if (tga_bundle_view(bundle, name, &tga))
+            printf("%s\t%ux%ux%u\tdecoded\n", name, tga.width, tga.height, tga.channels);
+        else
+            printf("%s\tstored\n", name);
+    }
+
+    tga_bundle_close(bundle);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    tga_bundle_mode mode = TGA_BUNDLE_STORED;
+    int arg = 1;
+
+    if (argc == 3 && strcmp(argv[1], "-l") == 0)
+        return list_bundle(argv[2]);
+
+    if (arg < argc && strcmp(argv[arg], "-d") == 0)
+    {
+        mode = TGA_BUNDLE_DECODED;
+        arg++;
+    }
+
+    if (argc - arg < 2)
+    {
+        fprintf(stderr, "Usage: tgapack [-d] <bundle> <file or directory>...\n"
+                        "       tgapack -l <bundle>\n\n"
+                        "  -d  store decoded pixels instead of the original TGA bytes\n"
+                        "  -l  list the entries of a bundle\n");
+        return 1;
+    }
+
+    const char *output = argv[arg++];
+    file_list list = { 0 };
+
+    for (; arg < argc; arg++)
+    {
+        struct stat st;
+        bool success;
+
+        if (stat(argv[arg], &st) == 0 && S_ISDIR(st.st_mode))
+            success = add_directory(&list, argv[arg], "");
+        else
+            success = add_file(&list, argv[arg], argv[arg]);
+
+        if (!success)
+        {
+            fprintf(stderr, "Error: Failed to add %s.\n", argv[arg]);
+            return 1;
+        }
+    }
+
+    if (!tga_bundle_write(output, (const char *const *)list.names, (const char *const *)list.paths, list.count, mode))
+    {
+        fprintf(stderr, "Error: Failed to write bundle %s.\n", output);
+        return 1;
+    }
+
+    printf("Packed %d images into %s.\n", list.count, output);
+    return 0;
+}
@@ -0,0 +1,566 @@
+/*
+===============================================================================
+    Copyright (C) 2011-2023 Ilya Lyakhovets
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+===============================================================================
+*/
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "../tga.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TYPE_COUNT 10
+
+typedef enum
+{
+    ALPHA_NONE,         // No alpha channel, or every pixel is opaque
+    ALPHA_BINARY,       // Only fully transparent and fully opaque pixels
+    ALPHA_BLENDED       // Partially transparent pixels too
+} alpha_usage;
+
+typedef struct
+{
+    char *path;
+    bool loaded;
+
+    byte image_type;    // As stored in the file header
+    byte bits;
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;
+    tga_metrics metrics;
+
+    size_t colors;      // Stops counting past the limit of the palette types when sizes are not estimated
+    alpha_usage alpha;
+    bool estimated[TYPE_COUNT];
+    uint64_t sizes[TYPE_COUNT];
+} file_stats;
+
+typedef struct
+{
+    file_stats *files;
+    int count;
+    int capacity;
+    int next;
+    bool estimate;
+} stats_list;
+
+static const char *const type_names[TYPE_COUNT] =
+{
+    "mapped", "rgb", "rgb16", "bw", "bw8", "mapped_rle", "rgb_rle", "rgb16_rle", "bw_rle", "bw8_rle"
+};
+
+static const char *const length_names[8] = { "1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65-128" };
+
+static bool is_tga(const char *path)
+{
+    size_t length = strlen(path);
+    return length > 4 && strcasecmp(&path[length - 4], ".tga") == 0;
+}
+
+static char *join_path(const char *a, const char *b)
+{
+    size_t length = strlen(a) + strlen(b) + 2;
+    char *path = (char *)malloc(length);
+
+    if (path)
+        snprintf(path, length, "%s%s%s", a, *a && *b ? "/" : "", b);
+
+    return path;
+}
+
+static bool add_file(stats_list *list, const char *path)
+{
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        file_stats *files = (file_stats *)realloc(list->files, capacity * sizeof(file_stats));
+        if (!files)
+            return false;
+
+        list->files = files;
+        list->capacity = capacity;
+    }
+
+    file_stats *stats = &list->files[list->count++];
+    memset(stats, 0, sizeof(file_stats));
+    stats->path = strdup(path);
+
+    return stats->path != NULL;
+}
+
+static bool scan_directory(stats_list *list, const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir)
+        return false;
+
+    bool success = true;
+    struct dirent *entry;
+
+    while (success && (entry = readdir(dir)))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char *child = join_path(path, entry->d_name);
+        struct stat st;
+
+        if (!child)
+            success = false;
+        else if (stat(child, &st) != 0)
+            ;
+        else if (S_ISDIR(st.st_mode))
+            success = scan_directory(list, child);
+        else if (S_ISREG(st.st_mode) && is_tga(child))
+            success = add_file(list, child);
+
+        free(child);
+    }
+
+    closedir(dir);
+    return success;
+}
+
+static int compare_path(const void *a, const void *b)
+{
+    return strcmp(((const file_stats *)a)->path, ((const file_stats *)b)->path);
+}
+
+// Pixels are packed into a 32-bit key, slot keys are offset by one so that zero marks an empty slot
+static size_t count_colors(const tga_image *tga, size_t limit)
+{
+    size_t pixels = (size_t)tga->width * tga->height;
+    size_t capacity = 1024;
+    size_t count = 0;
+    uint64_t *slots = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+
+    if (!slots)
+        return 0;
+
+    for (size_t i = 0; i < pixels && count <= limit; i++)
+    {
+        const byte *pixel = &tga->data[i * tga->channels];
+        uint32_t color = 0;
+
+        for (unsigned int c = 0; c < tga->channels; c++)
+            color = color << 8 | pixel[c];
+
+        uint64_t key = (uint64_t)color + 1;
+        size_t slot = (size_t)(key * 0x9e3779b97f4a7c15ull >> 32) & (capacity - 1);
+
+        while (slots[slot] && slots[slot] != key)
+            slot = (slot + 1) & (capacity - 1);
+
+        if (slots[slot])
+            continue;
+
+        slots[slot] = key;
+        count++;
+
+        // Grow at half load
+        if (count * 2 > capacity)
+        {
+            size_t grown_capacity = capacity * 2;
+            uint64_t *grown = (uint64_t *)calloc(grown_capacity, sizeof(uint64_t));
+            if (!grown)
+            {
+                free(slots);
+                return 0;
+            }
+
+            for (size_t j = 0; j < capacity; j++)
+            {
+                if (!slots[j])
+                    continue;
+
+                size_t k = (size_t)(slots[j] * 0x9e3779b97f4a7c15ull >> 32) & (grown_capacity - 1);
+
+                while (grown[k])
+                    k = (k + 1) & (grown_capacity - 1);
+
+                grown[k] = slots[j];
+            }
+
+            free(slots);
+            slots = grown;
+            capacity = grown_capacity;
+        }
+    }
+
+    free(slots);
+    return count;
+}
+
+static alpha_usage find_alpha_usage(const tga_image *tga)
+{
+    if (tga->channels != 4)
+        return ALPHA_NONE;
+
+    size_t pixels = (size_t)tga->width * tga->height;
+    alpha_usage usage = ALPHA_NONE;
+
+    for (size_t i = 0; i < pixels; i++)
+    {
+        byte alpha = tga->data[i * 4 + 3];
+
+        if (alpha != 0 && alpha != 255)
+            return ALPHA_BLENDED;
+
+        if (alpha == 0)
+            usage = ALPHA_BINARY;
+    }
+
+    return usage;
+}
+
+// Sizes are measured by encoding into a stream that only counts the bytes written to it
+static void *count_open(const char *filename, const char *mode, void *stream)
+{
+    (void)filename;
+    (void)mode;
+    *(uint64_t *)stream = 0;
+    return stream;
+}
+
+static size_t count_write(void *buffer, size_t size, size_t count, void *stream)
+{
+    (void)buffer;
+    *(uint64_t *)stream += (uint64_t)size * count;
+    return count;
+}
+
+static long count_seek(void *stream, long offset, int origin)
+{
+    (void)stream;
+    (void)offset;
+    (void)origin;
+    return -1;
+}
+
+static int count_close(void *stream)
+{
+    (void)stream;
+    return 0;
+}
+
+static bool encoded_size(tga_image *tga, tga_type type, uint64_t *size)
+{
+    tga_func_def func_def = { count_open, NULL, count_write, count_seek, count_close, size };
+    return save_tga_ext("", tga, type, &func_def);
+}
+
+static void read_type(file_stats *stats)
+{
+    byte header[18];
+    FILE *file = fopen(stats->path, "rb");
+
+    if (file)
+    {
+        if (fread(header, sizeof(header), 1, file) == 1)
+        {
+            stats->image_type = header[2];
+            stats->bits = header[16];
+        }
+
+        fclose(file);
+    }
+}
+
+static void profile(file_stats *stats, bool estimate)
+{
+    tga_image tga;
+
+    if (!load_tga_metrics(stats->path, &tga, NULL, &stats->metrics))
+        return;
+
+    read_type(stats);
+
+    stats->loaded = true;
+    stats->width = tga.width;
+    stats->height = tga.height;
+    stats->channels = tga.channels;
+    stats->colors = count_colors(&tga, estimate ? (size_t)-1 : 256);
+    stats->alpha = find_alpha_usage(&tga);
+
+    // The legacy writers only take three and four channels, palettes only take 256 colors
+    if (estimate && (tga.channels == 3 || tga.channels == 4))
+    {
+        for (int i = 0; i < TYPE_COUNT; i++)
+        {
+            if ((i == TGA_MAPPED || i == TGA_MAPPED_RLE) && stats->colors > 256)
+                continue;
+
+            stats->estimated[i] = encoded_size(&tga, (tga_type)i, &stats->sizes[i]);
+        }
+    }
+
+    free_tga(&tga);
+}
+
+static void *worker_thread(void *arg)
+{
+    stats_list *list = (stats_list *)arg;
+    int index;
+
+    while ((index = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED)) < list->count)
+        profile(&list->files[index], list->estimate);
+
+    return NULL;
+}
+
+static const char *type_name(byte image_type)
+{
+    switch (image_type)
+    {
+    case 1: return "mapped";
+    case 2: return "rgb";
+    case 3: return "bw";
+    case 9: return "mapped_rle";
+    case 10: return "rgb_rle";
+    case 11: return "bw_rle";
+    default: return "unknown";
+    }
+}
+
+static void print_lengths(const char *name, const uint64_t *lengths)
+{
+    printf("    %-4s", name);
+
+    for (int i = 0; i < 8; i++)
+        printf(" %8llu", (unsigned long long)lengths[i]);
+
+    printf("\n");
+}
+
+static void print_packets(const tga_metrics *metrics)
+{
+    uint64_t pixels = metrics->run_pixels + metrics->raw_pixels;
+
+    printf("  %llu packets, %.1f%% of pixels in runs, %.1f%% raw, %.2f pixels per packet\n",
+           (unsigned long long)metrics->packets,
+           pixels ? 100.0 * metrics->run_pixels / pixels : 0.0,
+           pixels ? 100.0 * metrics->raw_pixels / pixels : 0.0,
+           metrics->packets ? (double)pixels / metrics->packets : 0.0);
+
+    printf("    %-4s", "");
+
+    for (int i = 0; i < 8; i++)
+        printf(" %8s", length_names[i]);
+
+    printf("\n");
+    print_lengths("run", metrics->run_lengths);
+    print_lengths("raw", metrics->raw_lengths);
+}
+
+static void print_sizes(const bool *estimated, const uint64_t *sizes, uint64_t pixels)
+{
+    printf("  estimated sizes:\n");
+
+    for (int i = 0; i < TYPE_COUNT; i++)
+    {
+        if (estimated[i])
+            printf("    %-10s %12llu bytes, %.3f bytes/pixel\n", type_names[i], (unsigned long long)sizes[i],
+                   pixels ? (double)sizes[i] / pixels : 0.0);
+        else
+            printf("    %-10s %12s\n", type_names[i], "-");
+    }
+}
+
+static void print_file(const file_stats *stats)
+{
+    static const char *const alpha_names[] = { "none", "binary", "blended" };
+    uint64_t pixels = (uint64_t)stats->width * stats->height;
+    double achieved = pixels ? (double)stats->metrics.bytes_read / pixels : 0.0;
+
+    printf("%s: %ux%u, %u channels, %s %u-bit\n", stats->path, stats->width, stats->height, stats->channels,
+           type_name(stats->image_type), stats->bits);
+    printf("  %llu bytes, %.3f bytes/pixel, %.1f%% of %u bytes/pixel raw\n", (unsigned long long)stats->metrics.bytes_read,
+           achieved, 100.0 * achieved / stats->channels, stats->channels);
+
+    if (stats->colors > 256)
+        printf("  %s colors, too many for a palette, alpha %s\n", "over 256", alpha_names[stats->alpha]);
+    else
+        printf("  %zu colors, fits a palette, alpha %s\n", stats->colors, alpha_names[stats->alpha]);
+
+    if (stats->image_type >= 9)
+        print_packets(&stats->metrics);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tgastat [options] <input>...\n\n"
+                    "Profiles the RLE packets, colors and alpha of TGA files or of every TGA file of directory trees.\n\n"
+                    "  -e          estimate the size of each file under every TGA type\n"
+                    "  -j threads  number of worker threads, one per CPU by default\n"
+                    "  -s          only print the totals\n");
+}
+
+int main(int argc, char **argv)
+{
+    stats_list list;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool summary = false;
+    int opt;
+
+    memset(&list, 0, sizeof(list));
+
+    while ((opt = getopt(argc, argv, "ej:s")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e': list.estimate = true; break;
+        case 'j': workers = atoi(optarg); break;
+        case 's': summary = true; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind == argc)
+    {
+        usage();
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+        struct stat st;
+        bool success;
+
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            success = scan_directory(&list, argv[i]);
+        else
+            success = add_file(&list, argv[i]);
+
+        if (!success)
+        {
+            fprintf(stderr, "Error: Failed to scan %s.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    qsort(list.files, list.count, sizeof(file_stats), compare_path);
+
+    workers = workers > 0 ? workers : 1;
+    pthread_t *threads = (pthread_t *)calloc(workers, sizeof(pthread_t));
+    if (!threads)
+        return 1;
+
+    int started = 0;
+
+    while (started < workers && pthread_create(&threads[started], NULL, worker_thread, &list) == 0)
+        started++;
+
+    // The files are shared out one at a time, so fewer threads, or none, still profile all of them
+    if (!started)
+        worker_thread(&list);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    tga_metrics total;
+    uint64_t pixels = 0;
+    uint64_t raw_bytes = 0;
+    uint64_t sizes[TYPE_COUNT] = { 0 };
+    bool estimated[TYPE_COUNT];
+    int loaded = 0;
+    int paletted = 0;
+    int alpha[3] = { 0 };
+
+    memset(&total, 0, sizeof(total));
+
+    for (int i = 0; i < TYPE_COUNT; i++)
+        estimated[i] = list.estimate;
+
+    for (int i = 0; i < list.count; i++)
+    {
+        const file_stats *stats = &list.files[i];
+
+        if (!stats->loaded)
+        {
+            fprintf(stderr, "Error: Failed to load %s.\n", stats->path);
+            continue;
+        }
+
+        if (!summary)
+        {
+            print_file(stats);
+
+            if (list.estimate)
+                print_sizes(stats->estimated, stats->sizes, (uint64_t)stats->width * stats->height);
+        }
+
+        loaded++;
+        paletted += stats->colors <= 256;
+        alpha[stats->alpha]++;
+        pixels += (uint64_t)stats->width * stats->height;
+        raw_bytes += (uint64_t)stats->width * stats->height * stats->channels;
+        total.bytes_read += stats->metrics.bytes_read;
+        total.packets += stats->metrics.packets;
+        total.run_pixels += stats->metrics.run_pixels;
+        total.raw_pixels += stats->metrics.raw_pixels;
+
+        for (int j = 0; j < 8; j++)
+        {
+            total.run_lengths[j] += stats->metrics.run_lengths[j];
+            total.raw_lengths[j] += stats->metrics.raw_lengths[j];
+        }
+
+        // A total only makes sense when every file could be stored under the type
+        for (int j = 0; j < TYPE_COUNT; j++)
+        {
+            sizes[j] += stats->sizes[j];
+            estimated[j] = estimated[j] && stats->estimated[j];
+        }
+    }
+
+    printf("Total: %d of %d files, %llu pixels, %llu bytes, %.3f bytes/pixel, %.1f%% of raw\n", loaded, list.count,
+           (unsigned long long)pixels, (unsigned long long)total.bytes_read,
+           pixels ? (double)total.bytes_read / pixels : 0.0, raw_bytes ? 100.0 * total.bytes_read / raw_bytes : 0.0);
+    printf("  %d files fit a palette, alpha: %d none, %d binary, %d blended\n", paletted, alpha[ALPHA_NONE],
+           alpha[ALPHA_BINARY], alpha[ALPHA_BLENDED]);
+
+    if (total.packets)
+        print_packets(&total);
+
+    if (list.estimate)
+        print_sizes(estimated, sizes, pixels);
+
+    free(threads);
+
+    for (int i = 0; i < list.count; i++)
+        free(list.files[i].path);
+
+    free(list.files);
+
+    return loaded == list.count ? 0 : 1;
+}